@@ -30,12 +30,14 @@
  */
 #pragma once
 
+#include <mpi.h>
 #include <mercury.h>
 #include <mercury-progressor/mercury-progressor.h>
 #include <map>
 
 typedef struct nexus_ctx* nexus_ctx_t;
 typedef struct nexus_iter* nexus_iter_t;
+typedef struct nexus_boot* nexus_boot_t;
 
 /* error codes */
 typedef enum {
@@ -47,12 +49,112 @@ typedef enum {
   NX_DESTREP,     /* dest is dstrep */
   NX_INVAL,       /* invalid parameter */
   NX_DONE,        /* already at destination */
+  NX_PENDING,     /* operation not complete yet */
+  NX_GROUPREP,    /* dest is remote group's rep (see NEXUS_GROUP_SIZE) */
+  NX_DIRECT,      /* dest is remote and promoted (see nexus_promote) */
 } nexus_ret_t;
 
+/*
+ * rep selection callback for nexus_set_rep_policy().  return the local
+ * rank (0 .. lsize-1) on node "nodeid" that handles traffic between
+ * nodeid and node "peer".  it must give the same answer on every
+ * process of the node.
+ */
+typedef int (*nexus_rep_fn_t)(void* arg, int nodeid, int lsize, int nnodes,
+                              int peer);
+
+/*
+ * routing counters (see NEXUS_STATS).  hops[] counts nexus_next_hop()
+ * (and _rail/_batch) results by their nexus_ret_t value.
+ */
+#define NEXUS_STATS_NTYPES 16   /* > every nexus_ret_t value */
+
+typedef struct {
+  uint64_t hops[NEXUS_STATS_NTYPES];  /* lookups by return value */
+} nexus_stats_t;
+
+/* one counter summarized over all ranks by nexus_stats_reduce() */
+typedef struct {
+  uint64_t min;     /* smallest value over all ranks */
+  uint64_t max;     /* largest value over all ranks */
+  double avg;       /* mean value over all ranks */
+  int maxrank;      /* lowest rank that has the max value */
+} nexus_stat_range_t;
+
+typedef struct {
+  nexus_stat_range_t hops[NEXUS_STATS_NTYPES];  /* per rank hops[] */
+  nexus_stat_range_t inbound;  /* local hops sent to a rank by its node */
+} nexus_stats_summary_t;
+
+/* bootstrap phases timed by nexus_bootstrap_times() */
+typedef enum {
+  NX_PH_MPISETUP = 0, /* comm split, rank2node, etc. */
+  NX_PH_REPS,         /* rep policy and node groups */
+  NX_PH_LMAP_XCHG,    /* local address exchange over MPI */
+  NX_PH_LMAP_LOOKUP,  /* local HG_Addr_lookup()s */
+  NX_PH_RMAP_XCHG,    /* remote address exchange over MPI */
+  NX_PH_RMAP_LOOKUP,  /* remote HG_Addr_lookup()s */
+  NX_PH_WARMUP,       /* warm up rpcs (see NEXUS_WARMUP) */
+  NX_PH_BARRIER,      /* waiting for everyone's lookups to finish */
+  NX_PH_TOTAL,        /* all of nexus_bootstrap() */
+  NX_NPHASES,
+} nexus_phase_t;
+
+/*
+ * lookup latency histograms are log2 buckets of usec: bucket 0 holds
+ * lookups that took under 1 usec and bucket b > 0 holds the ones that
+ * took [2^(b-1), 2^b) usec (the last bucket also holds anything longer).
+ */
+#define NEXUS_HIST_NBUCKETS 32
+
+typedef struct {
+  double secs[NX_NPHASES];             /* wall clock time per phase */
+  uint64_t lhist[NEXUS_HIST_NBUCKETS]; /* local lookup latencies */
+  uint64_t rhist[NEXUS_HIST_NBUCKETS]; /* remote lookup latencies */
+} nexus_boot_times_t;
+
+/* one peer of a map in a nexus_export() array */
+typedef struct {
+  int grank;        /* global rank (as nexus_iter_globalrank()) */
+  int subrank;      /* 0 or node number (as nexus_iter_subrank()) */
+  hg_addr_t addr;   /* address (HG_ADDR_NULL if lazy and unresolved) */
+  int queue;        /* nexus_partition() queue of the peer */
+  int rail;         /* rail of addr (0 for local maps) */
+} nexus_export_t;
+
+/* a rank that may send to us (see nexus_inbound()) */
+typedef struct {
+  int grank;        /* the sender */
+  nexus_ret_t type; /* sender's next hop type for it (e.g. NX_SRCREP) */
+  int rail;         /* rail it arrives on (-1 for local hops) */
+  int nlinks;       /* remote rep pairs whose traffic it forwards to us */
+} nexus_inbound_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * nexus_set_rep_policy: install a rep selection callback for the next
+ * nexus_bootstrap() calls (NULL reverts to the default policy).  the
+ * NEXUS_REP_POLICY environment variable takes precedence.
+ *
+ * @param fn callback that picks the rep for each remote node
+ * @param arg passed to fn
+ */
+void nexus_set_rep_policy(nexus_rep_fn_t fn, void* arg);
+
+/**
+ * nexus_set_group_key: set this process's topology key (e.g. its rack
+ * or switch name) for the next nexus_bootstrap() calls.  nodes with the
+ * same key form a group and traffic between groups goes through group
+ * reps (NX_GROUPREP hops).  every process on a node must use the same
+ * key.  NULL or "" turns grouping by key off.
+ *
+ * @param key topology key (at most 63 chars are used)
+ */
+void nexus_set_group_key(const char* key);
+
 /**
  * nexus_bootstrap: bootstrap nexus library.  on success nexus will
  * dup the handles to keep a reference to mercury.  a collective call.
@@ -64,6 +166,110 @@ extern "C" {
 nexus_ctx_t nexus_bootstrap(progressor_handle_t *nethand,
                             progressor_handle_t *localhand);
 
+/**
+ * nexus_bootstrap_rails: bootstrap nexus with more than one network
+ * progressor (e.g. one per HCA).  each pair of nodes talks over one
+ * rail per stripe, and both ends of a pair pick the same rail, so rep
+ * traffic is spread evenly across the rails.  rails must be given in
+ * the same order on every process.  a collective call.
+ *
+ * @param nethands progressor handles for network traffic (one per rail)
+ * @param nrails number of handles in nethands (1 .. 8)
+ * @param localhand progressor handle for local traffic (e.g. na+sm)
+ * @return nexus context or NULL on error
+ */
+nexus_ctx_t nexus_bootstrap_rails(progressor_handle_t **nethands, int nrails,
+                                  progressor_handle_t *localhand);
+
+/**
+ * nexus_bootstrap_comm: bootstrap nexus over comm rather than over
+ * MPI_COMM_WORLD (e.g. just an app's I/O procs).  ranks are comm ranks
+ * and the tables are sized by comm, not by the whole job.  nexus runs
+ * its collectives on a dup of comm, so procs outside of comm are never
+ * involved.  if the app already has a comm with its procs on our node
+ * (e.g. from MPI_Comm_split_type()) it may pass it as localcomm to save
+ * nexus a split over comm (nexus copies it in comm rank order, so its
+ * own rank order does not matter).  localcomm may be a subset of the
+ * procs on the node, but it must only have procs that are in comm and
+ * each proc of comm must be in exactly one.  a collective call over
+ * comm.
+ *
+ * @param comm communicator of the procs to route between
+ * @param localcomm node local sub-communicator of comm (or MPI_COMM_NULL)
+ * @param nethands progressor handles for network traffic (one per rail)
+ * @param nrails number of handles in nethands (1 .. 8)
+ * @param localhand progressor handle for local traffic (e.g. na+sm)
+ * @return nexus context or NULL on error
+ */
+nexus_ctx_t nexus_bootstrap_comm(MPI_Comm comm, MPI_Comm localcomm,
+                                 progressor_handle_t **nethands,
+                                 int nrails,
+                                 progressor_handle_t *localhand);
+
+/**
+ * nexus_bootstrap_shared: bootstrap another context (e.g. for a second
+ * service with its own progressors) with the topology of base.  the
+ * rank to node maps, reps and node groups are shared with base rather
+ * than rebuilt, so only the address exchange and lookups are redone.
+ * the shared tables are refcounted, so base may be destroyed before or
+ * after the new context.  NEXUS_STRIPES, NEXUS_REP_POLICY and the node
+ * groups come from base.  a collective call over base's processes.
+ *
+ * @param base context to share the topology of
+ * @param nethands progressor handles for network traffic (one per rail)
+ * @param nrails number of handles in nethands (1 .. 8)
+ * @param localhand progressor handle for local traffic (e.g. na+sm)
+ * @return nexus context or NULL on error
+ */
+nexus_ctx_t nexus_bootstrap_shared(nexus_ctx_t base,
+                                   progressor_handle_t **nethands,
+                                   int nrails,
+                                   progressor_handle_t *localhand);
+
+/**
+ * nexus_bootstrap_start: start bootstrapping nexus in the background
+ * so the app can overlap its own setup with it.  a collective call.
+ * if MPI was initialized with MPI_THREAD_MULTIPLE the bootstrap runs
+ * in a nexus thread on a dup of MPI_COMM_WORLD, so the app may keep
+ * using MPI and mercury while it runs.  every rank must finish the
+ * bootstrap with nexus_bootstrap_test() or nexus_bootstrap_wait().
+ *
+ * limitation: without MPI_THREAD_MULTIPLE (or if the thread can't be
+ * created) there is no overlap.  the bootstrap uses blocking MPI calls
+ * (there is no nonblocking MPI_I* version of it), so this call does
+ * the whole bootstrap before it returns, just like nexus_bootstrap().
+ * nexus_bootstrap_test() and nexus_bootstrap_wait() then return at
+ * once.
+ *
+ * @param nethand progressor handle for network (non-local) traffic
+ * @param localhand progressor handle for local traffic (e.g. na+sm)
+ * @return bootstrap handle or NULL on error
+ */
+nexus_boot_t nexus_bootstrap_start(progressor_handle_t *nethand,
+                                   progressor_handle_t *localhand);
+
+/**
+ * nexus_bootstrap_test: check if a bootstrap is done (non-blocking).
+ * once it returns something other than NX_PENDING the bootstrap handle
+ * is freed and must not be used again.  it never returns NX_PENDING
+ * without MPI_THREAD_MULTIPLE (see nexus_bootstrap_start()).
+ *
+ * @param boot bootstrap handle from nexus_bootstrap_start()
+ * @param nctx nexus context (returned if NX_SUCCESS)
+ * @return NX_PENDING, NX_SUCCESS, or NX_ERROR
+ */
+nexus_ret_t nexus_bootstrap_test(nexus_boot_t boot, nexus_ctx_t *nctx);
+
+/**
+ * nexus_bootstrap_wait: wait for a bootstrap to finish and free the
+ * bootstrap handle.  without MPI_THREAD_MULTIPLE the bootstrap is
+ * already done, so this does not wait (see nexus_bootstrap_start()).
+ *
+ * @param boot bootstrap handle from nexus_bootstrap_start()
+ * @return nexus context or NULL on error
+ */
+nexus_ctx_t nexus_bootstrap_wait(nexus_boot_t boot);
+
 /**
  * Destroys the Nexus library freeing all allocated resources, including
  * freeing its dup'd progressor_handle_t structures.
@@ -72,6 +278,27 @@ nexus_ctx_t nexus_bootstrap(progressor_handle_t *nethand,
  */
 void nexus_destroy(nexus_ctx_t nctx);
 
+/**
+ * Repair the tables after some ranks' mercury endpoints went bad
+ * (collective, every rank must pass the same list).  with "drop" set
+ * the ranks are taken out of the tables: routes to them return
+ * NX_NOTFOUND and the rep pairs they were in move to the next live
+ * local rank on their node (on both ends).  with "drop" clear the ranks
+ * are (back) in and their addresses are looked up again, e.g. after
+ * they restarted their endpoints.  only the entries that involve the
+ * ranks' nodes are touched and each proc only fetches the addresses it
+ * needs, so the cost scales with the number of changed nodes.  other
+ * threads may keep routing while we repair, see the README.
+ *
+ * @param nctx context
+ * @param ranks MPI ranks that changed
+ * @param n number of ranks
+ * @param drop non-zero to take the ranks out, zero to refresh them
+ * @return NX_SUCCESS, NX_INVAL, or NX_ERROR (e.g. a lookup failed)
+ */
+nexus_ret_t nexus_repair(nexus_ctx_t nctx, const int* ranks, int n,
+                         int drop);
+
 /**
  * Returns next Mercury address in route to dest or error
  * @param nexus context
@@ -83,6 +310,145 @@ void nexus_destroy(nexus_ctx_t nctx);
 nexus_ret_t nexus_next_hop(nexus_ctx_t nctx, int dest, int* rank,
                            hg_addr_t* addr);
 
+/**
+ * Same as nexus_next_hop(), but also reports the rail the next hop is
+ * on.  for NX_DESTREP the address belongs to the progressor returned
+ * by nexus_railprogressor(nctx, *rail).  for other hops *rail is -1
+ * (the address is a local one).
+ *
+ * @param nexus context
+ * @param MPI rank of destination
+ * @param MPI rank of next hop (returned)
+ * @param Mercury address of next hop (returned)
+ * @param rail of next hop (returned)
+ * @return NX_SUCCESS or an error code
+ */
+nexus_ret_t nexus_next_hop_rail(nexus_ctx_t nctx, int dest, int* rank,
+                                hg_addr_t* addr, int* rail);
+
+/**
+ * Promote a remote dest to a direct route.  nexus looks up dest's
+ * remote address in the background and once it is resolved,
+ * nexus_next_hop() returns it as an NX_DIRECT hop (on rail 0) rather
+ * than routing through the reps.  direct routes are kept in a cache
+ * of NEXUS_DIRECT entries (0, the default, disables promotion) and the
+ * oldest one that has not been used lately is demoted to make room for
+ * a new one.  an NX_DIRECT address is only valid until its route is demoted,
+ * so dup it if you need to hold on to it.  nexus_partition() puts the
+ * dests with a resolved direct route in their own queue.  may call MPI.
+ *
+ * @param nctx context
+ * @param dest MPI rank of destination (must not be on our node)
+ * @param wholenode if non-zero, promote every rank on dest's node
+ * @return NX_SUCCESS (resolved), NX_PENDING (lookup started or in
+ *         progress), NX_INVAL, or NX_ERROR (e.g. promotion disabled)
+ */
+nexus_ret_t nexus_promote(nexus_ctx_t nctx, int dest, int wholenode);
+
+/**
+ * Demote a dest's direct route back to routing through the reps.
+ *
+ * @param nctx context
+ * @param dest MPI rank of destination
+ * @return NX_SUCCESS or NX_NOTFOUND if dest had no direct route
+ */
+nexus_ret_t nexus_demote(nexus_ctx_t nctx, int dest);
+
+/**
+ * Start resolving the remote addresses we need to route to the nodes
+ * of a set of dests.  only does something with NEXUS_LAZY set, where
+ * the rmap entries are looked up on first use and nexus_next_hop()
+ * returns NX_PENDING for a next hop that is still being looked up.
+ * each process only looks up the entries it holds (i.e. where it is
+ * the srcrep), so every process that will forward to those nodes
+ * should prefetch them.
+ *
+ * @param nctx context
+ * @param dests MPI ranks on the nodes to prefetch
+ * @param n number of dests
+ * @param wait if non-zero, wait for the lookups to finish
+ * @return NX_SUCCESS (all resolved), NX_PENDING (lookups in progress),
+ *         NX_NOTFOUND (a lookup failed), or NX_INVAL
+ */
+nexus_ret_t nexus_prefetch(nexus_ctx_t nctx, const int* dests, int n,
+                           int wait);
+
+/**
+ * Batch version of nexus_next_hop().  Looks up the next hop for each
+ * of the n dests and places the results in ranks[], addrs[], and
+ * types[] (types[i] is what nexus_next_hop() would return for dests[i]).
+ * @param nexus context
+ * @param array of n destination MPI ranks
+ * @param number of entries in the arrays
+ * @param MPI ranks of next hops (returned)
+ * @param Mercury addresses of next hops (returned)
+ * @param per-dest return codes (returned)
+ * @return NX_SUCCESS or NX_INVAL if the arguments are bad
+ */
+nexus_ret_t nexus_next_hop_batch(nexus_ctx_t nctx, const int* dests, int n,
+                                 int* ranks, hg_addr_t* addrs,
+                                 nexus_ret_t* types);
+
+/**
+ * Return the number of queues used by nexus_partition().  Queues
+ * 0 .. lsize-1 are local next hops (by local rank), the following
+ * nnodes * stripes queues are remote next hops (by node id, then by
+ * stripe; see NEXUS_STRIPES).  If direct routes are enabled (see
+ * nexus_promote()) the next queue holds the dests that have one, and
+ * the last queue holds dests that can't be routed.
+ * @param nexus context
+ * @return number of queues
+ */
+int nexus_partition_nqueues(nexus_ctx_t nctx);
+
+/**
+ * Group a batch of dests by their next hop queue (CSR layout).  On
+ * return perm[offsets[q]] .. perm[offsets[q+1]-1] are the indices of
+ * the dests[] entries (in their original order) routed to queue q.
+ * Does not allocate memory.  Dests for which nexus_next_hop() would
+ * return NX_DONE are placed in our own local rank's queue.
+ * @param nexus context
+ * @param array of n destination MPI ranks
+ * @param number of dests
+ * @param offsets array with nexus_partition_nqueues()+1 entries (returned)
+ * @param permutation array with n entries (returned)
+ * @return NX_SUCCESS or NX_INVAL if the arguments are bad
+ */
+nexus_ret_t nexus_partition(nexus_ctx_t nctx, const int* dests, int n,
+                            int* offsets, int* perm);
+
+/**
+ * Return the next hop of one of nexus_partition()'s queues.  Each dest
+ * in the direct route queue is its own next hop, so for it we return
+ * NX_DIRECT with rank -1 and HG_ADDR_NULL (get each dest's address
+ * with nexus_next_hop()).
+ * @param nexus context
+ * @param queue number
+ * @param MPI rank of next hop (returned)
+ * @param Mercury address of next hop (returned)
+ * @return NX_ISLOCAL, NX_DESTREP, NX_DIRECT, or an error code
+ */
+nexus_ret_t nexus_partition_queue(nexus_ctx_t nctx, int q, int* rank,
+                                  hg_addr_t* addr);
+
+/**
+ * List the ranks that may send to us and how, e.g. to size receive
+ * buffers and credits per peer.  There is one entry per sender and hop
+ * type it uses to reach us: the other local ranks (NX_ISLOCAL, and
+ * NX_SRCREP if we are a src rep), then the remote reps (NX_DESTREP or
+ * NX_GROUPREP) whose traffic arrives at us.  A local rank's nlinks is
+ * how many remote rep pairs it forwards traffic from to us (0 if it
+ * only sends its own).  This is computed from the tables without
+ * communication and assumes every rank may send to every other rank.
+ * Direct routes (nexus_promote()) are not included.
+ *
+ * @param nctx context
+ * @param peers filled in with up to n entries (may be NULL if n is 0)
+ * @param n size of peers
+ * @return number of entries
+ */
+int nexus_inbound(nexus_ctx_t nctx, nexus_inbound_t* peers, int n);
+
 /**
  * Blocks until all processes in the global communicator have reached this
  * routine.
@@ -155,6 +521,85 @@ progressor_handle_t *nexus_localprogressor(nexus_ctx_t nctx);
  */
 progressor_handle_t *nexus_remoteprogressor(nexus_ctx_t nctx);
 
+/**
+ * Return the number of remote rails nctx was bootstrapped with.
+ *
+ * @param nctx context
+ */
+int nexus_nrails(nexus_ctx_t nctx);
+
+/**
+ * Return nctx's progressor handle for remote communication on a rail
+ * (rail 0 is the one nexus_remoteprogressor() returns).  result valid
+ * until nexus_destroy() is called.
+ *
+ * @param nctx context
+ * @param rail rail number (0 .. nexus_nrails()-1)
+ * @return progressor handle or NULL if rail is out of range
+ */
+progressor_handle_t *nexus_railprogressor(nexus_ctx_t nctx, int rail);
+
+/**
+ * Get our routing counters.  counting is off unless NEXUS_STATS is set.
+ *
+ * @param nctx context
+ * @param st filled in with our counters
+ * @return NX_SUCCESS or NX_ERROR if counting is off
+ */
+nexus_ret_t nexus_stats(nexus_ctx_t nctx, nexus_stats_t* st);
+
+/**
+ * Get our per next hop counters (NEXUS_STATS=2).  slots are those of
+ * the local or remote map (see nexus_iter()), so local slot i is local
+ * rank i and remote slot j is the rep behind remote iter entry j.
+ *
+ * @param nctx context
+ * @param local non-zero for the local map, zero for the remote map
+ * @param counts filled in with up to n counters (may be NULL if n is 0)
+ * @param n size of counts
+ * @return number of slots in the map or -1 if not counting per slot
+ */
+int nexus_stats_slots(nexus_ctx_t nctx, int local, uint64_t* counts, int n);
+
+/**
+ * Zero our routing counters.  not atomic with respect to concurrent
+ * nexus_next_hop() calls.
+ *
+ * @param nctx context
+ */
+void nexus_stats_reset(nexus_ctx_t nctx);
+
+/**
+ * Summarize routing counters over all ranks.  collective, every rank
+ * must call it.  ranks that are not counting contribute zeros.
+ *
+ * @param nctx context
+ * @param sum filled in on every rank
+ * @return NX_SUCCESS or NX_ERROR
+ */
+nexus_ret_t nexus_stats_reduce(nexus_ctx_t nctx, nexus_stats_summary_t* sum);
+
+/**
+ * Get our bootstrap phase times and address lookup latency histograms.
+ *
+ * @param nctx context
+ * @param bt filled in with our times
+ * @return NX_SUCCESS
+ */
+nexus_ret_t nexus_bootstrap_times(nexus_ctx_t nctx, nexus_boot_times_t* bt);
+
+/**
+ * Write a JSON report of the bootstrap times of all ranks: min, max
+ * (and its rank), avg, and p99 of each phase plus the job wide lookup
+ * latency histograms.  collective, every rank must call it and rank 0
+ * writes the report.  NEXUS_BOOT_REPORT does this during bootstrap.
+ *
+ * @param nctx context
+ * @param outfile output file (NULL means stdout)
+ * @return NX_SUCCESS or NX_ERROR
+ */
+nexus_ret_t nexus_bootstrap_report(nexus_ctx_t nctx, const char* outfile);
+
 /**
  * Dump nexus tables (for debugging)
  *
@@ -215,6 +660,32 @@ int nexus_iter_globalrank(nexus_iter_t nit);
  */
 int nexus_iter_subrank(nexus_iter_t nit);
 
+/**
+ * Return rail of iterator's current address (0 for local maps).
+ *
+ * @param nit iterator handle
+ */
+int nexus_iter_rail(nexus_iter_t nit);
+
+/**
+ * Return a map's peers as a read only array, in the order nexus_iter()
+ * walks them.  This saves an iterator and a call per field per entry
+ * when setting up per peer state, and each peer's queue can be used
+ * with nexus_partition() and nexus_partition_queue().  With NEXUS_LAZY,
+ * remote peers that are not resolved yet are included with a null addr
+ * (nexus_partition_queue() resolves them).  The array is shared and
+ * valid until nexus_destroy().  Calling again fills in lazily resolved
+ * addresses in place (a null addr may become non-null, nothing else in
+ * the array changes) and only returns a new array after nexus_repair()
+ * changed the maps.
+ *
+ * @param nctx context
+ * @param local set non-zero for the local map
+ * @param n number of entries (returned)
+ * @return the array (NULL if the map is empty)
+ */
+const nexus_export_t* nexus_export(nexus_ctx_t nctx, int local, int* n);
+
 #ifdef __cplusplus
 }
 #endif
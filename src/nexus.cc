@@ -30,39 +30,259 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 
 #include "nexus_internal.h"
 
 #define DEFAULT_NX_LIMIT 4   /* default max# pending hg addr lookup req's */
+#define DEFAULT_NX_MAXLIMIT 64 /* default max adaptive lookup window */
+#define DEFAULT_NX_SLOWMS 1000 /* default slow hg addr lookup time (ms) */
+#define DEFAULT_NX_STRIPES 1   /* default rep pairs per node pair */
+#define DEFAULT_NX_DIRECT  0   /* default direct route cache size (off) */
+#define DEFAULT_NX_WARMUP_LIMIT 16  /* default warm up rpcs in flight */
+
+/* group key set by nexus_set_group_key() */
+static char nx_user_groupkey[NX_GROUP_KEYSZ] = "";
+
+/* rep policy callback installed by nexus_set_rep_policy() */
+static nexus_rep_fn_t nx_user_repfn = NULL;
+static void *nx_user_reparg = NULL;
+
+/*
+ * nexus_set_rep_policy: set rep selection callback for next bootstrap
+ */
+void nexus_set_rep_policy(nexus_rep_fn_t fn, void *arg) {
+  nx_user_repfn = fn;
+  nx_user_reparg = arg;
+}
+
+/*
+ * nexus_set_group_key: set topology key for next bootstrap
+ */
+void nexus_set_group_key(const char *key) {
+  snprintf(nx_user_groupkey, sizeof(nx_user_groupkey), "%s",
+           (key) ? key : "");
+}
+
+/*
+ * nexus_boot: state for a split-phase bootstrap.  if we have
+ * MPI_THREAD_MULTIPLE we run nx_bootstrap() in a thread on a dup of
+ * MPI_COMM_WORLD (so our collectives can't get mixed up with the app's).
+ * otherwise nexus_bootstrap_start() does all the work itself.
+ */
+struct nexus_boot {
+  progressor_handle_t *nethand;  /* args for nx_bootstrap() */
+  progressor_handle_t *localhand;
+  MPI_Comm comm;                 /* dup'd comm for the thread */
+  int threaded;                  /* true if we started a thread */
+  pthread_t thread;              /* thread running nx_bootstrap() */
+  std::atomic<int> done;         /* set once nctx is valid */
+  nexus_ctx_t nctx;              /* result (NULL on error) */
+};
+
+/*
+ * nx_boot_main: main routine of bootstrap thread
+ */
+static void *nx_boot_main(void *arg) {
+  struct nexus_boot *boot = (struct nexus_boot *)arg;
+
+  boot->nctx = nx_bootstrap(&boot->nethand, 1, boot->localhand, boot->comm,
+                            1, NULL, MPI_COMM_NULL);
+  boot->done.store(1);
+  return(NULL);
+}
 
 /*
  * nexus_bootstrap: bootstrap nexus library (collective call)
  */
 nexus_ctx_t nexus_bootstrap(progressor_handle_t *nethand,
                             progressor_handle_t *localhand) {
+  return(nx_bootstrap(&nethand, 1, localhand, MPI_COMM_WORLD, 0, NULL,
+                      MPI_COMM_NULL));
+}
+
+/*
+ * nexus_bootstrap_rails: bootstrap with one remote progressor per rail
+ */
+nexus_ctx_t nexus_bootstrap_rails(progressor_handle_t **nethands, int nrails,
+                                  progressor_handle_t *localhand) {
+  return(nx_bootstrap(nethands, nrails, localhand, MPI_COMM_WORLD, 0,
+                      NULL, MPI_COMM_NULL));
+}
+
+/*
+ * nexus_bootstrap_comm: bootstrap on a dup of the app's comm (collective
+ * call over comm)
+ */
+nexus_ctx_t nexus_bootstrap_comm(MPI_Comm comm, MPI_Comm localcomm,
+                                 progressor_handle_t **nethands,
+                                 int nrails,
+                                 progressor_handle_t *localhand) {
+  MPI_Comm dup;
+
+  if (comm == MPI_COMM_NULL) {
+    fprintf(stderr, "nexus_bootstrap_comm: error: null comm\n");
+    return(NULL);
+  }
+  if (MPI_Comm_dup(comm, &dup) != MPI_SUCCESS) {
+    fprintf(stderr, "nexus_bootstrap_comm: comm dup failed\n");
+    return(NULL);
+  }
+  return(nx_bootstrap(nethands, nrails, localhand, dup, 1, NULL, localcomm));
+}
+
+/*
+ * nexus_bootstrap_shared: bootstrap with base's topology (collective
+ * call over base's comm)
+ */
+nexus_ctx_t nexus_bootstrap_shared(nexus_ctx_t base,
+                                   progressor_handle_t **nethands,
+                                   int nrails,
+                                   progressor_handle_t *localhand) {
+  MPI_Comm comm;
+  assert(base != NULL);
+
+  if (MPI_Comm_dup(base->mycomm, &comm) != MPI_SUCCESS) {
+    fprintf(stderr, "nexus_bootstrap_shared: comm dup failed\n");
+    return(NULL);
+  }
+  return(nx_bootstrap(nethands, nrails, localhand, comm, 1, base,
+                      MPI_COMM_NULL));
+}
+
+/*
+ * nexus_bootstrap_start: start a split-phase bootstrap (collective call)
+ */
+nexus_boot_t nexus_bootstrap_start(progressor_handle_t *nethand,
+                                   progressor_handle_t *localhand) {
+  struct nexus_boot *boot;
+  int provided;
+
+  boot = new nexus_boot;
+  boot->nethand = nethand;
+  boot->localhand = localhand;
+  boot->comm = MPI_COMM_NULL;
+  boot->threaded = 0;
+  boot->done = 0;
+  boot->nctx = NULL;
+
+  if (MPI_Query_thread(&provided) == MPI_SUCCESS &&
+      provided == MPI_THREAD_MULTIPLE) {
+    if (MPI_Comm_dup(MPI_COMM_WORLD, &boot->comm) != MPI_SUCCESS) {
+      fprintf(stderr, "nexus_bootstrap_start: comm dup failed\n");
+      delete boot;
+      return(NULL);
+    }
+    if (pthread_create(&boot->thread, NULL, nx_boot_main, boot) == 0) {
+      boot->threaded = 1;
+      return(boot);
+    }
+    fprintf(stderr, "nexus_bootstrap_start: thread create failed\n");
+    nx_boot_main(boot);     /* just do it here */
+    return(boot);
+  }
+
+  boot->nctx = nx_bootstrap(&nethand, 1, localhand, MPI_COMM_WORLD, 0, NULL,
+                            MPI_COMM_NULL);
+  boot->done = 1;
+  return(boot);
+}
+
+/*
+ * nexus_bootstrap_test: see if a split-phase bootstrap is done
+ */
+nexus_ret_t nexus_bootstrap_test(nexus_boot_t boot, nexus_ctx_t *nctx) {
+  assert(boot != NULL);
+  if (!boot->done.load()) return NX_PENDING;
+  *nctx = nexus_bootstrap_wait(boot);
+  return (*nctx) ? NX_SUCCESS : NX_ERROR;
+}
+
+/*
+ * nexus_bootstrap_wait: finish a split-phase bootstrap
+ */
+nexus_ctx_t nexus_bootstrap_wait(nexus_boot_t boot) {
+  nexus_ctx_t nctx;
+
+  assert(boot != NULL);
+  if (boot->threaded)
+    pthread_join(boot->thread, NULL);
+  nctx = boot->nctx;
+  delete boot;
+  return(nctx);
+}
+
+/*
+ * nx_bootstrap: bootstrap nexus on comm with nrails remote handles.  if
+ * dupcomm is set, comm is ours and is freed with the nexus (or on error).
+ * if base is set, we share its topology (and comm is a dup of its).  if
+ * applocal is set, we dup it for our localcomm rather than splitting comm.
+ */
+nexus_ctx_t nx_bootstrap(progressor_handle_t **nethands, int nrails,
+                         progressor_handle_t *localhand, MPI_Comm comm,
+                         int dupcomm, nexus_ctx_t base, MPI_Comm applocal) {
   nexus_ctx_t nctx;
-  char *env;
+  struct nx_snap *snap;
+  char *env, *tabfile;
+  int maxlimit, adaptive, rail, cap, i, stripes, loaded;
+  double tstart, t;
   progressor_handle_t *nasmhand = NULL;  /* used if localhand == NULL */
   hg_class_t *nasmcls = NULL;
   hg_context_t *nasmctx = NULL;
 
   /*
-   * sanity check args: both nethand and localhand must be in listen mode
+   * sanity check args: nethands and localhand must be in listen mode
    */
-  if (!HG_Class_is_listening(mercury_progressor_hgclass(nethand)) ||
-      (localhand &&
-       !HG_Class_is_listening(mercury_progressor_hgclass(localhand))) ) {
+  if (nrails < 1 || nrails > NX_MAX_RAILS) {
+    fprintf(stderr, "nexus_bootstrap: error: bad number of rails %d\n",
+            nrails);
+    if (dupcomm) MPI_Comm_free(&comm);
+    return(NULL);
+  }
+  for (rail = 0 ; rail < nrails ; rail++) {
+    if (!HG_Class_is_listening(mercury_progressor_hgclass(nethands[rail])))
+      break;
+  }
+  if (rail < nrails || (localhand &&
+      !HG_Class_is_listening(mercury_progressor_hgclass(localhand))) ) {
     fprintf(stderr, "nexus_bootstrap: error: handles not listening\n");
+    if (dupcomm) MPI_Comm_free(&comm);
     return(NULL);
   }
 
   nctx = new nexus_ctx;   /* c++ malloc+init here */
+  nctx->mycomm = comm;
+  nctx->dupcomm = dupcomm;
+  nctx->applocal = applocal;
+  nctx->xchg = NX_XCHG_MPI;
   nctx->local2global = NULL;
   nctx->rank2node = NULL;
+  nctx->r2n.kind = NX_R2N_DENSE;
+  nctx->r2n.runstart = NULL;
   nctx->node2rep = NULL;
+  nctx->node2srcrep = NULL;
+  nctx->snap = NULL;
+  pthread_mutex_init(&nctx->snaplock, NULL);
+  nctx->direct = NULL;
+  nctx->ndirect = 0;
+  nctx->stats = NULL;
+  nctx->lazy = NULL;
+  nctx->repair = NULL;
+  for (i = 0 ; i < NX_NPHASES ; i++)
+    nctx->ptime[i] = 0;
+  for (i = 0 ; i < NEXUS_HIST_NBUCKETS ; i++)
+    nctx->lhist[i] = nctx->rhist[i] = 0;
+  nctx->grp.ngroups = 1;
+  nctx->grp.node2group = nctx->grp.gstart = nctx->grp.gnodes = NULL;
+  nctx->shmwin = MPI_WIN_NULL;
+  nctx->shmbase = NULL;
+  nctx->tabmap[0] = nctx->tabmap[1] = NULL;
+  nctx->topo = NULL;
   nctx->localcomm = MPI_COMM_NULL;
   nctx->repcomm = MPI_COMM_NULL;
-  nctx->hg_remote = NULL;
+  for (rail = 0 ; rail < NX_MAX_RAILS ; rail++)
+    nctx->hg_rail[rail] = NULL;
+  nctx->nrails = nrails;
   nctx->hg_local = NULL;
   nctx->internal_local = 0;
   /* now safe to call nx_destroy() on nctx if there is an error */
@@ -76,6 +296,70 @@ nexus_ctx_t nexus_bootstrap(progressor_handle_t *nethand,
       nctx->nx_limit = 1;
     }
   }
+  env = getenv("NEXUS_LOOKUP_MAXLIMIT");
+  maxlimit = (env && env[0]) ? atoi(env) : DEFAULT_NX_MAXLIMIT;
+  env = getenv("NEXUS_LOOKUP_ADAPT");
+  adaptive = (env && env[0]) ? atoi(env) : 1;
+  nx_win_init(&nctx->lwin, nctx->nx_limit, maxlimit, adaptive);
+  nx_win_init(&nctx->rwin, nctx->nx_limit, maxlimit, adaptive);
+  env = getenv("NEXUS_LOOKUP_SLOW_MS");
+  nctx->nx_slowms = (env && env[0]) ? atoi(env) : DEFAULT_NX_SLOWMS;
+  if (nctx->nx_slowms <= 0)
+    nctx->nx_slowms = DEFAULT_NX_SLOWMS;
+  env = getenv("NEXUS_STRIPES");
+  nctx->nstripes = (env && env[0]) ? atoi(env) : DEFAULT_NX_STRIPES;
+  if (nctx->nstripes < 1)
+    nctx->nstripes = 1;
+  snprintf(nctx->groupkey, sizeof(nctx->groupkey), "%s", nx_user_groupkey);
+  env = getenv("NEXUS_GROUP_HOSTCHARS");
+  nctx->grouphost = (env && env[0]) ? atoi(env) : 0;
+  env = getenv("NEXUS_GROUP_SIZE");
+  nctx->groupsize = (env && env[0]) ? atoi(env) : 0;
+  env = getenv("NEXUS_WARMUP");
+  nctx->warmup = (env && atoi(env) > 0);
+  env = getenv("NEXUS_WARMUP_LIMIT");
+  nctx->warmup_limit = (env && env[0]) ? atoi(env) : DEFAULT_NX_WARMUP_LIMIT;
+  if (nctx->warmup_limit <= 0)
+    nctx->warmup_limit = 1;
+  env = getenv("NEXUS_SHM_TABLES");
+  nctx->shm_tables = (env && atoi(env) > 0);
+  env = getenv("NEXUS_LAZY");
+  nctx->lazy_rmap = (env && atoi(env) > 0);
+  nctx->rep.fn = nx_user_repfn;
+  nctx->rep.arg = nx_user_reparg;
+  nctx->rep.policy = (nx_user_repfn) ? NX_REP_USER : NX_REP_MODULO;
+  env = getenv("NEXUS_REP_POLICY");
+  if (env && env[0]) {
+    nctx->rep.policy = nx_rep_policy_byname(env);
+    if (nctx->rep.policy == NX_REP_USER && !nx_user_repfn)
+      nctx->rep.policy = -1;
+    if (nctx->rep.policy < 0) {
+      fprintf(stderr, "nexus_bootstrap: bad NEXUS_REP_POLICY %s\n", env);
+      goto error;
+    }
+  }
+  env = getenv("NEXUS_ADDR_XCHG");
+  if (env && env[0]) {
+    if (strcmp(env, "mpi") == 0) {
+      nctx->xchg = NX_XCHG_MPI;
+    } else if (strcmp(env, "rma") == 0) {
+      nctx->xchg = NX_XCHG_RMA;
+#ifdef NEXUS_PMIX
+    } else if (strcmp(env, "pmix") == 0) {
+      nctx->xchg = NX_XCHG_PMIX;
+#endif
+    } else {
+      fprintf(stderr, "nexus_bootstrap: bad NEXUS_ADDR_XCHG %s\n", env);
+      goto error;
+    }
+  }
+  tabfile = getenv("NEXUS_TABLE_CACHE");    /* can't tell if fn changed */
+  if (!tabfile || !tabfile[0] || nctx->rep.policy == NX_REP_USER || base)
+    tabfile = NULL;
+  /* the cache is for the whole job, sub comms would fight over it */
+  if (tabfile && (MPI_Comm_compare(comm, MPI_COMM_WORLD, &i) != MPI_SUCCESS ||
+                  (i != MPI_IDENT && i != MPI_CONGRUENT)))
+    tabfile = NULL;
 
   /*
    * if we are not given a local handle, we default to generating
@@ -99,18 +383,41 @@ nexus_ctx_t nexus_bootstrap(progressor_handle_t *nethand,
   }
 
   /*
-   * install our comm and do our MPI setup
+   * do our MPI setup (on mycomm)
    */
-  nctx->mycomm = MPI_COMM_WORLD;   /* don't hardwire it, may change later */
-  if (nx_mpisetup(nctx) < 0)
+  tstart = t = MPI_Wtime();
+  stripes = nctx->nstripes;             /* before nx_mpisetup() limits it */
+  if (base)                             /* topology is base's */
+    loaded = (nx_topo_share(nctx, base) < 0) ? -1 : 1;
+  else
+    loaded = (tabfile) ? nx_tabfile_load(nctx, tabfile) : 0;
+  if (loaded < 0 || (!loaded && nx_mpisetup(nctx) < 0))
     goto error;
+  t = nx_phase_end(nctx, NX_PH_MPISETUP, t);
 
   /*
-   * install progress handles
+   * optionally group nodes (e.g. by rack) to limit remote peers
+   */
+  if (!loaded && nx_build_groups(nctx) < 0)
+    goto error;
+
+  /*
+   * pick our reps for each remote node using the rep policy (balanced
+   * needs the groups)
    */
-  if ((nctx->hg_remote = mercury_progressor_duphandle(nethand)) == NULL) {
-    fprintf(stderr, "nexus_bootstrap: error: duphandle nethand failed\n");
+  if (!loaded && nx_build_reps(nctx) < 0)
     goto error;
+  nx_phase_end(nctx, NX_PH_REPS, t);
+
+  /*
+   * install progress handles
+   */
+  for (rail = 0 ; rail < nrails ; rail++) {
+    nctx->hg_rail[rail] = mercury_progressor_duphandle(nethands[rail]);
+    if (nctx->hg_rail[rail] == NULL) {
+      fprintf(stderr, "nexus_bootstrap: error: duphandle nethand failed\n");
+      goto error;
+    }
   }
   if (nasmhand) {
     nctx->hg_local = nasmhand;  /* transfer ownership to nctx */
@@ -123,6 +430,12 @@ nexus_ctx_t nexus_bootstrap(progressor_handle_t *nethand,
     }
   }
 
+  /*
+   * register the warm up rpc before anyone can see our addresses
+   */
+  if (nctx->warmup && nx_warmup_register(nctx) < 0)
+    goto error;
+
   /*
    * build lmap: maps local per global rank to peer's local address
    */
@@ -130,18 +443,89 @@ nexus_ctx_t nexus_bootstrap(progressor_handle_t *nethand,
     goto error;
 
   if (!nctx->grank)
-    fprintf(stdout, "NX: LOCAL %s (NX-LIMIT=%d)\n",
+    fprintf(stdout, "NX: LOCAL %s (NX-LIMIT=%d, WINDOW=%d)\n",
             (mercury_progressor_hgcontext(nctx->hg_local) !=
-             mercury_progressor_hgcontext(nctx->hg_remote)) ? "DONE"
+             mercury_progressor_hgcontext(nctx->hg_rail[0])) ? "DONE"
                                                             : "VIA REMOTE",
-             nctx->nx_limit);
+             nctx->nx_limit, nctx->lwin.limit.load());
 
   /*
    * build rmap: maps remote node number to its rep's remote address.
    */
   if (nx_build_rmap(nctx) < 0)
     goto error;
-  if (!nctx->grank) fprintf(stdout, "NX: REMOTE DONE\n");
+  if (tabfile && !loaded)               /* for the next bootstrap */
+    nx_tabfile_save(nctx, tabfile, stripes);
+  if (!nctx->grank && nctx->nrails == 1)
+    fprintf(stdout, "NX: REMOTE DONE (WINDOW=%d)\n", nctx->rwin.limit.load());
+  else if (!nctx->grank)
+    fprintf(stdout, "NX: REMOTE DONE (RAILS=%d, WINDOW=%d)\n",
+            nctx->nrails, nctx->rwin.limit.load());
+
+  /*
+   * optionally connect to our peers now rather than on first use
+   */
+  if (nctx->warmup) {
+    double wstart = MPI_Wtime(), wtime;
+    int nrpcs = nx_warmup(nctx), total = 0;
+    wtime = MPI_Wtime() - wstart;
+    nctx->ptime[NX_PH_WARMUP] = wtime;
+    if (MPI_Reduce(&nrpcs, &total, 1, MPI_INT, MPI_SUM, 0,
+                   nctx->mycomm) != MPI_SUCCESS ||
+        MPI_Reduce((nctx->grank) ? &wtime : MPI_IN_PLACE, &wtime, 1,
+                   MPI_DOUBLE, MPI_MAX, 0, nctx->mycomm) != MPI_SUCCESS) {
+      fprintf(stderr, "nexus_bootstrap: warm up reduce failed\n");
+      goto error;
+    }
+    if (!nctx->grank)
+      fprintf(stdout, "NX: WARMUP DONE (RPCS=%d, %.3f ms)\n", total,
+              wtime * 1000.0);
+  }
+
+  /*
+   * wait for everyone's lookups to finish and then idle mercury
+   */
+  t = MPI_Wtime();
+  if (nx_bootstrap_done(nctx) < 0)
+    goto error;
+  nx_phase_end(nctx, NX_PH_BARRIER, t);
+
+  /*
+   * move the tables to the first snap, optionally precomputing the next
+   * hop for every dest rank so that nexus_next_hop() is a single table
+   * load, and publish it.
+   */
+  if ((snap = nx_snap_new(nctx)) == NULL)
+    goto error;
+  env = getenv("NEXUS_ROUTE_TABLE");
+  if (env && atoi(env) > 0 && nx_build_rtab(nctx, snap) < 0) {
+    nx_snap_abort(nctx, snap);
+    goto error;
+  }
+  nx_snap_publish(nctx, snap);
+
+  /*
+   * optionally allow promoting dests to direct routes
+   */
+  env = getenv("NEXUS_DIRECT");
+  cap = (env && env[0]) ? atoi(env) : DEFAULT_NX_DIRECT;
+  if (cap > 0 && nctx->nnodes > 1 && nx_direct_init(nctx, cap) < 0)
+    goto error;
+
+  /*
+   * optionally count next hop lookups (2 adds per next hop counts)
+   */
+  env = getenv("NEXUS_STATS");
+  if (env && atoi(env) > 0 && nx_stats_init(nctx, atoi(env)) < 0)
+    goto error;
+  nx_phase_end(nctx, NX_PH_TOTAL, tstart);
+
+  /*
+   * optionally report bootstrap times ("-" for stdout)
+   */
+  env = getenv("NEXUS_BOOT_REPORT");
+  if (env && env[0])     /* not fatal, the report is only a diagnostic */
+    nexus_bootstrap_report(nctx, strcmp(env, "-") ? env : NULL);
 
   /*
    * done!
@@ -152,8 +536,8 @@ nexus_ctx_t nexus_bootstrap(progressor_handle_t *nethand,
   return(nctx);
 
 error:
-  if (nasmhand) mercury_progressor_freehandle(nasmhand);
-  if (localhand == NULL && nctx->internal_local) {
+  if (nasmhand) {   /* na+sm instance not yet owned by nctx->hg_local */
+    mercury_progressor_freehandle(nasmhand);
     HG_Context_destroy(nasmctx);
     HG_Finalize(nasmcls);
   }
@@ -169,59 +553,222 @@ void nexus_destroy(nexus_ctx_t nctx) {
 }
 
 /*
- * nx_addr_get: private utility function for nexus_next_hop.  get address
- * or return HG_ADDR_NULL if no address found.
+ * nx_route: compute next hop info from snap s's maps (used by
+ * nexus_next_hop when we don't have a route table, and to fill in the
+ * route table).  nx_rv_step() picks the hop, we add its address.  if
+ * lookup is zero we don't start lazy lookups, an rmap addr that isn't
+ * resolved yet is NX_NOTFOUND.
  */
-namespace {
-hg_addr_t nx_addr_get(nexus_map_t* map, int key) {
-  nexus_map_t::iterator it = map->find(key);
-  return (it == map->end()) ? HG_ADDR_NULL : it->second;
+nexus_ret_t nx_route(nexus_ctx_t nctx, const struct nx_snap* s, int dest,
+                     int* rank, hg_addr_t* addr, int* rail, int lookup) {
+  const struct nx_rview rv = nx_rview_snap(nctx, s);
+  int hop, next, slot;
+  nexus_ret_t ret;
+
+  hop = nx_rv_step(&rv, dest, &next, &slot);
+#ifdef NEXUS_DEBUG
+  fprintf(stderr, "NX-%d: dest=%d, hop=%d, next=%d, slot=%d\n",
+          s->grank, dest, hop, next, slot);
+#endif
+
+  switch (hop) {
+    case NX_HOP_DONE:       /* we are the final hop */
+      return NX_DONE;
+    case NX_HOP_LOCAL:      /* we are the original src, or a dest rep */
+    case NX_HOP_SRCREP:     /* we are the original src */
+      *addr = s->lmap[slot].addr;
+      if (*addr == HG_ADDR_NULL) return NX_NOTFOUND;
+      *rank = next;
+      return (hop == NX_HOP_LOCAL) ? NX_ISLOCAL : NX_SRCREP;
+    default:                /* we are the src rep (or our group's rep) */
+      *addr = s->rmap[slot].addr;
+      *rank = next;
+      *rail = s->rmap[slot].rail;
+      if (*addr == HG_ADDR_NULL) {   /* not resolved yet if lazy */
+        if (nctx->lazy == NULL) return NX_NOTFOUND;
+        if (!lookup) {
+          *addr = nx_lazy_peek(nctx, slot);
+          if (*addr == HG_ADDR_NULL) return NX_NOTFOUND;
+        } else if ((ret = nx_lazy_get(nctx, slot, addr)) != NX_SUCCESS) {
+          return ret;
+        }
+      }
+      return (hop == NX_HOP_GROUPREP) ? NX_GROUPREP : NX_DESTREP;
+  }
 }
-}  // namespace
 
 /*
  * nexus_next_hop: lookup next hop info in nexus
  */
 nexus_ret_t nexus_next_hop(nexus_ctx_t nctx, int dest, int* rank,
                            hg_addr_t* addr) {
-  int srcrep, destrep;
-  int destn;
+  int rail;
+
+  return nexus_next_hop_rail(nctx, dest, rank, addr, &rail);
+}
+
+/*
+ * nexus_next_hop_rail: lookup next hop info and its rail in nexus
+ */
+nexus_ret_t nexus_next_hop_rail(nexus_ctx_t nctx, int dest, int* rank,
+                                hg_addr_t* addr, int* rail) {
+  const struct nx_snap* s;
+  const nexus_route_t* rt;
+  nexus_ret_t ret;
   assert(nctx != NULL);
 
-  /* stop here if we are the final hop */
-  if (nctx->grank == dest) return NX_DONE;
+  *rail = -1;
+  if (dest < 0 || dest >= nctx->gsize) {
+    ret = NX_INVAL;
+  } else {
+    s = nx_snap_enter(nctx);        /* also protects direct route addrs */
+    if (nctx->ndirect.load(std::memory_order_relaxed) > 0 &&
+        nx_direct_get(nctx, dest, addr) == 0) {
+      *rank = dest;
+      *rail = 0;
+      ret = NX_DIRECT;
+    } else if (s->rtab == NULL) {
+      ret = nx_route(nctx, s, dest, rank, addr, rail, 1);
+    } else {
+      rt = &s->rtab[dest];
+      *rank = rt->rank;
+      *addr = rt->addr;
+      *rail = rt->rail;
+      ret = (nexus_ret_t)rt->type;
+      if (ret == NX_NOTFOUND && nctx->lazy)   /* may be resolved by now */
+        ret = nx_route(nctx, s, dest, rank, addr, rail, 1);
+    }
+    nx_snap_exit();
+  }
+
+  if (nctx->stats) nx_stats_count(nctx, ret, dest, *rank);
+  return ret;
+}
 
-  /* if dest is local we return its local address */
-  if ((*addr = nx_addr_get(&nctx->lmap, dest)) != HG_ADDR_NULL) {
-    *rank = dest; /* the next stop is the final dest */
-    /* we are either the original src, or a dest rep */
-    return NX_ISLOCAL;
+/*
+ * nx_batch_finish: switch dests in a batch that have a resolved direct
+ * route over to it (as nexus_next_hop() would), leave the batch's snap
+ * and count the results
+ */
+static nexus_ret_t nx_batch_finish(nexus_ctx_t nctx, const int* dests, int n,
+                                   int* ranks, hg_addr_t* addrs,
+                                   nexus_ret_t* types) {
+  int i;
+
+  if (nctx->ndirect.load(std::memory_order_relaxed) > 0) {
+    for (i = 0 ; i < n ; i++) {
+      if (types[i] != NX_INVAL && types[i] != NX_DONE &&
+          types[i] != NX_ISLOCAL &&
+          nx_direct_get(nctx, dests[i], &addrs[i]) == 0) {
+        ranks[i] = dests[i];
+        types[i] = NX_DIRECT;
+      }
+    }
+  }
+  nx_snap_exit();
+  if (nctx->stats) {
+    for (i = 0 ; i < n ; i++)
+      nx_stats_count(nctx, types[i], dests[i], ranks[i]);
   }
+  return NX_SUCCESS;
+}
 
-  /* dest >> dest node */
-  destn = nctx->rank2node[dest];
-  /* dest node >> src rep's global rank */
-  srcrep = nctx->local2global[(destn % nctx->lsize)];
-  /* dest node >> dest rep's global rank */
-  destrep = nctx->node2rep[destn];
-#ifdef NEXUS_DEBUG
-  fprintf(stderr, "NX-%d: dest=%d, destnode=%d, srcrep=%d, destrep=%d\n",
-          nctx->grank, dest, destn, srcrep, destrep);
-#endif
+/*
+ * nexus_next_hop_batch: lookup next hop info for an array of dests.
+ * we build one routing view for the batch, classify the whole batch
+ * with it (topology arithmetic only, no map or lazy lookups) and then
+ * make a second pass to fill in the ranks and addresses.  the classify
+ * pass still branches on the rank2node kind and on groups, so it is
+ * not vectorized, but it keeps the map loads out of the first pass.
+ */
+nexus_ret_t nexus_next_hop_batch(nexus_ctx_t nctx, const int* dests, int n,
+                                 int* ranks, hg_addr_t* addrs,
+                                 nexus_ret_t* types) {
+  int grank, gsize, nodeid, i, slot, rail;
+  const struct nx_snap* s;
+  struct nx_rview rv;
+  const int *l2g;
+  nexus_ret_t ret;
+  assert(nctx != NULL);
 
-  if (nctx->grank != srcrep) {
-    *addr = nx_addr_get(&nctx->lmap, srcrep);
-    if (*addr == HG_ADDR_NULL) return NX_NOTFOUND;
-    *rank = srcrep; /* the next stop is src rep */
-    /* we are the original src */
-    return NX_SRCREP;
-  } else {
-    *addr = nx_addr_get(&nctx->rmap, destn);
-    if (*addr == HG_ADDR_NULL) return NX_NOTFOUND;
-    *rank = destrep; /* the next stop is dest rep */
-    /* we are the src rep */
-    return NX_DESTREP;
+  gsize = nctx->gsize;
+  nodeid = nctx->nodeid;
+  l2g = nctx->local2global;
+
+  if (n < 0 || (n > 0 && (!dests || !ranks || !addrs || !types)))
+    return NX_INVAL;
+
+  s = nx_snap_enter(nctx);          /* one snap for the whole batch */
+  grank = s->grank;
+  rv = nx_rview_snap(nctx, s);
+  if (s->rtab) {
+    for (i = 0 ; i < n ; i++) {
+      const int d = dests[i];
+      if (d < 0 || d >= gsize) {
+        types[i] = NX_INVAL;
+        continue;
+      }
+      ranks[i] = s->rtab[d].rank;
+      addrs[i] = s->rtab[d].addr;
+      types[i] = (nexus_ret_t)s->rtab[d].type;
+      if (types[i] == NX_NOTFOUND && nctx->lazy)
+        types[i] = nx_route(nctx, s, d, &ranks[i], &addrs[i], &rail, 1);
+    }
+    return nx_batch_finish(nctx, dests, n, ranks, addrs, types);
+  }
+
+  /*
+   * pass 1: classify (ranks[] holds the node we route towards for
+   * remote dests, see nx_group_hop())
+   */
+  for (i = 0 ; i < n ; i++) {
+    const int d = dests[i];
+    const int valid = (d >= 0) & (d < gsize);
+    const int dnode = nx_rv_rank2node(&rv, valid ? d : 0);
+    const int stripe = nx_rv_stripe(&rv, valid ? d : 0);
+    int destn, srcrep, viagroup = 0, t;
+
+    destn = (dnode == nodeid) ? dnode : nx_rv_group_hop(&rv, dnode, &viagroup);
+    srcrep = l2g[nx_rv_srcrep_slot(&rv, destn, stripe)];
+    t = (viagroup) ? NX_GROUPREP : NX_DESTREP;
+    t = (srcrep == grank) ? t : NX_SRCREP;
+    t = (dnode == nodeid) ? NX_ISLOCAL : t;
+    t = (d == grank) ? NX_DONE : t;
+    types[i] = (nexus_ret_t)(valid ? t : NX_INVAL);
+    ranks[i] = destn;
   }
+
+  /* pass 2: resolve next hop rank and address */
+  for (i = 0 ; i < n ; i++) {
+    switch (types[i]) {
+      case NX_ISLOCAL:
+        slot = nx_rv_lmap_slot(&rv, dests[i]);
+        addrs[i] = (slot != -1) ? s->lmap[slot].addr : HG_ADDR_NULL;
+        ranks[i] = dests[i];
+        break;
+      case NX_SRCREP:
+        slot = nx_rv_srcrep_slot(&rv, ranks[i], nx_rv_stripe(&rv, dests[i]));
+        addrs[i] = s->lmap[slot].addr;
+        ranks[i] = l2g[slot];
+        break;
+      case NX_DESTREP:
+      case NX_GROUPREP:
+        slot = ranks[i] * nctx->nstripes + nx_rv_stripe(&rv, dests[i]);
+        addrs[i] = s->rmap[slot].addr;
+        ranks[i] = s->node2rep[slot];
+        if (addrs[i] == HG_ADDR_NULL && nctx->lazy &&
+            (ret = nx_lazy_get(nctx, slot, &addrs[i])) != NX_NOTFOUND) {
+          if (ret == NX_PENDING) types[i] = NX_PENDING;
+          continue;
+        }
+        break;
+      default:
+        continue;
+    }
+    if (addrs[i] == HG_ADDR_NULL) types[i] = NX_NOTFOUND;
+  }
+
+  return nx_batch_finish(nctx, dests, n, ranks, addrs, types);
 }
 
 nexus_ret_t nexus_global_barrier(nexus_ctx_t nctx) {
@@ -232,8 +779,12 @@ nexus_ret_t nexus_global_barrier(nexus_ctx_t nctx) {
 }
 
 int nexus_global_rank(nexus_ctx_t nctx) {
+  int rank;
   assert(nctx != NULL);
-  return nctx->grank;
+
+  rank = nx_snap_enter(nctx)->grank;  /* may be nexus_set_grank()'s */
+  nx_snap_exit();
+  return rank;
 }
 
 int nexus_global_size(nexus_ctx_t nctx) {
@@ -258,8 +809,22 @@ int nexus_local_size(nexus_ctx_t nctx) {
   return nctx->lsize;
 }
 
+/*
+ * nexus_set_grank: route as another rank.  readers don't lock, so the
+ * new rank goes in a new snap (with its route table rebuilt, since
+ * routes depend on it) rather than in nctx.
+ */
 nexus_ret_t nexus_set_grank(nexus_ctx_t nctx, int rank) {
-  nctx->grank = rank;
+  struct nx_snap *s;
+
+  if ((s = nx_snap_new(nctx)) == NULL)
+    return NX_ERROR;
+  s->grank = rank;
+  if (s->rtab && nx_build_rtab(nctx, s) < 0) {
+    nx_snap_abort(nctx, s);
+    return NX_ERROR;
+  }
+  nx_snap_publish(nctx, s);
   return NX_SUCCESS;
 }
 
@@ -270,18 +835,31 @@ progressor_handle_t *nexus_localprogressor(nexus_ctx_t nctx) {
 
 progressor_handle_t *nexus_remoteprogressor(nexus_ctx_t nctx) {
   assert(nctx != NULL);
-  return nctx->hg_remote;
+  return nctx->hg_rail[0];
+}
+
+int nexus_nrails(nexus_ctx_t nctx) {
+  assert(nctx != NULL);
+  return nctx->nrails;
+}
+
+progressor_handle_t *nexus_railprogressor(nexus_ctx_t nctx, int rail) {
+  assert(nctx != NULL);
+  if (rail < 0 || rail >= nctx->nrails) return NULL;
+  return nctx->hg_rail[rail];
 }
 
 /*
  * nexus_dump: dump nexus tables to stderr or files
  */
 void nexus_dump(nexus_ctx_t nctx, char *outfile) {
+  const struct nx_snap *s;
+  hg_addr_t a;
   char *fname, *addr;
   int fnamelen, lcv;
   hg_size_t addr_alloc_sz, sz;
   FILE *fp;
-  nexus_map_t::iterator it;
+  size_t slot;
   hg_class_t *cls;
   hg_return_t hret;
 
@@ -304,9 +882,10 @@ void nexus_dump(nexus_ctx_t nctx, char *outfile) {
     if (fname) free(fname);
     return;
   }
+  s = nx_snap_enter(nctx);
 
   if (outfile) {
-    snprintf(fname, fnamelen, "%s.%d.id", outfile, nctx->grank);
+    snprintf(fname, fnamelen, "%s.%d.id", outfile, s->grank);
     fp = fopen(fname, "w");
     if (!fp) {
       perror("nexus_dump");
@@ -316,27 +895,27 @@ void nexus_dump(nexus_ctx_t nctx, char *outfile) {
     fp = stderr;
   }
 
-  fprintf(fp, "NX-%d: %d %d %d %d %d %d\n", nctx->grank, nctx->grank,
+  fprintf(fp, "NX-%d: %d %d %d %d %d %d\n", s->grank, s->grank,
           nctx->gsize, nctx->lrank, nctx->lsize, nctx->nodeid,
           nctx->nnodes);
-  fprintf(fp, "NX-%d: local %s\n", nctx->grank,
+  fprintf(fp, "NX-%d: local %s\n", s->grank,
           mercury_progressor_addrstring(nctx->hg_local));
-  fprintf(fp, "NX-%d: remote %s\n", nctx->grank,
-          mercury_progressor_addrstring(nctx->hg_remote));
-  fprintf(fp, "NX-%d: grank2node", nctx->grank);
+  fprintf(fp, "NX-%d: remote %s\n", s->grank,
+          mercury_progressor_addrstring(nctx->hg_rail[0]));
+  fprintf(fp, "NX-%d: grank2node", s->grank);
   for (lcv = 0 ; lcv < nctx->gsize ; lcv++) {
-    fprintf(fp, " %d", nctx->rank2node[lcv]);
+    fprintf(fp, " %d", nx_rank2node(nctx, lcv));
   }
   fprintf(fp, "\n");
-  fprintf(fp, "NX-%d: local2global", nctx->grank);
+  fprintf(fp, "NX-%d: local2global", s->grank);
   for (lcv = 0 ; lcv < nctx->lsize ; lcv++) {
     fprintf(fp, " %d", nctx->local2global[lcv]);
   }
   fprintf(fp, "\n");
-  fprintf(fp, "NX-%d: node2rep", nctx->grank);
-  if (nctx->node2rep) {
-    for (lcv = 0 ; lcv < nctx->nnodes ; lcv++) {
-      fprintf(fp, " %d", nctx->node2rep[lcv]);
+  fprintf(fp, "NX-%d: node2rep", s->grank);
+  if (s->node2rep) {
+    for (lcv = 0 ; lcv < nctx->nnodes * nctx->nstripes ; lcv++) {
+      fprintf(fp, " %d", s->node2rep[lcv]);
     }
   }
   fprintf(fp, "\n");
@@ -345,7 +924,7 @@ void nexus_dump(nexus_ctx_t nctx, char *outfile) {
     fclose(fp);
 
   if (outfile) {
-    snprintf(fname, fnamelen, "%s.%d.lmap", outfile, nctx->grank);
+    snprintf(fname, fnamelen, "%s.%d.lmap", outfile, s->grank);
     fp = fopen(fname, "w");
     if (!fp) {
       perror("nexus_dump");
@@ -356,18 +935,19 @@ void nexus_dump(nexus_ctx_t nctx, char *outfile) {
   }
 
   cls = mercury_progressor_hgclass(nctx->hg_local);
-  it = nctx->lmap.begin();
-  for (; it != nctx->lmap.end(); ++it) {
+  for (slot = 0 ; slot < s->lmap.size() ; slot++) {
+    if (s->lmap[slot].addr == HG_ADDR_NULL) continue;
     sz = addr_alloc_sz;
-    hret = HG_Addr_to_string(cls, addr, &sz, it->second);
+    hret = HG_Addr_to_string(cls, addr, &sz, s->lmap[slot].addr);
     if (hret != HG_SUCCESS) strcpy(addr, "n/a");
-    fprintf(fp, "NX-%d: lmap %d %s\n", nctx->grank, it->first, addr);
+    fprintf(fp, "NX-%d: lmap %d %s\n", s->grank, s->lmap[slot].grank,
+            addr);
   }
   if (fp != stderr)
     fclose(fp);
 
   if (outfile) {
-    snprintf(fname, fnamelen, "%s.%d.rmap", outfile, nctx->grank);
+    snprintf(fname, fnamelen, "%s.%d.rmap", outfile, s->grank);
     fp = fopen(fname, "w");
     if (!fp) {
       perror("nexus_dump");
@@ -377,19 +957,26 @@ void nexus_dump(nexus_ctx_t nctx, char *outfile) {
     fp = stderr;
   }
 
-  cls = mercury_progressor_hgclass(nctx->hg_remote);
-  it = nctx->rmap.begin();
-  for (; it != nctx->rmap.end(); ++it) {
+  for (slot = 0 ; slot < s->rmap.size() ; slot++) {
+    a = s->rmap[slot].addr;
+    if (a == HG_ADDR_NULL && nctx->lazy) a = nx_lazy_peek(nctx, slot);
+    if (a == HG_ADDR_NULL) continue;
+    cls = mercury_progressor_hgclass(nctx->hg_rail[s->rmap[slot].rail]);
     sz = addr_alloc_sz;
-    hret = HG_Addr_to_string(cls, addr, &sz, it->second);
+    hret = HG_Addr_to_string(cls, addr, &sz, a);
     if (hret != HG_SUCCESS) strcpy(addr, "n/a");
-    fprintf(fp, "NX-%d: rmap %d %s\n", nctx->grank, it->first, addr);
+    if (nctx->nstripes == 1)
+      fprintf(fp, "NX-%d: rmap %d %s\n", s->grank, (int)slot, addr);
+    else
+      fprintf(fp, "NX-%d: rmap %d.%d %s\n", s->grank,
+              (int)slot / nctx->nstripes, (int)slot % nctx->nstripes, addr);
   }
   if (fp != stderr)
     fclose(fp);
 
 
 done:
+  nx_snap_exit();
   if (fname) free(fname);
   if (addr) free(addr);
   return;
@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * nexus_addr.cc  compact encoding of mercury addresses for MPI exchange
+ *
+ * most of an address url is the same on every rank (the protocol prefix)
+ * and the rest is usually an ipv4 address and port (network plugins) or
+ * a pid and an id (na+sm).  nx_addrfmt_setup() checks if all ranks in a
+ * comm agree on the format.  if so, each address is sent as two packed
+ * 32 bit fields and nx_addr_decode() rebuilds the url for the lookup.
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "nexus_internal.h"
+
+namespace {
+
+/* nx_addr_num: parse an unsigned 32 bit decimal that ends the string */
+int nx_addr_num(const char* s, uint32_t* val) {
+  unsigned long long n = 0;
+
+  if (*s == '\0') return(0);
+  for ( ; *s ; s++) {
+    if (!isdigit((unsigned char)*s)) return(0);
+    n = n * 10 + (*s - '0');
+    if (n > UINT32_MAX) return(0);
+  }
+  *val = n;
+  return(1);
+}
+
+/*
+ * nx_addr_parse: split address url into prefix and two numeric fields.
+ * sets fmt->kind to the format found (NX_AF_STRING if we can't pack it).
+ */
+void nx_addr_parse(const char* addr, struct nx_addrfmt* fmt, uint32_t* v) {
+  char host[INET_ADDRSTRLEN];
+  const char *p, *c;
+  struct in_addr in;
+
+  fmt->kind = NX_AF_STRING;
+  fmt->sep = 0;
+  fmt->prefix[0] = '\0';
+  if ((p = strstr(addr, "://")) == NULL) return;
+  p += 3;
+  if (p - addr >= NX_AF_PREFIXSZ) return;
+
+  c = strrchr(p, ':');                 /* try a.b.c.d:port */
+  if (c && c - p < (int)sizeof(host)) {
+    memcpy(host, p, c - p);
+    host[c - p] = '\0';
+    if (inet_pton(AF_INET, host, &in) == 1 &&
+        nx_addr_num(c + 1, &v[1]) && v[1] <= 65535) {
+      v[0] = in.s_addr;
+      fmt->kind = NX_AF_IPPORT;
+      fmt->sep = ':';
+    }
+  }
+
+  if (fmt->kind == NX_AF_STRING) {     /* try <num><sep><num> */
+    for (c = p ; isdigit((unsigned char)*c) ; c++)
+      /*null*/;
+    if (c == p || *c == '\0' || c - p > 10) return;
+    memcpy(host, p, c - p);
+    host[c - p] = '\0';
+    if (!nx_addr_num(host, &v[0]) || !nx_addr_num(c + 1, &v[1])) return;
+    fmt->kind = NX_AF_PIDID;
+    fmt->sep = *c;
+  }
+
+  memcpy(fmt->prefix, addr, p - addr);
+  fmt->prefix[p - addr] = '\0';
+}
+
+/* nx_addr_fmtstr: rebuild an address url from its packed fields */
+void nx_addr_fmtstr(const struct nx_addrfmt* fmt, const uint32_t* v,
+                    char* buf, int bufsz) {
+  char host[INET_ADDRSTRLEN];
+  struct in_addr in;
+
+  if (fmt->kind == NX_AF_IPPORT) {
+    in.s_addr = v[0];
+    inet_ntop(AF_INET, &in, host, sizeof(host));
+    snprintf(buf, bufsz, "%s%s:%u", fmt->prefix, host, v[1]);
+  } else {
+    snprintf(buf, bufsz, "%s%u%c%u", fmt->prefix, v[0], fmt->sep, v[1]);
+  }
+}
+
+} // namespace
+
+/*
+ * nx_addrfmt_setup: pick the exchange format for addresses on comm
+ * (collective).  we pack addresses only if every rank's address parses
+ * with the same prefix as rank 0's and rebuilds to the exact same
+ * string.  return -1 on MPI error.
+ */
+int nx_addrfmt_setup(MPI_Comm comm, const char* myaddr,
+                     struct nx_addrfmt* fmt) {
+  char mine[2 + NX_AF_PREFIXSZ], root[sizeof(mine)];
+  char buf[NX_AF_PREFIXSZ + 32];
+  uint32_t v[2];
+  int in[2], out[2];
+
+  nx_addr_parse(myaddr, fmt, v);
+  if (fmt->kind != NX_AF_STRING) {     /* must round trip exactly */
+    nx_addr_fmtstr(fmt, v, buf, sizeof(buf));
+    if (strcmp(buf, myaddr) != 0) fmt->kind = NX_AF_STRING;
+  }
+
+  memset(mine, 0, sizeof(mine));
+  mine[0] = fmt->kind;
+  mine[1] = fmt->sep;
+  strcpy(mine + 2, fmt->prefix);
+  memcpy(root, mine, sizeof(root));
+  if (MPI_Bcast(root, sizeof(root), MPI_BYTE, 0, comm) != MPI_SUCCESS)
+    return(-1);
+
+  /* max of "can't pack" flag and of address string size */
+  in[0] = (fmt->kind == NX_AF_STRING || memcmp(root, mine, sizeof(mine)));
+  in[1] = strlen(myaddr) + 1;
+  if (MPI_Allreduce(in, out, 2, MPI_INT, MPI_MAX, comm) != MPI_SUCCESS)
+    return(-1);
+
+  fmt->strsz = out[1];
+  if (out[0]) {
+    fmt->kind = NX_AF_STRING;
+    fmt->sep = 0;
+    fmt->prefix[0] = '\0';
+    fmt->recsz = fmt->strsz;
+  } else {
+    fmt->recsz = sizeof(v);
+  }
+
+  return(0);
+}
+
+/*
+ * nx_addr_encode: encode our address into an fmt->recsz byte record
+ */
+void nx_addr_encode(const struct nx_addrfmt* fmt, const char* addr,
+                    void* rec) {
+  struct nx_addrfmt tmp;
+  uint32_t v[2];
+
+  if (fmt->kind == NX_AF_STRING) {
+    memset(rec, 0, fmt->recsz);
+    snprintf((char*)rec, fmt->recsz, "%s", addr);
+    return;
+  }
+
+  nx_addr_parse(addr, &tmp, v);        /* setup made sure this works */
+  memcpy(rec, v, sizeof(v));
+}
+
+/*
+ * nx_addr_decode: get the address url from an encoded record.  packed
+ * records are rebuilt in buf (which should be fmt->strsz bytes).
+ */
+const char* nx_addr_decode(const struct nx_addrfmt* fmt, const void* rec,
+                           char* buf, int bufsz) {
+  uint32_t v[2];
+
+  if (fmt->kind == NX_AF_STRING)
+    return((const char*)rec);
+
+  memcpy(v, rec, sizeof(v));
+  nx_addr_fmtstr(fmt, v, buf, bufsz);
+  return(buf);
+}
+
+/*
+ * nx_addrwin_open: put our encoded addresses (one per rail, then the
+ * local one) in a window on mycomm so peers can fetch just the records
+ * they need (collective).  the rail formats are the same everywhere,
+ * so each record is at the same offset on every proc.  the local
+ * format may not be, but only our local procs fetch that record.
+ * with NEXUS_ADDR_XCHG=pmix the records are published with PMIx
+ * instead.  return -1 on error.
+ */
+int nx_addrwin_open(nexus_ctx_t nx, struct nx_addrwin* aw) {
+  int rail, sz, err, gerr;
+
+  aw->win = MPI_WIN_NULL;
+  aw->pmix = NULL;
+  for (aw->loff = 0, rail = 0 ; rail < nx->nrails ; rail++) {
+    aw->roff[rail] = aw->loff;
+    aw->loff += nx->rfmt[rail].recsz;
+  }
+  sz = aw->loff + nx->lfmt.recsz;
+  aw->recs = (char*)malloc(sz);
+  if (aw->recs) {
+    for (rail = 0 ; rail < nx->nrails ; rail++)
+      nx_addr_encode(&nx->rfmt[rail],
+                     mercury_progressor_addrstring(nx->hg_rail[rail]),
+                     aw->recs + aw->roff[rail]);
+    nx_addr_encode(&nx->lfmt, mercury_progressor_addrstring(nx->hg_local),
+                   aw->recs + aw->loff);
+  }
+
+  /* everyone needs a window, so fail together */
+  err = (aw->recs == NULL);
+  if (MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX,
+                    nx->mycomm) != MPI_SUCCESS || gerr) {
+    fprintf(stderr, "nx_addrwin_open: malloc failed\n");
+    nx_addrwin_close(aw);
+    return(-1);
+  }
+#ifdef NEXUS_PMIX
+  if (nx->xchg == NX_XCHG_PMIX) {
+    if (nx_pmix_open(nx, aw, sz) < 0) {
+      nx_addrwin_close(aw);
+      return(-1);
+    }
+    return(0);
+  }
+#endif
+  if (MPI_Win_create(aw->recs, sz, 1, MPI_INFO_NULL, nx->mycomm,
+                     &aw->win) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_addrwin_open: window create failed\n");
+    aw->win = MPI_WIN_NULL;
+    nx_addrwin_close(aw);
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * nx_addrwin_get: fetch the rail "rail" records (-1 for the local
+ * ones) of n ranks into recs[] (n fmt records).  return -1 on error.
+ */
+int nx_addrwin_get(nexus_ctx_t nx, struct nx_addrwin* aw, int rail, int n,
+                   const int* granks, char* recs) {
+  const int recsz = (rail < 0) ? nx->lfmt.recsz : nx->rfmt[rail].recsz;
+  const int off = (rail < 0) ? aw->loff : aw->roff[rail];
+  int i, fail = 0;
+
+  if (n < 1)
+    return(0);
+#ifdef NEXUS_PMIX
+  if (aw->pmix)
+    return(nx_pmix_get(aw, off, recsz, n, granks, recs));
+#endif
+  if (MPI_Win_lock_all(0, aw->win) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_addrwin_get: lock failed\n");
+    return(-1);
+  }
+  for (i = 0 ; i < n ; i++) {
+    if (MPI_Get(recs + i * recsz, recsz, MPI_BYTE, granks[i], off, recsz,
+                MPI_BYTE, aw->win) != MPI_SUCCESS)
+      fail = 1;
+  }
+  if (MPI_Win_unlock_all(aw->win) != MPI_SUCCESS || fail) {
+    fprintf(stderr, "nx_addrwin_get: get failed\n");
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * nx_addrwin_close: free the window (collective if it was created)
+ */
+void nx_addrwin_close(struct nx_addrwin* aw) {
+#ifdef NEXUS_PMIX
+  if (aw->pmix) nx_pmix_close(aw);
+#endif
+  if (aw->win != MPI_WIN_NULL) MPI_Win_free(&aw->win);
+  if (aw->recs) free(aw->recs);
+  aw->recs = NULL;
+}
+
+/*
+ * nx_addrwin_rmap: build the rmap when node2rep[] is already known
+ * (from a table file or a shared topology) and the rmap formats are
+ * set up.  we already know the peer of each slot we hold, so
+ * we fetch just those records from an nx_addrwin rather than doing the
+ * rep exchange in nx_build_rmap().  the remote progressors must be
+ * running.  return -1 on error.
+ */
+int nx_addrwin_rmap(nexus_ctx_t nx, int recsz) {
+  int retval = 0, i, q, rail, c;
+  std::vector<int> granks, slots;
+  std::vector<char> recs, rec;
+  struct nx_addrwin aw;
+  double t;
+  nexus_mapent_t empty;
+
+  empty.addr = HG_ADDR_NULL;
+  empty.grank = -1;
+  empty.rail = 0;
+  nx->rmap.assign(nx->nnodes * nx->nstripes, empty);
+  for (q = 0 ; q < (int)nx->rmap.size() ; q++) {
+    nx->rmap[q].rail = nx_rail_of(nx, q / nx->nstripes, q % nx->nstripes);
+  }
+  for (c = 0, q = 0 ; q < (int)nx->rmap.size() ; q++) {
+    if (q / nx->nstripes != nx->nodeid &&
+        nx_srcrep_slot(nx, nx->node2srcrep, q / nx->nstripes,
+                       q % nx->nstripes) == nx->lrank &&
+        nx_rmap_needed(nx, q / nx->nstripes))
+      c++;
+  }
+  if (nx_addrwin_open(nx, &aw) < 0)
+    return(-1);
+  if (nx->lazy_rmap && nx_lazy_init(nx, c, recsz) < 0)
+    retval = -1;
+  rec.assign(recsz, 0);
+
+  for (rail = 0 ; retval == 0 && rail < nx->nrails ; rail++) {
+    granks.clear();
+    slots.clear();
+    for (q = 0 ; q < (int)nx->rmap.size() ; q++) {
+      if (nx->rmap[q].rail != rail || q / nx->nstripes == nx->nodeid ||
+          nx_srcrep_slot(nx, nx->node2srcrep, q / nx->nstripes,
+                         q % nx->nstripes) != nx->lrank ||
+          !nx_rmap_needed(nx, q / nx->nstripes))
+        continue;
+      granks.push_back(nx->node2rep[q]);
+      slots.push_back(q);
+    }
+    if (granks.empty()) continue;
+    recs.resize(granks.size() * nx->rfmt[rail].recsz);
+    t = MPI_Wtime();
+    if (nx_addrwin_get(nx, &aw, rail, granks.size(), &granks[0],
+                       &recs[0]) < 0) {
+      retval = -1;
+      break;
+    }
+    t = nx_phase_end(nx, NX_PH_RMAP_XCHG, t);
+    if (nx->lazy_rmap) {            /* saved in lazy's (max) record size */
+      for (i = 0 ; i < (int)granks.size() ; i++) {
+        memcpy(&rec[0], &recs[i * nx->rfmt[rail].recsz],
+               nx->rfmt[rail].recsz);
+        nx_lazy_add(nx, slots[i], granks[i], &rec[0]);
+      }
+    } else if (nx_lookup_recs(nx, nx->hg_rail[rail], &nx->rfmt[rail],
+                              granks.size(), &granks[0], &slots[0],
+                              &recs[0], &nx->rmap) < 0) {
+      fprintf(stderr, "nx_addrwin_rmap: lookups failed\n");
+      retval = -1;
+    }
+    nx_phase_end(nx, NX_PH_RMAP_LOOKUP, t);
+  }
+
+  nx_addrwin_close(&aw);
+  return(retval);
+}
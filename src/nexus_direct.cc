@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_direct.cc  bounded LRU cache of direct remote routes
+ *
+ * a promoted dest gets its own remote address so nexus_next_hop() can
+ * skip the srcrep and destrep.  we don't keep every rank's remote
+ * address around, so each proc exposes its own (encoded, rail 0)
+ * address in an MPI window and nexus_promote() reads the dest's record
+ * from it with a passive target MPI_Get.  the mercury lookup runs in
+ * the background and nexus_next_hop() returns NX_DIRECT once it is done.
+ * the cache holds at most "cap" entries.  to make room it evicts the
+ * least recently promoted resolved entry that nexus_next_hop() has not
+ * used since the last eviction (or the least recently promoted one if
+ * they have all been used).
+ *
+ * lookup callbacks run in the progressor's thread, so the cache is
+ * protected by a mutex.  nexus_next_hop() doesn't take it: resolved
+ * addrs are published in daddr[] (indexed by dest) and readers only set
+ * dest's flag in dused[].  readers load daddr[] inside nx_snap_enter(),
+ * so a dropped addr is retired with an epoch like a replaced snap and
+ * freed once no reader can still have it (see nexus_snap.cc).
+ * nexus_ctx::ndirect counts resolved entries so that nexus_next_hop()
+ * only looks if there is something to find.  we can't idle the
+ * progressor from inside its own callback, so finished lookups are
+ * idled by the next call into the cache.
+ */
+
+#include <assert.h>
+
+#include <new>
+#include <unordered_map>
+#include <utility>
+
+#include "nexus_internal.h"
+
+#define NX_DENT_FREE    0       /* unused entry (on free list) */
+#define NX_DENT_PENDING 1       /* lookup in progress */
+#define NX_DENT_READY   2       /* addr is valid */
+#define NX_DENT_DEMOTED 3       /* demoted while pending, free when done */
+
+struct nx_direct;
+
+struct nx_dent {
+  struct nx_direct* dir;        /* cache that owns us */
+  int dest;                     /* global rank (-1 if free) */
+  int state;                    /* NX_DENT_* */
+  hg_addr_t addr;               /* dest's remote address (if ready) */
+  int prev;                     /* lru list (or free list) links */
+  int next;
+};
+
+struct nx_direct {
+  nexus_ctx_t nx;               /* context that owns us */
+  pthread_mutex_t lock;         /* protects everything below */
+  pthread_cond_t cv;            /* nx_direct_destroy() waits here */
+  std::vector<nx_dent> ents;    /* cap entries, never resized */
+  std::unordered_map<int, int> byrank; /* dest -> ents[] index */
+  std::atomic<hg_addr_t>* daddr;  /* dest -> resolved addr (or NULL) */
+  std::atomic<char>* dused;     /* dest -> used since last eviction */
+  std::vector<std::pair<uint64_t, hg_addr_t> > dead; /* retired addrs */
+  int head;                     /* most recently promoted (-1 if empty) */
+  int tail;                     /* least recently promoted */
+  int freelist;                 /* unused entries */
+  int pending;                  /* lookups in flight */
+  int unidled;                  /* finished lookups not yet idled */
+  hg_class_t* cls;              /* rail 0 class */
+  progressor_handle_t* phand;   /* rail 0 progressor */
+  MPI_Win win;                  /* address directory */
+  char* myrec;                  /* our record (exposed in win) */
+  char* rec;                    /* buffer for a dest's record */
+  char* url;                    /* buffer for a decoded url */
+};
+
+namespace {
+/* nx_dent_unlink: take entry i off the lru list (w/lock) */
+void nx_dent_unlink(struct nx_direct* dir, int i) {
+  nx_dent* const e = &dir->ents[i];
+
+  if (e->prev != -1)
+    dir->ents[e->prev].next = e->next;
+  else
+    dir->head = e->next;
+  if (e->next != -1)
+    dir->ents[e->next].prev = e->prev;
+  else
+    dir->tail = e->prev;
+  e->prev = e->next = -1;
+}
+
+/* nx_dent_push: put entry i at the head of the lru list (w/lock) */
+void nx_dent_push(struct nx_direct* dir, int i) {
+  nx_dent* const e = &dir->ents[i];
+
+  e->prev = -1;
+  e->next = dir->head;
+  if (dir->head != -1) dir->ents[dir->head].prev = i;
+  dir->head = i;
+  if (dir->tail == -1) dir->tail = i;
+}
+
+/*
+ * nx_dent_drop: unlink entry i and put it on the free list (w/lock).
+ * readers may still have a resolved entry's addr, so we unpublish it
+ * and retire it with a new epoch rather than free it.
+ */
+void nx_dent_drop(struct nx_direct* dir, int i) {
+  nx_dent* const e = &dir->ents[i];
+
+  nx_dent_unlink(dir, i);
+  if (e->state == NX_DENT_READY) {
+    dir->nx->ndirect.fetch_sub(1);
+    dir->daddr[e->dest].store(HG_ADDR_NULL);
+    dir->dead.push_back(std::make_pair(nx_epoch.fetch_add(1) + 1, e->addr));
+  } else if (e->addr != HG_ADDR_NULL) {
+    HG_Addr_free(dir->cls, e->addr);
+  }
+  dir->byrank.erase(e->dest);
+  e->dest = -1;
+  e->state = NX_DENT_FREE;
+  e->addr = HG_ADDR_NULL;
+  e->next = dir->freelist;
+  dir->freelist = i;
+}
+
+/*
+ * nx_direct_reap: idle the progressor for finished lookups and free the
+ * retired addrs no reader can still see (w/lock).  dead[] is in epoch
+ * order.
+ */
+void nx_direct_reap(struct nx_direct* dir) {
+  uint64_t oldest;
+  size_t n;
+
+  for ( ; dir->unidled > 0 ; dir->unidled--)
+    mercury_progressor_idle(dir->phand);
+  if (dir->dead.empty()) return;
+  oldest = nx_reader_oldest();
+  for (n = 0 ; n < dir->dead.size() && dir->dead[n].first <= oldest ; n++)
+    HG_Addr_free(dir->cls, dir->dead[n].second);
+  dir->dead.erase(dir->dead.begin(), dir->dead.begin() + n);
+}
+
+/* nx_direct_cb: lookup callback, runs in the progressor's thread */
+hg_return_t nx_direct_cb(const struct hg_cb_info* info) {
+  nx_dent* const e = (nx_dent*)info->arg;
+  struct nx_direct* const dir = e->dir;
+
+  pthread_mutex_lock(&dir->lock);
+  if (info->ret == HG_SUCCESS) e->addr = info->info.lookup.addr;
+  if (info->ret == HG_SUCCESS && e->state == NX_DENT_PENDING) {
+    e->state = NX_DENT_READY;
+    dir->daddr[e->dest].store(e->addr, std::memory_order_release);
+    dir->nx->ndirect.fetch_add(1);
+  } else {                          /* failed or demoted, drop it */
+    nx_dent_drop(dir, e - &dir->ents[0]);
+  }
+  dir->pending--;
+  dir->unidled++;
+  pthread_cond_signal(&dir->cv);
+  pthread_mutex_unlock(&dir->lock);
+  return HG_SUCCESS;
+}
+
+/*
+ * nx_direct_add: start a direct route to dest (w/lock).  return
+ * NX_SUCCESS if it is already resolved, NX_PENDING if the lookup is in
+ * progress, or NX_ERROR.
+ */
+nexus_ret_t nx_direct_add(struct nx_direct* dir, int dest) {
+  nexus_ctx_t nx = dir->nx;
+  std::unordered_map<int, int>::iterator it;
+  nx_dent* e;
+  int i;
+  hg_return_t hret;
+
+  if ((it = dir->byrank.find(dest)) != dir->byrank.end()) {
+    e = &dir->ents[it->second];
+    if (e->state == NX_DENT_DEMOTED) e->state = NX_DENT_PENDING;
+    nx_dent_unlink(dir, it->second);
+    nx_dent_push(dir, it->second);
+    return (e->state == NX_DENT_READY) ? NX_SUCCESS : NX_PENDING;
+  }
+
+  if (dir->freelist == -1) {        /* full: evict an unused entry */
+    for (i = dir->tail ; i != -1 ; i = dir->ents[i].prev) {
+      if (dir->ents[i].state == NX_DENT_READY &&
+          dir->dused[dir->ents[i].dest].exchange(0) == 0)
+        break;
+    }
+    if (i == -1) {                  /* all used since the last eviction */
+      for (i = dir->tail ; i != -1 ; i = dir->ents[i].prev) {
+        if (dir->ents[i].state == NX_DENT_READY) break;
+      }
+    }
+    if (i == -1) return NX_ERROR;   /* all entries still pending */
+    nx_dent_drop(dir, i);
+  }
+
+  /* get dest's record from the directory and decode it */
+  if (MPI_Win_lock(MPI_LOCK_SHARED, dest, 0, dir->win) != MPI_SUCCESS ||
+      MPI_Get(dir->rec, nx->rfmt[0].recsz, MPI_BYTE, dest, 0,
+              nx->rfmt[0].recsz, MPI_BYTE, dir->win) != MPI_SUCCESS ||
+      MPI_Win_unlock(dest, dir->win) != MPI_SUCCESS) {
+    fprintf(stderr, "nexus_promote: directory get for rank %d failed\n",
+            dest);
+    return NX_ERROR;
+  }
+
+  i = dir->freelist;
+  e = &dir->ents[i];
+  dir->freelist = e->next;
+  e->dest = dest;
+  e->state = NX_DENT_PENDING;
+  e->addr = HG_ADDR_NULL;
+  dir->byrank[dest] = i;
+  dir->dused[dest].store(1, std::memory_order_relaxed);
+  nx_dent_push(dir, i);
+
+  if (mercury_progressor_needed(dir->phand) != HG_SUCCESS) {
+    fprintf(stderr, "nexus_promote: progressor needed failed\n");
+    nx_dent_drop(dir, i);
+    return NX_ERROR;
+  }
+  dir->pending++;
+  hret = HG_Addr_lookup(mercury_progressor_hgcontext(dir->phand),
+                        &nx_direct_cb, e,
+                        nx_addr_decode(&nx->rfmt[0], dir->rec, dir->url,
+                                       nx->rfmt[0].strsz),
+                        HG_OP_ID_IGNORE);
+  if (hret != HG_SUCCESS) {
+    fprintf(stderr, "nexus_promote: lookup rank %d failed (%d)\n", dest,
+            hret);
+    dir->pending--;
+    dir->unidled++;
+    nx_dent_drop(dir, i);
+    return NX_ERROR;
+  }
+  return NX_PENDING;
+}
+}  // namespace
+
+/*
+ * nx_direct_init: set up the address directory and an empty cache of
+ * "cap" entries (collective over mycomm).  return -1 on error.
+ */
+int nx_direct_init(nexus_ctx_t nx, int cap) {
+  struct nx_direct* dir;
+  int i, err, gerr;
+
+  dir = new nx_direct;
+  dir->nx = nx;
+  pthread_mutex_init(&dir->lock, NULL);
+  pthread_cond_init(&dir->cv, NULL);
+  dir->ents.resize(cap);
+  for (i = 0 ; i < cap ; i++) {
+    dir->ents[i].dir = dir;
+    dir->ents[i].dest = -1;
+    dir->ents[i].state = NX_DENT_FREE;
+    dir->ents[i].addr = HG_ADDR_NULL;
+    dir->ents[i].prev = -1;
+    dir->ents[i].next = (i + 1 < cap) ? i + 1 : -1;
+  }
+  dir->head = dir->tail = -1;
+  dir->freelist = 0;
+  dir->pending = dir->unidled = 0;
+  dir->phand = nx->hg_rail[0];
+  dir->cls = mercury_progressor_hgclass(dir->phand);
+  dir->win = MPI_WIN_NULL;
+  dir->daddr = new (std::nothrow) std::atomic<hg_addr_t>[nx->gsize];
+  dir->dused = new (std::nothrow) std::atomic<char>[nx->gsize];
+  dir->myrec = (char *)malloc(nx->rfmt[0].recsz);
+  dir->rec = (char *)malloc(nx->rfmt[0].recsz);
+  dir->url = (char *)malloc(nx->rfmt[0].strsz);
+  nx->direct = dir;                 /* nx_direct_destroy() cleans up */
+
+  err = (!dir->daddr || !dir->dused || !dir->myrec || !dir->rec ||
+         !dir->url);
+  if (err) fprintf(stderr, "nx_direct_init: malloc failed\n");
+  if (MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX,
+                    nx->mycomm) != MPI_SUCCESS || gerr)
+    return(-1);                     /* no one creates the window */
+  for (i = 0 ; i < nx->gsize ; i++) {
+    dir->daddr[i].store(HG_ADDR_NULL, std::memory_order_relaxed);
+    dir->dused[i].store(0, std::memory_order_relaxed);
+  }
+  nx_addr_encode(&nx->rfmt[0], mercury_progressor_addrstring(dir->phand),
+                 dir->myrec);
+  if (MPI_Win_create(dir->myrec, nx->rfmt[0].recsz, 1, MPI_INFO_NULL,
+                     nx->mycomm, &dir->win) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_direct_init: directory window create failed\n");
+    dir->win = MPI_WIN_NULL;
+    return(-1);
+  }
+
+  return(0);
+}
+
+/*
+ * nx_direct_get: get dest's direct route if it is resolved and mark it
+ * as used, without locking.  the caller must be in nx_snap_enter(),
+ * which keeps the addr from being freed if the route is dropped.
+ * return -1 if there isn't one.
+ */
+int nx_direct_get(nexus_ctx_t nx, int dest, hg_addr_t* addr) {
+  struct nx_direct* const dir = nx->direct;
+  const hg_addr_t a = dir->daddr[dest].load(std::memory_order_acquire);
+
+  if (a == HG_ADDR_NULL) return(-1);
+  if (dir->dused[dest].load(std::memory_order_relaxed) == 0)
+    dir->dused[dest].store(1, std::memory_order_relaxed);
+  *addr = a;
+  return(0);
+}
+
+/*
+ * nx_direct_destroy: wait for lookups, free the cache and the directory
+ * (collective over mycomm)
+ */
+void nx_direct_destroy(nexus_ctx_t nx) {
+  struct nx_direct* dir = nx->direct;
+  size_t i;
+
+  pthread_mutex_lock(&dir->lock);
+  while (dir->pending > 0)
+    pthread_cond_wait(&dir->cv, &dir->lock);
+  while (dir->head != -1)
+    nx_dent_drop(dir, dir->head);
+  nx_direct_reap(dir);
+  for (i = 0 ; i < dir->dead.size() ; i++)   /* no readers left */
+    HG_Addr_free(dir->cls, dir->dead[i].second);
+  pthread_mutex_unlock(&dir->lock);
+
+  if (dir->win != MPI_WIN_NULL) MPI_Win_free(&dir->win);
+  delete[] dir->daddr;
+  delete[] dir->dused;
+  if (dir->myrec) free(dir->myrec);
+  if (dir->rec) free(dir->rec);
+  if (dir->url) free(dir->url);
+  pthread_cond_destroy(&dir->cv);
+  pthread_mutex_destroy(&dir->lock);
+  delete dir;
+  nx->direct = NULL;
+}
+
+/*
+ * nexus_promote: start a direct route to dest (or every rank on dest's
+ * node if wholenode is set)
+ */
+nexus_ret_t nexus_promote(nexus_ctx_t nctx, int dest, int wholenode) {
+  struct nx_direct* dir;
+  nexus_ret_t rv, r;
+  int node, d;
+  assert(nctx != NULL);
+
+  if ((dir = nctx->direct) == NULL) return NX_ERROR;
+  if (dest < 0 || dest >= nctx->gsize) return NX_INVAL;
+  node = nx_rank2node(nctx, dest);
+  if (node == nctx->nodeid) return NX_INVAL;
+
+  pthread_mutex_lock(&dir->lock);
+  if (!wholenode) {
+    rv = nx_direct_add(dir, dest);
+  } else {
+    for (rv = NX_SUCCESS, d = 0 ; d < nctx->gsize ; d++) {
+      if (nx_rank2node(nctx, d) != node) continue;
+      r = nx_direct_add(dir, d);
+      if (r == NX_ERROR || (r == NX_PENDING && rv == NX_SUCCESS)) rv = r;
+      if (rv == NX_ERROR) break;
+    }
+  }
+  nx_direct_reap(dir);
+  pthread_mutex_unlock(&dir->lock);
+  return rv;
+}
+
+/*
+ * nexus_demote: drop dest's direct route (if any)
+ */
+nexus_ret_t nexus_demote(nexus_ctx_t nctx, int dest) {
+  struct nx_direct* dir;
+  std::unordered_map<int, int>::iterator it;
+  nexus_ret_t rv = NX_NOTFOUND;
+  assert(nctx != NULL);
+
+  if ((dir = nctx->direct) == NULL) return NX_NOTFOUND;
+  pthread_mutex_lock(&dir->lock);
+  if ((it = dir->byrank.find(dest)) != dir->byrank.end()) {
+    if (dir->ents[it->second].state == NX_DENT_PENDING)
+      dir->ents[it->second].state = NX_DENT_DEMOTED;  /* cb frees it */
+    else if (dir->ents[it->second].state == NX_DENT_READY)
+      nx_dent_drop(dir, it->second);
+    rv = NX_SUCCESS;
+  }
+  nx_direct_reap(dir);
+  pthread_mutex_unlock(&dir->lock);
+  return rv;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_inbound.cc  list the ranks that may send to us
+ *
+ * the rep pairs are shared by both directions of a node pair, so the
+ * rank on our node that hears from node m on stripe s is our srcrep
+ * for m on s, and the sender is node2rep[m * nstripes + s].  with that
+ * and the group gateways (which every proc can compute) we can walk
+ * every route that ends at us or passes through us without asking
+ * anyone.  we assume any rank may send to any other rank, and leave
+ * out direct routes (nexus_promote()).
+ */
+
+#include <assert.h>
+
+#include "nexus_internal.h"
+
+namespace {
+/*
+ * nx_in_links: dest nodes whose traffic node m sends to our node (or
+ * none if it does not use its rep pair with us).  that is our node
+ * within a group, plus the groups we are the gateway to.  a gateway
+ * pair between two groups carries all of our group's traffic.
+ */
+void nx_in_links(nexus_ctx_t nx, int m, std::vector<int>* dnodes) {
+  const struct nx_groups* const grp = &nx->grp;
+  int g, i;
+
+  dnodes->clear();
+  if (m == nx->nodeid || !nx_rmap_needed(nx, m))
+    return;
+  if (grp->ngroups <= 1) {
+    dnodes->push_back(nx->nodeid);
+  } else if (grp->node2group[m] != grp->mygroup) {  /* gateway pair */
+    for (i = grp->gstart[grp->mygroup] ; i < grp->gstart[grp->mygroup+1] ; i++)
+      dnodes->push_back(grp->gnodes[i]);
+  } else {
+    dnodes->push_back(nx->nodeid);
+    for (g = 0 ; g < grp->ngroups ; g++) {
+      if (g == grp->mygroup || nx_group_gw(nx, grp->mygroup, g) != nx->nodeid)
+        continue;
+      for (i = grp->gstart[g] ; i < grp->gstart[g+1] ; i++)
+        dnodes->push_back(grp->gnodes[i]);
+    }
+  }
+}
+
+/*
+ * nx_in_add: add nlinks to peer grank's entry of a type (made if new).
+ * only local peers can have more than one entry to merge.
+ */
+void nx_in_add(std::vector<nexus_inbound_t>* ents, int grank,
+               nexus_ret_t type, int rail, int nlinks, int merge) {
+  size_t i;
+  nexus_inbound_t ent;
+
+  for (i = 0 ; merge && i < ents->size() ; i++) {
+    if ((*ents)[i].grank == grank && (*ents)[i].type == type) {
+      (*ents)[i].nlinks += nlinks;
+      return;
+    }
+  }
+  ent.grank = grank;
+  ent.type = type;
+  ent.rail = rail;
+  ent.nlinks = nlinks;
+  ents->push_back(ent);
+}
+}  // namespace
+
+/*
+ * nexus_inbound: list the ranks that may send to us (see above)
+ */
+int nexus_inbound(nexus_ctx_t nctx, nexus_inbound_t* peers, int n) {
+  const int ns = nctx->nstripes;
+  std::vector<nexus_inbound_t> local, remote;
+  std::vector<char> hasstripe;      /* node * ns + s: has a rank on s? */
+  std::vector<int> dnodes;
+  const struct nx_snap* s;
+  int m, st, k, d, i, slot, vg, mystripe, srcrep;
+  assert(nctx != NULL);
+
+  /* original srcs on our node send to us directly */
+  for (k = 0 ; k < nctx->lsize ; k++) {
+    if (k != nctx->lrank)
+      nx_in_add(&local, nctx->local2global[k], NX_ISLOCAL, -1, 0, 0);
+  }
+  if (nctx->nnodes <= 1)
+    goto done;
+
+  hasstripe.assign(nctx->nnodes * ns, 0);
+  for (i = 0 ; i < nctx->gsize ; i++)
+    hasstripe[nx_rank2node(nctx, i) * ns + nx_stripe_of(nctx, i)] = 1;
+  s = nx_snap_enter(nctx);
+  mystripe = nx_stripe_of(nctx, s->grank);    /* nexus_set_grank()'s */
+
+  /* and so do they if we are their srcrep for any remote node */
+  for (d = 0, srcrep = 0 ; !srcrep && d < nctx->nnodes ; d++) {
+    for (st = 0 ; d != nctx->nodeid && st < ns ; st++) {
+      if (hasstripe[d * ns + st] &&
+          nx_srcrep_slot(nctx, s->node2srcrep, nx_group_hop(nctx, d, &vg),
+                         st) == nctx->lrank)
+        srcrep = 1;
+    }
+  }
+  for (k = 0 ; srcrep && k < nctx->lsize ; k++) {
+    if (k != nctx->lrank)
+      nx_in_add(&local, nctx->local2global[k], NX_SRCREP, -1, 0, 0);
+  }
+
+  /* walk the remote traffic that arrives on our node */
+  for (m = 0 ; m < nctx->nnodes ; m++) {
+    nx_in_links(nctx, m, &dnodes);
+    for (st = 0 ; !dnodes.empty() && st < ns ; st++) {
+      k = nx_srcrep_slot(nctx, s->node2srcrep, m, st);  /* hears from m */
+      for (i = 0, slot = -1 ; slot < 0 && i < (int)dnodes.size() ; i++) {
+        if (hasstripe[dnodes[i] * ns + st]) slot = m * ns + st;
+      }
+      if (slot < 0)
+        continue;                   /* no traffic on this stripe */
+      if (k == nctx->lrank) {       /* from m to us */
+        nx_in_add(&remote, s->node2rep[slot],
+                  (nctx->grp.ngroups > 1 &&
+                   nctx->grp.node2group[m] != nctx->grp.mygroup) ?
+                  NX_GROUPREP : NX_DESTREP, nx_rail_of(nctx, m, st), 1, 0);
+        continue;
+      }
+      if (st == mystripe)           /* k hands us our own traffic */
+        nx_in_add(&local, nctx->local2global[k], NX_ISLOCAL, -1, 1, 1);
+      for (i = 0 ; i < (int)dnodes.size() ; i++) {
+        d = dnodes[i];              /* or traffic we forward on */
+        if (d != nctx->nodeid && hasstripe[d * ns + st] &&
+            nx_srcrep_slot(nctx, s->node2srcrep, nx_group_hop(nctx, d, &vg),
+                           st) == nctx->lrank) {
+          nx_in_add(&local, nctx->local2global[k], NX_SRCREP, -1, 1, 1);
+          break;
+        }
+      }
+    }
+  }
+  nx_snap_exit();
+
+done:
+  for (i = 0 ; i < (int)local.size() && i < n ; i++)
+    peers[i] = local[i];
+  for (k = 0 ; k < (int)remote.size() && i + k < n ; k++)
+    peers[i + k] = remote[k];
+  return((int)(local.size() + remote.size()));
+}
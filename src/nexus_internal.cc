@@ -35,6 +35,11 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <time.h>
+
+#include <atomic>
+#include <map>
+#include <string>
 
 #include "nexus_internal.h"
 
@@ -43,50 +48,281 @@
 
 namespace {
 
+/* value for unused map slots */
+const nexus_mapent_t nx_empty_mapent = { HG_ADDR_NULL, -1, 0 };
+
 /*
  * xchg_dat_t: structure used to exchange mercury addressing info,
- * including url address string, over MPI.  the address buffer
- * (fixed sized to largest value needed) follows the structure.
+ * including the encoded address, over MPI.  the address record
+ * (fmt->recsz bytes, see nx_addrfmt) follows the structure.
  * after we use MPI to exchange info, we then pass this to nx_lookup_addrs()
- * to convert the url strings into hg_addr_t's.
+ * to convert the addresses into hg_addr_t's.
  */
 typedef struct {
   int grank;      /* a global rank */
-  int idx;        /* map index (key) to store hg_addr_t under */
-  char addr[];    /* address string (follows structure in memory) */
+  int idx;        /* map slot to store hg_addr_t in */
+  char addr[];    /* encoded address (follows structure in memory) */
 } xchg_dat_t;
 
-/* nx_lookup_ctx: state for a nx_lookup operation */
+/*
+ * nx_lookup_ctx: state for a nx_lookup operation.  lookups are issued
+ * in a sliding window: the caller fills the window and then each
+ * completion callback refills it.  the window size comes from the
+ * progressor's nx_lookup_win (see nx_win_update()).  entries are
+ * claimed using the atomic "next" counter, so the mutex and cv are only
+ * used for retries (rare) and to wake the caller when we are done.
+ *
+ * "pending" counts entries that are not done plus threads currently
+ * running in our code (the caller while filling and each callback).
+ * whoever drops it to zero is the last to touch ctx and wakes the caller.
+ */
 struct nx_lookup_ctx {
-  pthread_mutex_t cb_mutex;   /* syncs caller with callback */
-  pthread_cond_t cb_cv;       /* caller waits for callbacks here */
+  nexus_ctx_t nx;             /* nexus context we are working in */
+  progressor_handle_t *phand; /* the progressor to use for lookups */
+  struct nx_lookup_win *win;  /* lookup window for phand */
+  std::atomic<uint64_t> *hist; /* latency histogram for phand */
+  xchg_dat_t *xarr;           /* xchg array with "xsize" entries */
+  int xsize;                  /* number of entries in xarr[] */
+  int addrsz;                 /* address size of one entry in xarr[] */
+  const struct nx_addrfmt *fmt; /* how addresses in xarr[] are encoded */
+  char *strs;                 /* decoded url for each entry (if packed) */
+  int eff_offset;             /* rotates our starting point in xarr[] */
+  struct nx_lookup_out* out;  /* array: out[0 .. (xsize-1)] */
   nexus_map_t* nx_map;        /* the address map we'll be updating */
-  int done;                   /* num of ops done */
+  std::atomic<int> next;      /* next xarr[] entry to start */
+  std::atomic<int> inflight;  /* number of lookups in flight */
+  std::atomic<int> pending;   /* see above */
+  std::atomic<int> failed;    /* set once any op fails for good */
+  std::atomic<int> nretry;    /* number of entries in retry[] */
+  std::vector<int> retry;     /* entries to retry (w/cb_mutex) */
+  pthread_mutex_t cb_mutex;   /* protects retry[], finished */
+  pthread_cond_t cb_cv;       /* caller waits for final callback here */
+  int finished;               /* set when pending drops to zero */
 };
 
 /* nx_lookup_out: arg passed to lookup callback nx_lookup_cb() */
 struct nx_lookup_out {
   struct nx_lookup_ctx* ctx;  /* lookup context that owns this lookup */
   hg_return_t hret;           /* lookup return value */
-  int idx;                    /* map index/key to store addr in if success */
+  int idx;                    /* map slot to store addr in if success */
+  int grank;                  /* global rank we are looking up */
+  int tries;                  /* number of times we tried the lookup */
+  uint64_t start;             /* time lookup started (usec) */
+  uint64_t usec;              /* time lookup took (usec) */
 };
 
+/* nx_now_usec: return current monotonic time in usec */
+uint64_t nx_now_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* nx_hist_add: add a lookup latency to a log2 histogram */
+void nx_hist_add(std::atomic<uint64_t>* hist, uint64_t usec) {
+  int b;
+
+  for (b = 0 ; usec != 0 && b < NEXUS_HIST_NBUCKETS - 1 ; b++)
+    usec >>= 1;
+  hist[b].fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * nx_win_update: AIMD update of a lookup window.  errors halve the
+ * window.  otherwise we grow the window by one each time a window's
+ * worth of lookups completes, unless the smoothed latency has more than
+ * doubled from the best we have seen (peers or network are congested),
+ * in which case we halve it.  latencies below NX_WIN_FLOOR_USEC never
+ * count as congestion.  we run in callbacks (rwin is shared by all
+ * rails' progressors) and in callers whose lookup failed to start, so
+ * every update is a CAS loop.  only the caller whose ack fills the
+ * window resets acks, so each window's worth changes limit once.
+ */
+#define NX_WIN_FLOOR_USEC 1000
+void nx_win_update(struct nx_lookup_win* w, uint64_t usec, int ok) {
+  uint64_t base, srtt;
+  int limit, acks;
+
+  if (!w->adaptive) return;
+  limit = w->limit.load();
+
+  if (!ok) {
+    while (limit > 1 && !w->limit.compare_exchange_weak(limit, limit / 2))
+      ;
+    w->acks.store(0);
+    return;
+  }
+
+  base = w->base.load();
+  while ((base == 0 || usec < base) &&
+         !w->base.compare_exchange_weak(base, usec))
+    ;
+  if (base == 0 || usec < base) base = usec;
+  srtt = w->srtt.load();
+  while (!w->srtt.compare_exchange_weak(srtt, (srtt == 0) ? usec :
+                                        (7 * srtt + usec) / 8))
+    ;
+  srtt = (srtt == 0) ? usec : (7 * srtt + usec) / 8;
+
+  acks = w->acks.fetch_add(1) + 1;
+  if (acks < limit || !w->acks.compare_exchange_strong(acks, 0))
+    return;
+  if (srtt > 2 * base && srtt > NX_WIN_FLOOR_USEC)
+    w->limit.compare_exchange_strong(limit, (limit > 1) ? limit / 2 : 1);
+  else if (limit < w->maxlimit)
+    w->limit.compare_exchange_strong(limit, limit + 1);
+}
+
+/*
+ * nx_lookup_unref: drop a pending count and wake the caller if it was
+ * the last one.  ctx must not be touched after this returns.
+ */
+void nx_lookup_unref(struct nx_lookup_ctx* ctx) {
+  if (ctx->pending.fetch_sub(1) == 1) {
+    pthread_mutex_lock(&ctx->cb_mutex);
+    ctx->finished = 1;
+    pthread_cond_signal(&ctx->cb_cv);
+    pthread_mutex_unlock(&ctx->cb_mutex);
+  }
+}
+
+/*
+ * nx_lookup_failed: a lookup failed.  put it on the retry list if we
+ * have tries left, otherwise mark it done.
+ */
+void nx_lookup_failed(struct nx_lookup_ctx* ctx, struct nx_lookup_out* out) {
+  if (out->tries < NX_LOOKUP_TRIES && !ctx->failed.load()) {
+    pthread_mutex_lock(&ctx->cb_mutex);
+    ctx->retry.push_back(out - ctx->out);
+    ctx->nretry.fetch_add(1);
+    pthread_mutex_unlock(&ctx->cb_mutex);
+    return;
+  }
+  ctx->failed.store(1);
+  nx_lookup_unref(ctx);
+}
+
+/*
+ * nx_lookup_claim: claim the next entry to work on (retries first).
+ * return its index in xarr[] or -1 if there is nothing left to start.
+ */
+int nx_lookup_claim(struct nx_lookup_ctx* ctx) {
+  int i = -1;
+
+  if (ctx->nretry.load() > 0) {
+    pthread_mutex_lock(&ctx->cb_mutex);
+    if (!ctx->retry.empty()) {
+      i = ctx->retry.back();
+      ctx->retry.pop_back();
+      ctx->nretry.fetch_sub(1);
+    }
+    pthread_mutex_unlock(&ctx->cb_mutex);
+    if (i != -1) return i;
+  }
+
+  if ((i = ctx->next.fetch_add(1)) >= ctx->xsize) return -1;
+  return (i + ctx->eff_offset) % ctx->xsize;
+}
+
+hg_return_t nx_lookup_cb(const struct hg_cb_info* info);
+
+/*
+ * nx_lookup_start: claim an entry and start its lookup.  entries that
+ * complete without a callback (our own address, errors) are finished
+ * here and we move on to the next one.  return 1 if we started a
+ * lookup, 0 if there was nothing left to start.
+ */
+int nx_lookup_start(struct nx_lookup_ctx* ctx) {
+  int eff_i;
+  hg_return_t hret;
+  hg_addr_t self_addr;
+
+  while ((eff_i = nx_lookup_claim(ctx)) != -1) {
+    xchg_dat_t* const xi = (xchg_dat_t*)(((char*)ctx->xarr) +
+                                         eff_i * (sizeof(*xi) + ctx->addrsz));
+    struct nx_lookup_out* const out = &ctx->out[eff_i];
+
+    if (out->tries++ == 0) {
+      out->ctx = ctx;
+      out->idx = xi->idx;           /* map slot to use */
+      out->grank = xi->grank;
+      out->usec = 0;
+      (*ctx->nx_map)[xi->idx].grank = xi->grank;
+    }
+    out->hret = HG_SUCCESS;
+
+    if (ctx->failed.load()) {       /* don't start new work after error */
+      out->hret = HG_OTHER_ERROR;
+      nx_lookup_unref(ctx);
+    } else if (xi->grank != ctx->nx->grank) {
+      out->start = nx_now_usec();
+      hret = HG_Addr_lookup(mercury_progressor_hgcontext(ctx->phand),
+                            &nx_lookup_cb, out,
+                            nx_addr_decode(ctx->fmt, xi->addr,
+                                           ctx->strs + eff_i * ctx->fmt->strsz,
+                                           ctx->fmt->strsz),
+                            HG_OP_ID_IGNORE);
+      if (hret == HG_SUCCESS)
+        return(1);                  /* nx_lookup_cb() will finish it */
+      out->hret = hret;
+      nx_win_update(ctx->win, 0, 0);
+      nx_lookup_failed(ctx, out);
+    } else {
+      hret = HG_Addr_self(mercury_progressor_hgclass(ctx->phand), &self_addr);
+      if (hret == HG_SUCCESS) {     /* directly add address to map */
+        (*ctx->nx_map)[xi->idx].addr = self_addr;
+      } else {
+        out->hret = hret;
+        ctx->failed.store(1);
+      }
+      nx_lookup_unref(ctx);
+    }
+  }
+
+  return(0);
+}
+
+/*
+ * nx_lookup_fill: start lookups until the window is full or we run out
+ */
+void nx_lookup_fill(struct nx_lookup_ctx* ctx) {
+  int n;
+
+  for (;;) {
+    n = ctx->inflight.load();
+    if (n >= ctx->win->limit.load()) return;
+    if (!ctx->inflight.compare_exchange_weak(n, n + 1)) continue;
+    if (nx_lookup_start(ctx) == 0) {
+      ctx->inflight.fetch_sub(1);
+      return;
+    }
+  }
+}
+
 /*
  * nx_lookup_cb: adress lookup callback function.  find our nx_lookup_out,
- * plug in the results of the lookup, and then notify the caller.
+ * plug in the results of the lookup, update the window, and refill it.
  */
 hg_return_t nx_lookup_cb(const struct hg_cb_info* info) {
   struct nx_lookup_out* const out = (struct nx_lookup_out*)info->arg;
+  struct nx_lookup_ctx* const ctx = out->ctx;
 
-  pthread_mutex_lock(&out->ctx->cb_mutex);
-
+  ctx->pending.fetch_add(1);        /* hold ctx while we are running */
+  ctx->inflight.fetch_sub(1);
+  out->usec = nx_now_usec() - out->start;
   out->hret = info->ret;
-  if (out->hret == HG_SUCCESS)
-    (*(out->ctx->nx_map))[out->idx] = info->info.lookup.addr;
-  out->ctx->done += 1;
+  if (out->hret == HG_SUCCESS) {
+    (*ctx->nx_map)[out->idx].addr = info->info.lookup.addr;
+    nx_win_update(ctx->win, out->usec, 1);
+    nx_hist_add(ctx->hist, out->usec);
+    nx_lookup_unref(ctx);
+  } else {
+    nx_win_update(ctx->win, 0, 0);
+    nx_lookup_failed(ctx, out);
+  }
 
-  pthread_cond_signal(&out->ctx->cb_cv);
-  pthread_mutex_unlock(&out->ctx->cb_mutex);
+  nx_lookup_fill(ctx);
+  nx_lookup_unref(ctx);
 
   return HG_SUCCESS;
 }
@@ -98,91 +334,77 @@ hg_return_t nx_lookup_cb(const struct hg_cb_info* info) {
  * @param phand the progressor to use for lookups
  * @param xarr xchg array with "xsize" entries
  * @param addrsz sizeof() one entry in xarr[]
- * @param map map to put results in
+ * @param fmt how the addresses in xarr[] are encoded
+ * @param map map to put results in (must be sized to hold all idx slots)
  * @return 0 or -1 on failure
  */
 int nx_lookup_addrs(nexus_ctx_t nx, progressor_handle_t *phand,
                     xchg_dat_t *xarr, int xsize, int addrsz,
-                    nexus_map_t *map) {
+                    const struct nx_addrfmt *fmt, nexus_map_t *map) {
   int retval = 0;               /* assume success, set to -1 on error */
   struct nx_lookup_ctx ctx;
-  struct nx_lookup_out* out;    /* array: out[0 .. (xsize-1)] */
-  int local, eff_offset, i;
+  int local, i, nslow, slowest;
   hg_return_t hret;
-  hg_addr_t self_addr;
 
+  if (xsize < 1)
+    return(0);
+
+  ctx.nx = nx;
+  ctx.phand = phand;
+  ctx.xarr = xarr;
+  ctx.xsize = xsize;
+  ctx.addrsz = addrsz;
+  ctx.fmt = fmt;
+  ctx.strs = NULL;
+  /* determine if we are local, use my rank as starting point */
+  local = (phand == nx->hg_local);
+  ctx.win = (local) ? &nx->lwin : &nx->rwin;
+  ctx.hist = (local) ? nx->lhist : nx->rhist;
+  ctx.eff_offset = (local) ? nx->lrank : nx->grank;
+  ctx.nx_map = map;
+  ctx.next = 0;
+  ctx.inflight = 0;
+  ctx.pending = xsize + 1;          /* +1 for us while we fill */
+  ctx.failed = 0;
+  ctx.nretry = 0;
+  ctx.finished = 0;
   pthread_mutex_init(&ctx.cb_mutex, NULL);
   pthread_cond_init(&ctx.cb_cv, NULL);
-  ctx.nx_map = map;
-  ctx.done = 0;
 
-  out = (struct nx_lookup_out*)malloc(sizeof(*out) * xsize);
-  if (!out) {
+  ctx.out = (struct nx_lookup_out*)calloc(xsize, sizeof(*ctx.out));
+  if (fmt->kind != NX_AF_STRING)
+    ctx.strs = (char*)malloc(xsize * fmt->strsz);
+  if (!ctx.out || (fmt->kind != NX_AF_STRING && !ctx.strs)) {
     fprintf(stderr, "nx_lookup_addrs: malloc failed\n");
     GOTO_DONE(-1);
   }
 
-  /* determine if we are local, use my rank as starting point */
-  local = (phand == nx->hg_local);
-  eff_offset = (local) ? nx->lrank : nx->grank;
-  i = 0;
+  /* fill the window, callbacks will keep it full from here on */
+  nx_lookup_fill(&ctx);
+  nx_lookup_unref(&ctx);
 
-  hret = HG_SUCCESS;
   pthread_mutex_lock(&ctx.cb_mutex);
-  while (hret == HG_SUCCESS && i < xsize) {
-    int remain = xsize - i;
-    int cando = (remain < nx->nx_limit) ? remain : nx->nx_limit;
-
-    /* start as many as we can */
-    while (hret == HG_SUCCESS && cando-- > 0) {
-      const int eff_i = (i + eff_offset) % xsize;
-
-      xchg_dat_t* const xi =
-          (xchg_dat_t*)(((char*)xarr) + eff_i * (sizeof(*xi) + addrsz));
-
-      out[eff_i].hret = HG_SUCCESS;
-      out[eff_i].idx = xi->idx;      /* map key to use */
-      out[eff_i].ctx = &ctx;
-
-      if (xi->grank != nx->grank) {
-        pthread_mutex_unlock(&ctx.cb_mutex);
-
-        hret = HG_Addr_lookup(mercury_progressor_hgcontext(phand),
-                              &nx_lookup_cb, &out[eff_i], xi->addr,
-                              HG_OP_ID_IGNORE);
-
-        pthread_mutex_lock(&ctx.cb_mutex);
-      } else {
-        hret = HG_Addr_self(mercury_progressor_hgclass(phand), &self_addr);
-
-        if (hret == HG_SUCCESS) { /* directly add address to map */
-          (*(ctx.nx_map))[xi->idx] = self_addr;
-
-          ctx.done += 1;
-        }
-      }
-
-      if (hret != HG_SUCCESS) {
-        out[eff_i].hret = hret;
-        ctx.done += 1;
-      }
-      i++;
-    }    /* cando */
-
-    while (ctx.done < i) { /* XXX: ok to break out if just one slot is free? */
-      pthread_cond_wait(&ctx.cb_cv, &ctx.cb_mutex);
-    }
-
-  }      /* i < xsize */
+  while (!ctx.finished)
+    pthread_cond_wait(&ctx.cb_cv, &ctx.cb_mutex);
   pthread_mutex_unlock(&ctx.cb_mutex);
 
   hret = HG_SUCCESS;
-  for (int j = 0; j < i; j++) {
-    const int eff_j = (j + eff_offset) % xsize;
-    if (out[eff_j].hret != HG_SUCCESS) {
-      hret = out[eff_j].hret;
-      break;
-    }
+  nslow = 0;
+  slowest = 0;
+  for (i = 0 ; i < xsize ; i++) {
+    if (ctx.out[i].hret != HG_SUCCESS && hret == HG_SUCCESS)
+      hret = ctx.out[i].hret;
+    if (ctx.out[i].usec >= (uint64_t)nx->nx_slowms * 1000) nslow++;
+    if (ctx.out[i].usec > ctx.out[slowest].usec) slowest = i;
+#ifdef NEXUS_DEBUG
+    fprintf(stderr, "NX-%d: lookup rank %d took %llu usec\n", nx->grank,
+            ctx.out[i].grank, (unsigned long long)ctx.out[i].usec);
+#endif
+  }
+  if (nslow) {
+    fprintf(stderr, "nx_lookup_addrs: NX-%d: %d slow lookup(s), "
+            "slowest was rank %d (%.3f ms)\n", nx->grank, nslow,
+            ctx.out[slowest].grank, ctx.out[slowest].usec / 1000.0);
   }
   if (hret != HG_SUCCESS) {
     fprintf(stderr, "nx_lookup_addrs: mercury lookup error %d\n", hret);
@@ -190,33 +412,258 @@ int nx_lookup_addrs(nexus_ctx_t nx, progressor_handle_t *phand,
   }
 
 done:
-  if (out) free(out);
+  if (ctx.out) free(ctx.out);
+  if (ctx.strs) free(ctx.strs);
   pthread_cond_destroy(&ctx.cb_cv);
   pthread_mutex_destroy(&ctx.cb_mutex);
   return(retval);
 }
 
+/*
+ * nx_shm_sync: make local root's updates to shmwin visible to local
+ * procs (collective over localcomm).  return -1 on error.
+ */
+int nx_shm_sync(nexus_ctx_t nx) {
+  if (MPI_Win_sync(nx->shmwin) != MPI_SUCCESS ||
+      MPI_Barrier(nx->localcomm) != MPI_SUCCESS ||
+      MPI_Win_sync(nx->shmwin) != MPI_SUCCESS)
+    return(-1);
+  return(0);
+}
+
+/*
+ * nx_shm_tables: allocate rank2node[], node2rep[], and node2srcrep[] in
+ * a segment shared by our local procs and have the local root fill in
+ * rank2node[].
+ * the local roots gather each node's local2global[] over repcomm
+ * rather than having every proc allgather its node id over mycomm.
+ * return -1 on error.
+ */
+int nx_shm_tables(nexus_ctx_t nx) {
+  int retval = 0;               /* assume success, set to -1 on error */
+  int *lsizes = NULL, *displs = NULL, *granks = NULL;
+  MPI_Aint sz;
+  int dispunit, i, r, err, gerr;
+
+  /*
+   * the local root owns the whole segment.
+   * layout: rank2node, node2rep (per rmap slot), node2srcrep
+   */
+  sz = (nx->lrank == 0) ? sizeof(int) * (nx->gsize + nx->nnodes *
+                                         (nx->nstripes + 1)) : 0;
+  if (MPI_Win_allocate_shared(sz, sizeof(int), MPI_INFO_NULL, nx->localcomm,
+                              &nx->shmbase, &nx->shmwin) != MPI_SUCCESS ||
+      MPI_Win_shared_query(nx->shmwin, 0, &sz, &dispunit,
+                           &nx->shmbase) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_shm_tables: shared window setup failed\n");
+    nx->shmwin = MPI_WIN_NULL;
+    return(-1);
+  }
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, nx->shmwin);  /* for MPI_Win_sync */
+  nx->rank2node = nx->shmbase;
+
+  if (nx->repcomm != MPI_COMM_NULL) {
+    lsizes = (int *)malloc(sizeof(int) * nx->nnodes);
+    displs = (int *)malloc(sizeof(int) * nx->nnodes);
+    granks = (int *)malloc(sizeof(int) * nx->gsize);
+    err = (!lsizes || !displs || !granks);
+    if (err) fprintf(stderr, "nx_shm_tables: malloc failed\n");
+    if (MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX,
+                      nx->repcomm) != MPI_SUCCESS || gerr)
+      GOTO_DONE(-1);            /* no local root does the allgather */
+    if (MPI_Allgather(&nx->lsize, 1, MPI_INT, lsizes, 1, MPI_INT,
+                      nx->repcomm) != MPI_SUCCESS) {
+      fprintf(stderr, "nx_shm_tables: lsize allgather failed\n");
+      GOTO_DONE(-1);
+    }
+    for (displs[0] = 0, i = 1 ; i < nx->nnodes ; i++) {
+      displs[i] = displs[i - 1] + lsizes[i - 1];
+    }
+    if (MPI_Allgatherv(nx->local2global, nx->lsize, MPI_INT, granks,
+                       lsizes, displs, MPI_INT, nx->repcomm) != MPI_SUCCESS) {
+      fprintf(stderr, "nx_shm_tables: local2global allgather failed\n");
+      GOTO_DONE(-1);
+    }
+    for (i = 0 ; i < nx->nnodes ; i++) {
+      for (r = 0 ; r < lsizes[i] ; r++) {
+        nx->rank2node[granks[displs[i] + r]] = i;
+      }
+    }
+  }
+
+done:
+  if (nx_shm_sync(nx) < 0) {
+    fprintf(stderr, "nx_shm_tables: sync failed\n");
+    retval = -1;
+  }
+  if (lsizes) free(lsizes);
+  if (displs) free(displs);
+  if (granks) free(granks);
+  return(retval);
+}
+
+/*
+ * nx_r2n_setup: look at the layout of rank2node[] and switch to a
+ * compressed form if we can.  the private dense table is freed if we
+ * don't need it (the shared one, if any, is left alone).
+ * return -1 on error.
+ */
+int nx_r2n_setup(nexus_ctx_t nx) {
+  struct nx_r2n* const r2n = &nx->r2n;
+
+  if (nx_r2n_build(r2n, nx->rank2node, nx->gsize, nx->nnodes) < 0) {
+    fprintf(stderr, "nx_r2n_setup: malloc runs failed\n");
+    return(-1);
+  }
+
+#ifdef NEXUS_DEBUG
+  fprintf(stderr, "NX-%d: rank2node kind=%d ppn=%d nruns=%d\n", nx->grank,
+          r2n->kind, r2n->ppn, r2n->nruns);
+#endif
+  if (r2n->kind != NX_R2N_DENSE && nx->shmwin == MPI_WIN_NULL) {
+    free(nx->rank2node);
+    nx->rank2node = NULL;
+  }
+  return(0);
+}
+
 } // namespace
 
-/* nx_mpisetup: setup our MPI comms.  return -1 on error. */
-int nx_mpisetup(nexus_ctx_t nx) {
-  int color;
+/*
+ * nx_lookup_recs: look up n encoded addresses (recs[] holds n fmt
+ * records) of ranks granks[] into map slots slots[].  this is
+ * nx_lookup_addrs() for callers outside of bootstrap that don't have
+ * an xchg array.  return -1 on error.
+ */
+int nx_lookup_recs(nexus_ctx_t nx, progressor_handle_t *phand,
+                   const struct nx_addrfmt *fmt, int n, const int *granks,
+                   const int *slots, const char *recs, nexus_map_t *map) {
+  const int xchg_sz = sizeof(xchg_dat_t) + fmt->recsz;
+  xchg_dat_t *xitem, *xarray;
+  int i, rv;
+
+  if (n < 1)
+    return(0);
+  xarray = (xchg_dat_t *)malloc(n * xchg_sz);
+  if (!xarray) {
+    fprintf(stderr, "nx_lookup_recs: malloc failed\n");
+    return(-1);
+  }
+  for (i = 0 ; i < n ; i++) {
+    xitem = (xchg_dat_t *)((char *)xarray + i * xchg_sz);
+    xitem->grank = granks[i];
+    xitem->idx = slots[i];
+    memcpy(xitem->addr, recs + i * fmt->recsz, fmt->recsz);
+  }
+  rv = nx_lookup_addrs(nx, phand, xarray, n, fmt->recsz, fmt, map);
+  free(xarray);
+  return(rv);
+}
+
+/* nx_win_init: init a lookup window */
+void nx_win_init(struct nx_lookup_win* w, int limit, int maxlimit,
+                 int adaptive) {
+  w->limit = limit;
+  w->maxlimit = (maxlimit < limit) ? limit : maxlimit;
+  w->adaptive = adaptive;
+  w->acks = 0;
+  w->base = 0;
+  w->srtt = 0;
+}
+
+/*
+ * nx_localsetup: get our grank/gsize from mycomm and set up localcomm
+ * and our lrank/lsize.  localcomm is split out of mycomm unless the app
+ * gave us one (applocal), then we copy it and check that its procs are
+ * all in mycomm and on our node.  the copy is a split keyed by global
+ * rank, since local2global[] must be sorted by global rank (see
+ * nx_rv_lmap_slot()) whatever order the app's comm is in.  collective
+ * over mycomm.  return -1 on error.
+ */
+int nx_localsetup(nexus_ctx_t nx) {
+  MPI_Group lgrp, ggrp;
+  MPI_Comm shm;
+  int bad, gbad, ssize, i;
+  std::vector<int> lranks, granks;
 
   /* mycomm is our global comm, get our global rank & size from it */
   if (MPI_Comm_rank(nx->mycomm, &nx->grank) != MPI_SUCCESS ||
       MPI_Comm_size(nx->mycomm, &nx->gsize) != MPI_SUCCESS) {
-    fprintf(stderr, "nx_mpisetup: can't get grank/gsize\n");
+    fprintf(stderr, "nx_localsetup: can't get grank/gsize\n");
     return(-1);
   }
 
   /* split out local procs into a new localcomm and get local rank/size */
-  if (MPI_Comm_split_type(nx->mycomm, MPI_COMM_TYPE_SHARED, 0,
-                          MPI_INFO_NULL, &nx->localcomm) != MPI_SUCCESS ||
-      MPI_Comm_rank(nx->localcomm, &nx->lrank) != MPI_SUCCESS         ||
+  if (nx->applocal == MPI_COMM_NULL) {
+    if (MPI_Comm_split_type(nx->mycomm, MPI_COMM_TYPE_SHARED, 0,
+                            MPI_INFO_NULL, &nx->localcomm) != MPI_SUCCESS ||
+        MPI_Comm_rank(nx->localcomm, &nx->lrank) != MPI_SUCCESS         ||
+        MPI_Comm_size(nx->localcomm, &nx->lsize) != MPI_SUCCESS) {
+      fprintf(stderr, "nx_localsetup: comm local split failed\n");
+      return(-1);
+    }
+    return(0);
+  }
+
+  if (MPI_Comm_split(nx->applocal, 0, nx->grank,
+                     &nx->localcomm) != MPI_SUCCESS                ||
+      MPI_Comm_rank(nx->localcomm, &nx->lrank) != MPI_SUCCESS   ||
       MPI_Comm_size(nx->localcomm, &nx->lsize) != MPI_SUCCESS) {
-    fprintf(stderr, "nx_mpisetup: comm local split failed\n");
+    fprintf(stderr, "nx_localsetup: app localcomm split failed\n");
+    return(-1);
+  }
+  lranks.resize(nx->lsize);
+  granks.resize(nx->lsize);
+  for (i = 0 ; i < nx->lsize ; i++)
+    lranks[i] = i;
+  bad = 0;
+  if (MPI_Comm_group(nx->localcomm, &lgrp) != MPI_SUCCESS) {
+    bad = 1;
+  } else {
+    if (MPI_Comm_group(nx->mycomm, &ggrp) != MPI_SUCCESS) {
+      bad = 1;
+    } else {
+      if (MPI_Group_translate_ranks(lgrp, nx->lsize, &lranks[0], ggrp,
+                                    &granks[0]) != MPI_SUCCESS)
+        bad = 1;
+      for (i = 0 ; !bad && i < nx->lsize ; i++) {
+        if (granks[i] == MPI_UNDEFINED || (i > 0 && granks[i] <= granks[i-1]))
+          bad = 1;                  /* not in mycomm (or out of order) */
+      }
+      MPI_Group_free(&ggrp);
+    }
+    MPI_Group_free(&lgrp);
+  }
+  if (MPI_Comm_split_type(nx->localcomm, MPI_COMM_TYPE_SHARED, 0,
+                          MPI_INFO_NULL, &shm) != MPI_SUCCESS) {
+    bad = 1;
+  } else {
+    if (MPI_Comm_size(shm, &ssize) != MPI_SUCCESS || ssize != nx->lsize)
+      bad = 1;
+    MPI_Comm_free(&shm);
+  }
+
+  /* everyone fails together so no one hangs in a later collective */
+  if (MPI_Allreduce(&bad, &gbad, 1, MPI_INT, MPI_MAX,
+                    nx->mycomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_localsetup: localcomm check reduce failed\n");
+    return(-1);
+  }
+  if (gbad) {
+    if (bad)
+      fprintf(stderr, "nx_localsetup: NX-%d: app localcomm has procs "
+              "not in comm or not on our node\n", nx->grank);
     return(-1);
   }
+  return(0);
+}
+
+/* nx_mpisetup: setup our MPI comms.  return -1 on error. */
+int nx_mpisetup(nexus_ctx_t nx) {
+  int color, minlsize;
+
+  if (nx_localsetup(nx) < 0)
+    return(-1);
 
   /* generate local2global[] - a mapping from local rank to global rank  */
   nx->local2global = (int *)malloc(sizeof(int) * nx->lsize);
@@ -256,7 +703,20 @@ int nx_mpisetup(nexus_ctx_t nx) {
       return(-1);
   }
 
+  /* stripes need their own rep on each node, so limit to smallest lsize */
+  if (nx->nstripes > 1) {
+    if (MPI_Allreduce(&nx->lsize, &minlsize, 1, MPI_INT, MPI_MIN,
+                      nx->mycomm) != MPI_SUCCESS) {
+      fprintf(stderr, "nx_mpisetup: min lsize reduce failed\n");
+      return(-1);
+    }
+    if (nx->nstripes > minlsize)
+      nx->nstripes = minlsize;
+  }
+
   /* generate rank2node[] - a mapping from global rank to its node id  */
+  if (nx->shm_tables)
+    return((nx_shm_tables(nx) < 0) ? -1 : nx_r2n_setup(nx));
   nx->rank2node = (int*)malloc(sizeof(int) * nx->gsize);
   if (!nx->rank2node) {
     fprintf(stderr, "nx_mpisetup: rank2node malloc failed\n");
@@ -268,67 +728,234 @@ int nx_mpisetup(nexus_ctx_t nx) {
     return(-1);
   }
 
-  return(0);
+  return(nx_r2n_setup(nx));
+}
+
+/*
+ * nx_build_reps: apply our rep policy to fill in node2srcrep[].  for
+ * the nic policy, each proc checks which rails' nics it is near and we
+ * share the result with our local procs.  NEXUS_REP_NIC may list one
+ * nic per rail (comma separated).  return -1 on error.
+ */
+int nx_build_reps(nexus_ctx_t nx) {
+  int retval = 0;               /* assume success, set to -1 on error */
+  int *elig = NULL, near, rail, err, gerr;
+  char nics[256], *nic, *next;
+
+  nx->rep.nodeid = nx->nodeid;
+  nx->rep.lsize = nx->lsize;
+  nx->rep.nnodes = nx->nnodes;
+  nx->rep.nrails = nx->nrails;
+  nx->rep.nstripes = nx->nstripes;
+  nx->rep.eligible = NULL;
+  nx->rep.grp = &nx->grp;           /* nx_build_groups() ran first */
+
+  if (nx->rep.policy == NX_REP_NIC) {
+    elig = (int *)malloc(sizeof(int) * nx->lsize);
+    err = (elig == NULL);
+    if (err) fprintf(stderr, "nx_build_reps: malloc eligible failed\n");
+    if (MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX,
+                      nx->localcomm) != MPI_SUCCESS || gerr)
+      GOTO_DONE(-1);            /* no one on our node does the allgather */
+    next = getenv("NEXUS_REP_NIC");
+    snprintf(nics, sizeof(nics), "%s", (next) ? next : "");
+    for (near = 0, next = nics, rail = 0 ; rail < nx->nrails ; rail++) {
+      nic = next;               /* "" (i.e. first hca) once we run out */
+      next += strcspn(next, ",");
+      if (*next) *next++ = '\0';
+      if (nx_rep_nearnic(nic) == 1) near |= (1 << rail);
+    }
+    if (MPI_Allgather(&near, 1, MPI_INT, elig, 1, MPI_INT,
+                      nx->localcomm) != MPI_SUCCESS) {
+      fprintf(stderr, "nx_build_reps: eligible allgather failed\n");
+      GOTO_DONE(-1);
+    }
+    nx->rep.eligible = elig;
+  }
+
+  if (nx->shmwin != MPI_WIN_NULL) {     /* local root fills shared copy */
+    nx->node2srcrep = nx->shmbase + nx->gsize +
+                      nx->nnodes * nx->nstripes;
+    if (nx->lrank == 0 && nx_rep_fill(&nx->rep, nx->node2srcrep) < 0)
+      retval = -1;
+    if (nx_shm_sync(nx) < 0) {
+      fprintf(stderr, "nx_build_reps: sync failed\n");
+      retval = -1;
+    }
+  } else {
+    nx->node2srcrep = (int *)malloc(sizeof(int) * nx->nnodes);
+    if (!nx->node2srcrep) {
+      fprintf(stderr, "nx_build_reps: malloc node2srcrep failed\n");
+      GOTO_DONE(-1);
+    }
+    if (nx_rep_fill(&nx->rep, nx->node2srcrep) < 0)
+      retval = -1;
+  }
+
+done:
+  nx->rep.eligible = NULL;      /* only valid during the fill */
+  nx->rep.grp = NULL;
+  if (elig) free(elig);
+  return(retval);
+}
+
+/*
+ * nx_build_groups: put nodes in groups, either by a key (the user's
+ * key from nexus_set_group_key() or the first grouphost chars of the
+ * hostname) or by node id / groupsize.  node reps allgather the local
+ * root's key and number the groups in order of their first node.
+ * leaves grp.ngroups at 1 if we are not grouping.  return -1 on error.
+ */
+int nx_build_groups(nexus_ctx_t nx) {
+  int retval = 0;               /* assume success, set to -1 on error */
+  struct nx_groups *grp = &nx->grp;
+  std::map<std::string, int> key2group;
+  char mykey[NX_GROUP_KEYSZ], *keys = NULL;
+  int bykey, i, g, err, gerr;
+
+  grp->ngroups = 1;
+  if (nx->nnodes <= 1 ||
+      (!nx->groupkey[0] && nx->grouphost <= 0 && nx->groupsize <= 0))
+    return(0);
+
+  /*
+   * every proc sets up groups, so agree on malloc failures over mycomm
+   * before anyone starts a collective or moves on to nx_build_reps().
+   */
+  bykey = (nx->groupkey[0] || nx->grouphost > 0);
+  grp->node2group = (int *)malloc(sizeof(int) * nx->nnodes);
+  if (bykey && nx->repcomm != MPI_COMM_NULL)
+    keys = (char *)malloc(sizeof(mykey) * nx->nnodes);
+  err = (!grp->node2group || (bykey && nx->repcomm != MPI_COMM_NULL &&
+                              !keys));
+  if (err) fprintf(stderr, "nx_build_groups: malloc failed\n");
+  if (MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX,
+                    nx->mycomm) != MPI_SUCCESS || gerr)
+    GOTO_DONE(-1);
+
+  if (bykey) {
+    memset(mykey, 0, sizeof(mykey));
+    if (nx->groupkey[0]) {
+      snprintf(mykey, sizeof(mykey), "%s", nx->groupkey);
+    } else {
+      if (gethostname(mykey, sizeof(mykey) - 1) != 0)
+        strcpy(mykey, "localhost");
+      if (nx->grouphost < NX_GROUP_KEYSZ)
+        mykey[nx->grouphost] = '\0';
+    }
+    if (nx->repcomm != MPI_COMM_NULL) {
+      if (MPI_Allgather(mykey, sizeof(mykey), MPI_BYTE, keys,
+                        sizeof(mykey), MPI_BYTE,
+                        nx->repcomm) != MPI_SUCCESS) {
+        fprintf(stderr, "nx_build_groups: key allgather failed\n");
+        GOTO_DONE(-1);
+      }
+      for (i = 0 ; i < nx->nnodes ; i++) {
+        std::string key(keys + i * sizeof(mykey));
+        g = key2group.insert(std::make_pair(key, (int)key2group.size()))
+            .first->second;
+        grp->node2group[i] = g;
+      }
+    }
+    if (MPI_Bcast(grp->node2group, nx->nnodes, MPI_INT, 0,
+                  nx->localcomm) != MPI_SUCCESS) {
+      fprintf(stderr, "nx_build_groups: local bcast node2group failed\n");
+      GOTO_DONE(-1);
+    }
+  } else {
+    for (i = 0 ; i < nx->nnodes ; i++)
+      grp->node2group[i] = i / nx->groupsize;
+  }
+
+  if (nx_groups_index(grp, nx->nnodes) < 0) {
+    fprintf(stderr, "nx_build_groups: malloc group tables failed\n");
+    GOTO_DONE(-1);
+  }
+  if (grp->ngroups == 1)         /* everyone in one group, don't bother */
+    GOTO_DONE(0);
+  grp->mygroup = grp->node2group[nx->nodeid];
+
+done:
+  if (retval != 0 || grp->ngroups == 1) {
+    grp->ngroups = 1;
+    if (grp->node2group) free(grp->node2group);
+    if (grp->gstart) free(grp->gstart);
+    if (grp->gnodes) free(grp->gnodes);
+    grp->node2group = grp->gstart = grp->gnodes = NULL;
+  }
+  if (keys) free(keys);
+  return(retval);
 }
 
 /* nx_build_lmap: build lmap.  return -1 on error. */
 int nx_build_lmap(nexus_ctx_t nx) {
   int retval = 0;               /* assume success, set to -1 on error */
-  char *myaddrstr;
-  int my_sz, xchg_sz, rv;
-  xchg_dat_t *xitem = NULL, *xarray = NULL;
+  char *myaddrstr, *myrec = NULL, *recs = NULL;
+  int xchg_sz, rv, r;
+  xchg_dat_t *xitem, *xarray = NULL;
+  double t = MPI_Wtime();
 
-  /* get my address, its length, and use MPI to get the max size for local */
+  /* get my address and agree on an exchange format (and max size) */
   myaddrstr = mercury_progressor_addrstring(nx->hg_local);
-  my_sz = strlen(myaddrstr) + 1;
-  if (MPI_Allreduce(&my_sz, &nx->laddrsz, 1, MPI_INT,
-                    MPI_MAX, nx->localcomm) != MPI_SUCCESS) {
-    fprintf(stderr, "nx_build_lmap: localcomm size reduce failed\n");
+  if (nx_addrfmt_setup(nx->localcomm, myaddrstr, &nx->lfmt) < 0) {
+    fprintf(stderr, "nx_build_lmap: localcomm addr format setup failed\n");
     return(-1);
   }
-  xchg_sz = sizeof(xchg_dat_t) + nx->laddrsz;
+  nx->laddrsz = nx->lfmt.strsz;
+  xchg_sz = sizeof(xchg_dat_t) + nx->lfmt.recsz;
 
   /* malloc buffers for MPI data exchange */
-  xitem = (xchg_dat_t *)malloc(xchg_sz);
+  myrec = (char *)malloc(nx->lfmt.recsz);
+  recs = (char *)malloc(nx->lsize * nx->lfmt.recsz);
   xarray = (xchg_dat_t *)malloc(nx->lsize * xchg_sz);
-  if (!xitem || !xarray) {
+  if (!myrec || !recs || !xarray) {
     fprintf(stderr, "nx_build_lmap: xchg malloc fail\n");
     GOTO_DONE(-1);
   }
-  xitem->grank = nx->grank;       /* my global rank */
-  xitem->idx = nx->grank;         /* use global rank as lmap key */
-  strcpy(xitem->addr, myaddrstr); /* copy addr over */
+  nx_addr_encode(&nx->lfmt, myaddrstr, myrec);
 
-  /* now exchange the local data */
-  if (MPI_Allgather(xitem, xchg_sz, MPI_BYTE, xarray, xchg_sz, MPI_BYTE,
-                nx->localcomm) != MPI_SUCCESS) {
-    fprintf(stderr, "nx_build_lmap: mpi all gather failed\n");
+  /*
+   * fire up local mercury before we publish our address.  that way
+   * anyone who gets our address can look it up right away and we don't
+   * need a barrier before the lookups.  we keep it running until
+   * nx_bootstrap_done() knows all local and remote lookups are done.
+   */
+  if (mercury_progressor_needed(nx->hg_local) != HG_SUCCESS) {
+    fprintf(stderr, "nx_build_lmap: progressor needed failed\n");
     GOTO_DONE(-1);
   }
 
-  /* now we need to fire up local mercury and do address lookups */
-  if (mercury_progressor_needed(nx->hg_local) != HG_SUCCESS) {
-    fprintf(stderr, "nx_build_lmap: progressor needed failed\n");
+  /*
+   * now exchange the local addresses.  we already know each local
+   * rank's global rank (local2global[]) and it uses its local rank as
+   * its lmap slot, so we only need to send the encoded address.
+   */
+  if (MPI_Allgather(myrec, nx->lfmt.recsz, MPI_BYTE, recs, nx->lfmt.recsz,
+                    MPI_BYTE, nx->localcomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_build_lmap: mpi all gather failed\n");
     GOTO_DONE(-1);
   }
+  for (r = 0 ; r < nx->lsize ; r++) {
+    xitem = (xchg_dat_t *)(((char *)xarray) + r * xchg_sz);
+    xitem->grank = nx->local2global[r];
+    xitem->idx = r;
+    memcpy(xitem->addr, recs + r * nx->lfmt.recsz, nx->lfmt.recsz);
+  }
 
-  MPI_Barrier(nx->localcomm);
+  /* now do the address lookups */
+  nx->lmap.assign(nx->lsize, nx_empty_mapent);
+  t = nx_phase_end(nx, NX_PH_LMAP_XCHG, t);
   rv = nx_lookup_addrs(nx, nx->hg_local, xarray, nx->lsize,
-                       nx->laddrsz, &nx->lmap);
+                       nx->lfmt.recsz, &nx->lfmt, &nx->lmap);
+  nx_phase_end(nx, NX_PH_LMAP_LOOKUP, t);
   if (rv < 0) {
     retval = -1;
     fprintf(stderr, "nx_build_lmap: nx_lookup_addrs failed\n");
   }
-  MPI_Barrier(nx->localcomm);
-
-  /* now we can stop mercury */
-  if (mercury_progressor_idle(nx->hg_local) != HG_SUCCESS) {
-    fprintf(stderr, "nx_build_lmap: progressor idle failed\n");
-    GOTO_DONE(-1);
-  }
 
 done:
-  if (xitem) free(xitem);
+  if (myrec) free(myrec);
+  if (recs) free(recs);
   if (xarray) free(xarray);
   return(retval);
 }
@@ -336,18 +963,28 @@ done:
 /* nx_build_rmap: build rmap.  return -1 on error. */
 int nx_build_rmap(nexus_ctx_t nx) {
   int retval = 0;               /* assume success, set to -1 on error */
-  char *myaddrstr, *rank2addr = NULL, *addrcpy = NULL;
-  int my_sz, xchg_sz, rv, *nodeinfo = NULL, *myinfo = NULL;
-  int M, i, P, c;
-  xchg_dat_t *xitem = NULL, *xarray = NULL;
-
-  /* get my address, its length, and use MPI to get the max size for remote */
-  myaddrstr = mercury_progressor_addrstring(nx->hg_remote);
-  my_sz = strlen(myaddrstr) + 1;
-  if (MPI_Allreduce(&my_sz, &nx->gaddrsz, 1, MPI_INT,
-                    MPI_MAX, nx->mycomm) != MPI_SUCCESS) {
-    fprintf(stderr, "nx_build_rmap: mycomm size reduce failed\n");
-    return(-1);
+  char *myaddrstr, *addrcpy = NULL, *laddrs = NULL;
+  char *sendbuf = NULL, *recvbuf = NULL, *scatbuf = NULL;
+  int xchg_sz, rv, *counts = NULL, *displs = NULL;
+  int i, c, r, s, nslots, rail, recsz, n, err, gerr;
+  xchg_dat_t *xitem, *xarray = NULL, *rarray = NULL;
+  double t = MPI_Wtime();
+
+  /*
+   * agree on an exchange format for each rail.  records for all rails
+   * use the largest record size so we can exchange them in one array.
+   */
+  nx->gaddrsz = recsz = 0;
+  for (rail = 0 ; rail < nx->nrails ; rail++) {
+    myaddrstr = mercury_progressor_addrstring(nx->hg_rail[rail]);
+    if (nx_addrfmt_setup(nx->mycomm, myaddrstr, &nx->rfmt[rail]) < 0) {
+      fprintf(stderr, "nx_build_rmap: mycomm addr format setup failed\n");
+      return(-1);
+    }
+    if (nx->rfmt[rail].strsz > nx->gaddrsz)
+      nx->gaddrsz = nx->rfmt[rail].strsz;
+    if (nx->rfmt[rail].recsz > recsz)
+      recsz = nx->rfmt[rail].recsz;
   }
 
   /*
@@ -358,195 +995,333 @@ int nx_build_rmap(nexus_ctx_t nx) {
     return(0);
 
   /*
-   * to setup the remote network, we need to know a) which remote peers we
-   * should connect to, and b) what are their addresses. but to accomplish a,
-   * we need to first prepare two auxiliary arrays: rank2addr which maps each
-   * rank to its remote address, and nodeinfo which is going to contain the
-   * manifest information for each remote node.
-   *
-   * our first step is to prepare the rank2addr array.
+   * to setup the remote network, each proc needs to know a) which remote
+   * peers it should connect to, and b) what are their addresses.  a node
+   * is our peer if our rep policy picked our lrank for it (node2srcrep[]),
+   * and the rep we talk to on remote node i is the proc node i's policy
+   * picked for our node.  so node j only ever needs one address from
+   * each remote node i.  rather than allgather every rank's address, we
+   * exchange just those in 3 steps:
+   * 1. gather our local procs' remote addresses (one per rail) to our
+   *    node rep (lroot)
+   * 2. node reps all-to-all one xchg_dat_t per node pair and stripe over
+   *    repcomm: node i sends node j the rank and address of its rep for
+   *    node j on each stripe (on the stripe's rail).  this also gives
+   *    us node2rep[].
+   * 3. each node rep broadcasts node2rep[] and scatters the xchg_dat_t's
+   *    to the local procs responsible for them (on localcomm)
+   * node reps handle O(nnodes) addresses, everyone else O(nnodes/lsize).
+   * with node groups, only the records for nodes in nx_rmap_needed()
+   * are scattered and looked up.
    */
-  rank2addr = (char *)malloc(nx->gsize * nx->gaddrsz);
-  if (!rank2addr) {
-    fprintf(stderr, "nx_build_rmap: rank2addr malloc failed\n");
-    GOTO_DONE(-1);
-  }
-  addrcpy = (char *)malloc(nx->gaddrsz);
-  if (!addrcpy) {
-    fprintf(stderr, "nx_build_rmap: addrcpy malloc failed\n");
-    GOTO_DONE(-1);
-  }
-  memset(addrcpy, 0, nx->gaddrsz);
-  snprintf(addrcpy, nx->gaddrsz, "%s", myaddrstr);
-  if (MPI_Allgather(addrcpy, nx->gaddrsz, MPI_BYTE,
-                    rank2addr, nx->gaddrsz, MPI_BYTE,
-                                            nx->mycomm) != MPI_SUCCESS) {
-    fprintf(stderr, "nx_build_rmap: rank2addr allgather failed\n");
-    GOTO_DONE(-1);
+  xchg_sz = sizeof(xchg_dat_t) + recsz;
+  nslots = nx->nnodes * nx->nstripes;   /* rmap size */
+
+  /* fire up remote mercury before publishing our address (see lmap) */
+  for (rail = 0 ; rail < nx->nrails ; rail++) {
+    if (mercury_progressor_needed(nx->hg_rail[rail]) != HG_SUCCESS) {
+      fprintf(stderr, "nx_build_rmap: progressor needed failed\n");
+      while (--rail >= 0)
+        mercury_progressor_idle(nx->hg_rail[rail]);
+      return(-1);
+    }
   }
-  free(addrcpy);
-  addrcpy = NULL;
+  if (nx->node2rep != NULL)         /* from a table file or shared topo */
+    return(nx_addrwin_rmap(nx, recsz));
+  if (nx->xchg != NX_XCHG_MPI)      /* only node2rep[] goes through reps */
+    return((nx_build_node2rep(nx) < 0) ? -1 : nx_addrwin_rmap(nx, recsz));
 
   /*
-   * we now prepare the nodeinfo array in 4 steps:
-   * 1. find max number of ranks per node
-   * 2. have eachnode rep construct a (M+1)-sized array containing
-   *    (#ranks, r0, r1, ...)
-   * 3. have node reps all-gather their (M+1)-sized arrays over repcomm
-   * 4. have each node rep broadcast the finished array (on localcomm)
+   * allocate all our buffers first and agree on malloc failures over
+   * mycomm, so no one is left waiting in the collectives below.
+   * we are responsible for the slots our policy gave us (but not our
+   * node), so we know how many records we get before the exchange.
    */
-
-  /* 1. get "M" - max ranks per node */
-  if (MPI_Allreduce(&nx->lsize, &M, 1, MPI_INT,
-                    MPI_MAX, nx->mycomm) != MPI_SUCCESS) {
-    fprintf(stderr, "nx_build_rmap: lsize allreduce failed\n");
-    GOTO_DONE(-1);
+  for (c = 0, i = 0 ; i < nslots ; i++) {
+    if (i / nx->nstripes != nx->nodeid &&
+        nx_srcrep_slot(nx, nx->node2srcrep, i / nx->nstripes,
+                       i % nx->nstripes) == nx->lrank &&
+        nx_rmap_needed(nx, i / nx->nstripes))
+      c++;
   }
+  addrcpy = (char *)malloc(nx->nrails * recsz);
+  xarray = (xchg_dat_t *)malloc((c ? c : 1) * xchg_sz);
+  if (nx->shmwin != MPI_WIN_NULL)       /* follows rank2node[] in shm */
+    nx->node2rep = nx->shmbase + nx->gsize;
+  else
+    nx->node2rep = (int*) malloc(sizeof(int) * nslots);
+  err = (!addrcpy || !xarray || !nx->node2rep);
+  if (nx->repcomm != MPI_COMM_NULL) {   /* we are a rep? */
+    laddrs = (char *)malloc(nx->lsize * nx->nrails * recsz);
+    sendbuf = (char *)malloc(nslots * xchg_sz);
+    recvbuf = (char *)malloc(nslots * xchg_sz);
+    counts = (int *)malloc(sizeof(int) * nx->lsize);
+    displs = (int *)malloc(sizeof(int) * nx->lsize);
+    scatbuf = (char *)malloc(nslots * xchg_sz);
+    err |= (!laddrs || !sendbuf || !recvbuf || !counts || !displs ||
+            !scatbuf);
+  }
+  if (err) fprintf(stderr, "nx_build_rmap: malloc xchg bufs failed\n");
+  if (MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX,
+                    nx->mycomm) != MPI_SUCCESS || gerr)
+    GOTO_DONE(-1);
 
-  /* now malloc nodeinfo */
-  nodeinfo = (int *) malloc(sizeof(int) * (M + 1) * nx->nnodes);
-  if (!nodeinfo) {
-    fprintf(stderr, "nx_build_rmap: malloc nodeinfo failed\n");
+  /* 1. gather local (encoded) addresses to the node rep */
+  for (rail = 0 ; rail < nx->nrails ; rail++) {
+    myaddrstr = mercury_progressor_addrstring(nx->hg_rail[rail]);
+    nx_addr_encode(&nx->rfmt[rail], myaddrstr, addrcpy + rail * recsz);
+  }
+  if (MPI_Gather(addrcpy, nx->nrails * recsz, MPI_BYTE, laddrs,
+                 nx->nrails * recsz, MPI_BYTE, 0,
+                 nx->localcomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_build_rmap: local addr gather failed\n");
     GOTO_DONE(-1);
   }
 
-  /* the next two steps are for reps only */
-  if (nx->repcomm != MPI_COMM_NULL) {   /* we are a rep? */
-    /* 2. reps prepare their info */
-    myinfo = (int *)malloc(sizeof(int) * (M + 1));
-    if (!myinfo) {
-      fprintf(stderr, "nx_build_rmap: malloc myinfo failed\n");
+  /* 2. reps exchange per node pair records */
+  if (nx->repcomm != MPI_COMM_NULL) {
+    for (i = 0 ; i < nslots ; i++) {
+      s = i % nx->nstripes;
+      /* our local rank that handles node i / nstripes on stripe s */
+      r = nx_srcrep_slot(nx, nx->node2srcrep, i / nx->nstripes, s);
+      rail = nx_rail_of(nx, i / nx->nstripes, s);
+      xitem = (xchg_dat_t *)(sendbuf + i * xchg_sz);
+      xitem->grank = nx->local2global[r];
+      xitem->idx = nx->nodeid * nx->nstripes + s;   /* receiver's slot */
+      memcpy(xitem->addr, laddrs + (r * nx->nrails + rail) * recsz, recsz);
+    }
+    if (MPI_Alltoall(sendbuf, nx->nstripes * xchg_sz, MPI_BYTE, recvbuf,
+                     nx->nstripes * xchg_sz, MPI_BYTE,
+                     nx->repcomm) != MPI_SUCCESS) {
+      fprintf(stderr, "nx_build_rmap: rep alltoall failed\n");
       GOTO_DONE(-1);
     }
-    myinfo[0] = nx->lsize;
-    for (i = 0 ; i < M ; i++)
-      myinfo[i+1] = (i < nx->lsize) ? nx->local2global[i] : -1;
+    for (i = 0 ; i < nslots ; i++) {
+      xitem = (xchg_dat_t *)(recvbuf + i * xchg_sz);
+      nx->node2rep[i] = xitem->grank;
+    }
+  }
 
-    /* 3. reps exchange their info over repcomm */
-    if (MPI_Allgather(myinfo, M+1, MPI_INT,
-                      nodeinfo, M+1, MPI_INT, nx->repcomm) != MPI_SUCCESS) {
-      fprintf(stderr, "nx_build_rmap: allgather nodeinfo failed\n");
+  /* 3. distribute node2rep[] and records to local procs */
+  if (nx->shmwin != MPI_WIN_NULL) {
+    if (nx_shm_sync(nx) < 0) {
+      fprintf(stderr, "nx_build_rmap: local sync node2rep failed\n");
       GOTO_DONE(-1);
     }
-
-    free(myinfo);
-    myinfo = NULL;
+  } else if (MPI_Bcast(nx->node2rep, nslots, MPI_INT, 0,
+                       nx->localcomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_build_rmap: local bcast node2rep failed\n");
+    GOTO_DONE(-1);
   }
 
-  /* 4. reps broadcast finished array on localcomm to all local procs */
-  if (MPI_Bcast(nodeinfo, (M+1) * nx->nnodes * sizeof(int), MPI_BYTE, 0,
-            nx->localcomm) != MPI_SUCCESS) {
-    fprintf(stderr, "nx_build_rmap: malloc local bcast nodeinfo failed\n");
+  if (nx->repcomm != MPI_COMM_NULL) {
+    /* bucket records by local rank (counts and displs in records) */
+    for (r = 0 ; r < nx->lsize ; r++) {
+      counts[r] = 0;
+    }
+    for (i = 0 ; i < nslots ; i++) {
+      if (i / nx->nstripes != nx->nodeid &&
+          nx_rmap_needed(nx, i / nx->nstripes))
+        counts[nx_srcrep_slot(nx, nx->node2srcrep, i / nx->nstripes,
+                              i % nx->nstripes)]++;
+    }
+    for (r = 0, c = 0 ; r < nx->lsize ; c += counts[r], r++) {
+      displs[r] = c;
+    }
+    for (i = 0 ; i < nslots ; i++) {
+      if (i / nx->nstripes == nx->nodeid ||
+          !nx_rmap_needed(nx, i / nx->nstripes)) continue;
+      r = nx_srcrep_slot(nx, nx->node2srcrep, i / nx->nstripes,
+                         i % nx->nstripes);
+      memcpy(scatbuf + displs[r]++ * xchg_sz, recvbuf + i * xchg_sz,
+             xchg_sz);
+    }
+    for (r = 0 ; r < nx->lsize ; r++) {   /* now convert to bytes */
+      displs[r] = (displs[r] - counts[r]) * xchg_sz;
+      counts[r] *= xchg_sz;
+    }
+    c = counts[0] / xchg_sz;    /* we are lrank 0 */
+  }
+  if (MPI_Scatterv(scatbuf, counts, displs, MPI_BYTE, xarray, c * xchg_sz,
+                   MPI_BYTE, 0, nx->localcomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_build_rmap: local scatter failed\n");
     GOTO_DONE(-1);
   }
 
-  /*
-   * now that we have nodeinfo[], we can build nx->node2rep[] which
-   * maps node number to its rep's global rank.
-   */
-  nx->node2rep = (int*) malloc(sizeof(int) * nx->nnodes);
-  if (!nx->node2rep) {
-    fprintf(stderr, "nx_build_rmap: malloc node2rep failed\n");
-    GOTO_DONE(-1);
+  nx->rmap.assign(nslots, nx_empty_mapent);
+  for (i = 0 ; i < nslots ; i++) {
+    nx->rmap[i].rail = nx_rail_of(nx, i / nx->nstripes, i % nx->nstripes);
   }
 
-  /*
-   * the representative for a node is one whose local rank is equal to our
-   * node's id modulo the remote node's lsize.
-   */
-  for (i = 0 ; i < nx->nnodes ; i++) {   /* foreach node i */
-#define IDX(i) (i * (M+1))
-    nx->node2rep[i] = nodeinfo[IDX(i) + 1 + (nx->nodeid % nodeinfo[IDX(i)])];
-#undef IDX
+  /* lookup addresses if we've got any (one batch per rail) */
+  t = nx_phase_end(nx, NX_PH_RMAP_XCHG, t);
+  if (nx->lazy_rmap) {              /* or save them for later */
+    if (nx_lazy_init(nx, c, recsz) < 0)
+      GOTO_DONE(-1);
+    for (i = 0 ; i < c ; i++) {
+      xitem = (xchg_dat_t *)((char *)xarray + i * xchg_sz);
+      nx_lazy_add(nx, xitem->idx, xitem->grank, xitem->addr);
+    }
+    GOTO_DONE(0);
   }
+  if (c != 0 && nx->nrails > 1) {
+    rarray = (xchg_dat_t *)malloc(c * xchg_sz);
+    if (!rarray) {
+      fprintf(stderr, "nx_build_rmap: malloc rarray failed\n");
+      GOTO_DONE(-1);
+    }
+  }
+  for (rail = 0 ; c != 0 && rail < nx->nrails ; rail++) {
+    if (nx->nrails == 1) {
+      rv = nx_lookup_addrs(nx, nx->hg_rail[0], xarray, c, recsz,
+                           &nx->rfmt[0], &nx->rmap);
+    } else {
+      for (n = 0, i = 0 ; i < c ; i++) {
+        xitem = (xchg_dat_t *)((char *)xarray + i * xchg_sz);
+        if (nx->rmap[xitem->idx].rail == rail)
+          memcpy((char *)rarray + n++ * xchg_sz, xitem, xchg_sz);
+      }
+      rv = (n == 0) ? 0 : nx_lookup_addrs(nx, nx->hg_rail[rail], rarray, n,
+                                          recsz, &nx->rfmt[rail], &nx->rmap);
+    }
+    if (rv < 0) {
+      retval = -1;
+      fprintf(stderr, "nx_build_rmap: nx_lookup_addrs failed\n");
+      break;
+    }
+  }
+  nx_phase_end(nx, NX_PH_RMAP_LOOKUP, t);
 
-  /* done with nodeinfo[] */
-  free(nodeinfo);
-  nodeinfo = NULL;
+done:
+  if (xarray) free(xarray);
+  if (rarray) free(rarray);
+  if (addrcpy) free(addrcpy);
+  if (laddrs) free(laddrs);
+  if (sendbuf) free(sendbuf);
+  if (recvbuf) free(recvbuf);
+  if (scatbuf) free(scatbuf);
+  if (counts) free(counts);
+  if (displs) free(displs);
 
-  /*
-   * we distribute 'nnodes' remote nodes among 'lsize' local procs.
-   *
-   * P = max possible number of peers we can be responsible for
-   */
-  P = (nx->nnodes / nx->lsize) + ((nx->nnodes % nx->lsize) ? 1 : 0);
+  return(retval);
+}
 
-  /*
-   * setup for the address lookups
-   */
-  xarray = (xchg_dat_t*)malloc(P * (sizeof(*xarray) + nx->gaddrsz));
-  if (!xarray) {
-    fprintf(stderr, "nx_build_rmap: malloc xarray failed\n");
-    GOTO_DONE(-1);
+/*
+ * nx_build_node2rep: fill in node2rep[] without moving any addresses,
+ * for exchanges that fetch just the records each proc needs (see
+ * NX_XCHG_RMA).  this is step 2 of nx_build_rmap() with only the ranks:
+ * node reps all-to-all the global rank of their rep for each node pair
+ * and stripe over repcomm and then share node2rep[] with their local
+ * procs.  return -1 on error.
+ */
+int nx_build_node2rep(nexus_ctx_t nx) {
+  const int nslots = nx->nnodes * nx->nstripes;
+  int *sendbuf = NULL, i, rv = 0, err, gerr;
+
+  /* the alltoall spans nodes, so agree on malloc failures over mycomm */
+  if (nx->shmwin != MPI_WIN_NULL)       /* follows rank2node[] in shm */
+    nx->node2rep = nx->shmbase + nx->gsize;
+  else
+    nx->node2rep = (int*) malloc(sizeof(int) * nslots);
+  if (nx->repcomm != MPI_COMM_NULL)
+    sendbuf = (int *)malloc(sizeof(int) * nslots);
+  err = (!nx->node2rep || (nx->repcomm != MPI_COMM_NULL && !sendbuf));
+  if (err) fprintf(stderr, "nx_build_node2rep: malloc failed\n");
+  if (MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX,
+                    nx->mycomm) != MPI_SUCCESS || gerr) {
+    if (sendbuf) free(sendbuf);
+    return(-1);
   }
 
-  /*
-   * a node (node, not a rank) is a peer iff its node id modulo our node's
-   * lsize is equal to our lrank.
-   */
-  i = nx->lrank;    /* i is a node number */
-  c = 0;            /* current entry# in xarray */
-  while (i < nx->nnodes) {
-#define NADDR(x, y, s) (&x[y * s])
-
-    char *raddr;
-
-    /* skip ourselves */
-    if (i == nx->nodeid) {
-      i += nx->lsize;
-      continue;
+  if (nx->repcomm != MPI_COMM_NULL) {
+    for (i = 0 ; i < nslots ; i++) {
+      sendbuf[i] = nx->local2global[nx_srcrep_slot(nx, nx->node2srcrep,
+                                    i / nx->nstripes, i % nx->nstripes)];
     }
+    if (MPI_Alltoall(sendbuf, nx->nstripes, MPI_INT, nx->node2rep,
+                     nx->nstripes, MPI_INT, nx->repcomm) != MPI_SUCCESS) {
+      fprintf(stderr, "nx_build_node2rep: rep alltoall failed\n");
+      rv = -1;
+    }
+    free(sendbuf);
+    if (rv < 0)
+      return(-1);
+  }
 
-    raddr = NADDR(rank2addr, nx->node2rep[i], nx->gaddrsz);
-
-    xitem = (xchg_dat_t *)(((char*)xarray) +
-                                     c * (sizeof(*xitem) + nx->gaddrsz));
-    xitem->idx = i;   /* use node id as address indexes */
-    xitem->grank = nx->node2rep[i];
-    strcpy(xitem->addr, raddr);
-
-    i += nx->lsize;
-    c++;
-
-#undef NADDR
+  if (nx->shmwin != MPI_WIN_NULL) {
+    if (nx_shm_sync(nx) < 0) {
+      fprintf(stderr, "nx_build_node2rep: local sync node2rep failed\n");
+      return(-1);
+    }
+  } else if (MPI_Bcast(nx->node2rep, nslots, MPI_INT, 0,
+                       nx->localcomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_build_node2rep: local bcast node2rep failed\n");
+    return(-1);
   }
+  return(0);
+}
 
-  free(rank2addr);
-  rank2addr = NULL;
+/*
+ * nx_bootstrap_done: wait for all procs to finish their lmap and rmap
+ * lookups (peers may still be looking us up until then) and then stop
+ * the mercury progressors started by nx_build_lmap() and nx_build_rmap().
+ * return -1 on error.
+ */
+int nx_bootstrap_done(nexus_ctx_t nx) {
+  int retval = 0, rail;
 
-  /* now we need to fire up remote mercury and do address lookups */
-  if (mercury_progressor_needed(nx->hg_remote) != HG_SUCCESS) {
-    fprintf(stderr, "nx_build_rmap: progressor needed failed\n");
-    GOTO_DONE(-1);
+  if (MPI_Barrier(nx->mycomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_bootstrap_done: barrier failed\n");
+    retval = -1;
+  }
+  if (mercury_progressor_idle(nx->hg_local) != HG_SUCCESS) {
+    fprintf(stderr, "nx_bootstrap_done: local progressor idle failed\n");
+    retval = -1;
+  }
+  for (rail = 0 ; nx->nnodes > 1 && rail < nx->nrails ; rail++) {
+    if (mercury_progressor_idle(nx->hg_rail[rail]) != HG_SUCCESS) {
+      fprintf(stderr, "nx_bootstrap_done: remote progressor idle failed\n");
+      retval = -1;
+    }
   }
 
+  return(retval);
+}
 
-  /* lookup addresses if we've got any */
-  MPI_Barrier(nx->mycomm);
-  if (c != 0) {
-    rv = nx_lookup_addrs(nx, nx->hg_remote, xarray, c, nx->gaddrsz, &nx->rmap);
-    if (rv < 0)
-      fprintf(stderr, "nx_build_rmap: nx_lookup_addrs failed\n");
-  }
-  MPI_Barrier(nx->mycomm);
+/*
+ * nx_build_rtab: build (or refresh) the dense route table of an
+ * unpublished snap s from s's maps.  entries are 16 bytes, so we align
+ * the table on a cache line to keep each entry within a single line.
+ * return -1 on error.
+ */
+int nx_build_rtab(nexus_ctx_t nx, struct nx_snap *s) {
+  void *mem;
+  int d;
 
-  /* now we can stop mercury */
-  if (mercury_progressor_idle(nx->hg_remote) != HG_SUCCESS) {
-    fprintf(stderr, "nx_build_rmap: progressor idle failed\n");
-    GOTO_DONE(-1);
+  if (s->rtab == NULL) {
+    if (posix_memalign(&mem, 64, sizeof(nexus_route_t) * nx->gsize) != 0) {
+      fprintf(stderr, "nx_build_rtab: rtab malloc failed\n");
+      return(-1);
+    }
+    s->rtab = (nexus_route_t *)mem;
   }
 
-  free(xarray);
-  xarray = NULL;
-
-done:
-  if (xarray) free(xarray);
-  if (rank2addr) free(rank2addr);
-  if (addrcpy) free(addrcpy);
-  if (nodeinfo) free(nodeinfo);
-  if (myinfo) free(myinfo);
+  /*
+   * don't let nx_route() start lazy lookups for every entry (readers
+   * may be routing, so we can't touch nx->lazy).  unresolved entries
+   * stay NX_NOTFOUND and nexus_next_hop() falls back to nx_route() for
+   * them.
+   */
+  for (d = 0 ; d < nx->gsize ; d++) {
+    nexus_route_t *rt = &s->rtab[d];
+    int rail = -1;
+    rt->rank = -1;
+    rt->addr = HG_ADDR_NULL;
+    rt->type = nx_route(nx, s, d, &rt->rank, &rt->addr, &rail, 0);
+    rt->rail = rail;
+  }
 
-  return(retval);
+  return(0);
 }
 
 /* nx_destroy: do the actual work of disposing of an nctx */
@@ -554,13 +1329,20 @@ void nx_destroy(nexus_ctx_t nctx, int do_barrier) {
   nexus_map_t::iterator it;
   hg_class_t *cls;
   hg_context_t *ctx;
-
+  int rail;
+
+  if (nctx->lazy)                   /* wait for lookups before freeing */
+    nx_lazy_destroy(nctx);
+  nx_export_destroy(nctx);
+  nx_snap_destroy(nctx);            /* the tables, if we got that far */
+  if (nctx->repair)
+    nx_repair_destroy(nctx);
   if (nctx->hg_local) {
     cls = mercury_progressor_hgclass(nctx->hg_local);
     ctx = mercury_progressor_hgcontext(nctx->hg_local);
     for (it = nctx->lmap.begin(); it != nctx->lmap.end(); ++it) {
-      if (it->second != HG_ADDR_NULL) {
-        HG_Addr_free(cls, it->second);
+      if (it->addr != HG_ADDR_NULL) {
+        HG_Addr_free(cls, it->addr);
       }
     }
     mercury_progressor_freehandle(nctx->hg_local);
@@ -571,20 +1353,33 @@ void nx_destroy(nexus_ctx_t nctx, int do_barrier) {
     }
   }
 
+  if (nctx->shmwin != MPI_WIN_NULL) {  /* collective over localcomm */
+    MPI_Win_unlock_all(nctx->shmwin);
+    MPI_Win_free(&nctx->shmwin);
+    nctx->rank2node = NULL;               /* these were in shmwin */
+    nctx->node2rep = nctx->node2srcrep = NULL;
+  }
+  nx_tabfile_unmap(nctx);           /* NULLs tables that were mapped */
+  if (nctx->topo)                   /* NULLs tables that were shared */
+    nx_topo_unref(nctx);
+
   if (nctx->localcomm != MPI_COMM_NULL) {
     if (do_barrier)
       MPI_Barrier(nctx->localcomm);
     MPI_Comm_free(&nctx->localcomm);
   }
 
-  if (nctx->hg_remote) {
-    cls = mercury_progressor_hgclass(nctx->hg_remote);
-    for (it = nctx->rmap.begin(); it != nctx->rmap.end(); ++it) {
-      if (it->second != HG_ADDR_NULL) {
-        HG_Addr_free(cls, it->second);
-      }
+  if (nctx->direct)                 /* collective over mycomm */
+    nx_direct_destroy(nctx);
+  for (it = nctx->rmap.begin(); it != nctx->rmap.end(); ++it) {
+    if (it->addr != HG_ADDR_NULL) {  /* only set if we have its rail */
+      cls = mercury_progressor_hgclass(nctx->hg_rail[it->rail]);
+      HG_Addr_free(cls, it->addr);
     }
-    mercury_progressor_freehandle(nctx->hg_remote);
+  }
+  for (rail = 0 ; rail < nctx->nrails ; rail++) {
+    if (nctx->hg_rail[rail])
+      mercury_progressor_freehandle(nctx->hg_rail[rail]);
   }
 
   MPI_Barrier(nctx->mycomm);
@@ -594,8 +1389,18 @@ void nx_destroy(nexus_ctx_t nctx, int do_barrier) {
     MPI_Comm_free(&nctx->repcomm);
   }
 
+  if (nctx->dupcomm)
+    MPI_Comm_free(&nctx->mycomm);
+
   if (nctx->local2global) free(nctx->local2global);
   if (nctx->rank2node) free(nctx->rank2node);
+  if (nctx->r2n.runstart) free(nctx->r2n.runstart);
   if (nctx->node2rep) free(nctx->node2rep);
+  if (nctx->node2srcrep) free(nctx->node2srcrep);
+  if (nctx->stats) nx_stats_destroy(nctx);
+  if (nctx->grp.node2group) free(nctx->grp.node2group);
+  if (nctx->grp.gstart) free(nctx->grp.gstart);
+  if (nctx->grp.gnodes) free(nctx->grp.gnodes);
+  pthread_mutex_destroy(&nctx->snaplock);
   delete nctx;
 }
@@ -32,20 +32,167 @@
 
 #include <errno.h>
 #include <mpi.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <vector>
+
 #include "deltafs-nexus_api.h"
+#include "nexus_route.h"
+
+/*
+ * nexus_map_t: dense address map.  lmap is indexed by local rank and
+ * rmap is indexed by node id * nstripes + stripe (see nx_stripe_of()).
+ * unused slots have addr == HG_ADDR_NULL.
+ */
+typedef struct {
+  hg_addr_t addr;   /* peer's mercury address */
+  int grank;        /* peer's global rank */
+  int rail;         /* rail addr is on (always 0 in lmap) */
+} nexus_mapent_t;
+
+typedef std::vector<nexus_mapent_t> nexus_map_t;
+
+/*
+ * nexus_route_t: entry in the optional dense route table.  the table is
+ * indexed by destination global rank and caches nexus_next_hop() results.
+ */
+typedef struct {
+  hg_addr_t addr;   /* address of next hop */
+  int rank;         /* global rank of next hop */
+  short type;       /* nexus_ret_t hop type */
+  short rail;       /* rail of addr (-1 if not NX_DESTREP) */
+} nexus_route_t;
+
+/*
+ * nx_lookup_win: adaptive (AIMD) window for hg addr lookups.  we keep
+ * one per progressor, since na+sm and network lookups behave differently.
+ */
+struct nx_lookup_win {
+  std::atomic<int> limit;      /* current max lookups in flight */
+  int maxlimit;                /* upper bound for limit */
+  int adaptive;                /* zero means limit is fixed */
+  std::atomic<int> acks;       /* successes since last limit change */
+  std::atomic<uint64_t> base;  /* lowest lookup latency seen (usec) */
+  std::atomic<uint64_t> srtt;  /* smoothed lookup latency (usec) */
+};
+
+#define NX_LOOKUP_TRIES 3      /* max tries for a hg addr lookup */
+
+/*
+ * nx_addrfmt: how we encode mercury address strings for exchange over
+ * MPI.  if every rank's address is "<prefix>a.b.c.d:port" (NX_AF_IPPORT)
+ * or "<prefix><num><sep><num>" (NX_AF_PIDID, e.g. "na+sm://<pid>/0")
+ * with the same prefix, we only send the two packed numeric fields and
+ * rebuild the url right before the lookup.  otherwise (NX_AF_STRING)
+ * we send the url string padded to the largest address size.
+ */
+#define NX_AF_STRING   0        /* plain url string */
+#define NX_AF_IPPORT   1        /* packed ipv4 address and port */
+#define NX_AF_PIDID    2        /* packed pair of numbers (e.g. pid/id) */
+#define NX_AF_PREFIXSZ 48       /* max prefix we'll pack (incl. null) */
+
+struct nx_addrfmt {
+  int kind;                    /* NX_AF_* */
+  char sep;                    /* NX_AF_PIDID separator char */
+  char prefix[NX_AF_PREFIXSZ]; /* url prefix shared by all ranks */
+  int recsz;                   /* bytes of one encoded address */
+  int strsz;                   /* max string size of a decoded address */
+};
+
+/*
+ * address exchanges (see NEXUS_ADDR_XCHG).  NX_XCHG_MPI moves every
+ * rmap record through the reps with MPI collectives.  the others only
+ * exchange node2rep[] and then each proc fetches just the records it
+ * needs from an nx_addrwin, either with MPI one sided gets or with
+ * PMIx (NEXUS_PMIX builds only).
+ */
+#define NX_XCHG_MPI  0          /* collective record exchange (default) */
+#define NX_XCHG_RMA  1          /* fetch records from an MPI window */
+#define NX_XCHG_PMIX 2          /* fetch records from the PMIx server */
+
+/*
+ * nx_addrwin: our encoded addresses in an MPI window (or published with
+ * PMIx), for procs that already know which peers they need (see
+ * nx_addrwin_open())
+ */
+struct nx_addrwin {
+  MPI_Win win;                  /* window on mycomm */
+  struct nx_pmix* pmix;         /* PMIx state (NX_XCHG_PMIX only) */
+  char* recs;                   /* our records (exposed in win) */
+  int roff[NX_MAX_RAILS];       /* offset of each rail's record */
+  int loff;                     /* offset of our local record */
+};
 
-typedef std::map<int, hg_addr_t> nexus_map_t;
+/*
+ * nx_stats: routing counters (see NEXUS_STATS).  these are relaxed
+ * atomics, since nexus_next_hop() may be called from many threads and
+ * we only need the totals.  lslot[] and rslot[] are only allocated for
+ * per next hop counts and are indexed like lmap and rmap.
+ */
+struct nx_stats {
+  std::atomic<uint64_t> hops[NEXUS_STATS_NTYPES]; /* by nexus_ret_t */
+  std::atomic<uint64_t>* lslot;  /* lmap slot -> hops (NULL if off) */
+  std::atomic<uint64_t>* rslot;  /* rmap slot -> hops (NULL if off) */
+  int nlslots;                   /* lmap slots */
+  int nrslots;                   /* rmap slots */
+};
+
+/*
+ * nx_snap: one version of the routing tables that can change after
+ * bootstrap (the topology, i.e. rank2node[] and local2global[], can't).
+ * a snap is immutable once published.  readers get the current one
+ * with nx_snap_enter() and must not use it after nx_snap_exit().  an
+ * update copies the current snap (nx_snap_new()), changes the copy and
+ * publishes it.  the old snap is freed once every reader that could
+ * have seen it has exited (see nexus_snap.cc).  the addrs in ldead[]
+ * and rdead[] are the ones the update replaced, they are freed with
+ * the old snap.
+ */
+struct nx_snap {
+  uint64_t version;  /* 1 for the tables we bootstrapped with */
+  nexus_map_t lmap;  /* local rank -> that peer's local address */
+  nexus_map_t rmap;  /* remote node -> its rep's remote address */
+  int* node2rep;     /* rmap slot -> that rep's global rank */
+  int* node2srcrep;  /* node -> local rank of our rep for it (stripe 0) */
+  nexus_route_t* rtab; /* dest global rank -> next hop (NULL if disabled) */
+  int grank;         /* rank we route as (see nexus_set_grank()) */
+  int inshm;         /* node2rep[], node2srcrep[] in shmwin or tabmap */
+  std::atomic<int> pins;   /* nx_snap_pin() refs (e.g. iterators) */
+  uint64_t retired;  /* epoch we were replaced in (0 if current) */
+  nexus_map_t ldead; /* lmap addrs to free with us */
+  nexus_map_t rdead; /* rmap addrs to free with us */
+};
+
+/*
+ * nx_reader: a thread's read side state.  we keep one per thread (not
+ * per context), each on its own cache line so readers never write a
+ * line another thread reads.  records are never freed, a thread that
+ * exits gives its record back for reuse.
+ */
+struct nx_reader {
+  std::atomic<uint64_t> epoch;  /* epoch we entered in (0 if not reading) */
+  int depth;                    /* nested nx_snap_enter() calls */
+  std::atomic<int> inuse;       /* record belongs to a live thread */
+  struct nx_reader* next;       /* list of all records */
+  char pad[64 - 24];            /* keep records on separate lines */
+};
+
+extern std::atomic<uint64_t> nx_epoch; /* current epoch (never 0) */
+extern thread_local struct nx_reader* nx_self; /* this thread's record */
 
 /*
  * nexus_ctx: nexus internal state
  */
 struct nexus_ctx {
   MPI_Comm mycomm;  /* my top-level comm (e.g. comm world) */
+  int dupcomm;      /* true if mycomm is our own dup we must free */
+  MPI_Comm applocal; /* app's node local comm to dup (or MPI_COMM_NULL) */
+  int xchg;         /* rmap address exchange (NX_XCHG_*) */
   int grank;        /* my global rank */
   int gsize;        /* total number of ranks */
   int gaddrsz;      /* max string size needed for global address */
@@ -59,27 +206,297 @@ struct nexus_ctx {
   int laddrsz;      /* max string size needed for local address */
 
   int* local2global; /* local rank -> the local peer's global rank */
-  int* rank2node;    /* global rank -> its node id */
-  int* node2rep;     /* node -> its rep's global rank */
+  int* rank2node;    /* global rank -> its node id (see nx_rank2node) */
+  struct nx_r2n r2n; /* how we map global rank to node id */
+  int* node2rep;     /* rmap slot -> that rep's global rank */
+  int* node2srcrep;  /* node -> local rank of our rep for it (stripe 0) */
+  int nstripes;      /* rep pairs per node pair (stripe width) */
+  struct nx_repinfo rep; /* rep policy we bootstrapped with */
+  struct nx_groups grp;  /* node groups (if grp.ngroups > 1) */
+  char groupkey[NX_GROUP_KEYSZ]; /* nexus_set_group_key() key */
+  int grouphost;     /* group by this many leading hostname chars */
+  int groupsize;     /* group by node id / groupsize */
 
-  nexus_map_t lmap; /* local peer's global rank -> that peer's local address */
+  /*
+   * bootstrap builds lmap, rmap, node2rep[] and node2srcrep[] here and
+   * nx_snap_new() then moves them to the first snap.  after that they
+   * are empty and all routing goes through the current snap.
+   */
+  nexus_map_t lmap; /* local rank -> that peer's local address */
   nexus_map_t rmap; /* remote node -> its rep's remote address */
 
+  std::atomic<struct nx_snap*> snap; /* current tables (NULL in bootstrap) */
+  pthread_mutex_t snaplock;   /* held from nx_snap_new() to publish */
+  std::vector<struct nx_snap*> retired; /* replaced snaps, oldest first */
+  struct nx_direct* direct;   /* direct route cache (NULL if disabled) */
+  std::atomic<int> ndirect;   /* number of resolved direct routes */
+  struct nx_stats* stats;     /* routing counters (NULL if disabled) */
+  int lazy_rmap;              /* look up rmap entries on first use */
+  struct nx_lazy* lazy;       /* unresolved rmap entries (if lazy_rmap) */
+  struct nx_repair* repair;   /* dropped ranks (NULL until a repair) */
+  std::vector<struct nx_export*> exports; /* nexus_export() arrays */
+
+  double ptime[NX_NPHASES];   /* bootstrap time per phase (secs) */
+  std::atomic<uint64_t> lhist[NEXUS_HIST_NBUCKETS]; /* local lookups */
+  std::atomic<uint64_t> rhist[NEXUS_HIST_NBUCKETS]; /* remote lookups */
+
+  /*
+   * if shm_tables is set, rank2node[], node2rep[], and node2srcrep[]
+   * live in a segment shared by all local procs (shmwin).  the local
+   * root fills it in and everyone else only reads it.
+   */
+  int shm_tables;   /* non-zero to share tables with local procs */
+  MPI_Win shmwin;   /* shared window (MPI_WIN_NULL if not shared) */
+  int* shmbase;     /* base of local root's part of shmwin */
+
+  /*
+   * if we bootstrapped from NEXUS_TABLE_CACHE files, the topology
+   * tables point into their read only mappings (see nexus_tabfile.cc).
+   */
+  void* tabmap[2];  /* job and node file mappings (NULL if not mapped) */
+  size_t tablen[2]; /* their sizes */
+  struct nx_topo* topo; /* tables shared with other contexts (or NULL) */
+
   MPI_Comm localcomm;
   MPI_Comm repcomm;
 
-  progressor_handle_t *hg_remote;    /* dup'd handle, if !NULL */
+  progressor_handle_t *hg_rail[NX_MAX_RAILS]; /* dup'd remote handles */
+  int nrails;                        /* number of hg_rail[] in use */
   progressor_handle_t *hg_local;     /* dup'd handle, if !NULL */
   int internal_local;                /* true if we HG_Init'd hg_local */
 
-  /* max pending hg addr lookup requests */
+  /* max pending hg addr lookup requests (initial window size) */
   int nx_limit;
+  struct nx_lookup_win lwin;  /* lookup window for hg_local */
+  struct nx_lookup_win rwin;  /* lookup window for all hg_rail[] */
+  int nx_slowms;    /* report addr lookups that take longer than this */
+
+  int warmup;                 /* send warm up rpcs during bootstrap */
+  int warmup_limit;           /* max warm up rpcs in flight */
+  hg_id_t warmup_lid;         /* warm up rpc id for hg_local */
+  hg_id_t warmup_rid[NX_MAX_RAILS]; /* warm up rpc id for each rail */
+
+  struct nx_addrfmt lfmt;     /* exchange format for local addresses */
+  struct nx_addrfmt rfmt[NX_MAX_RAILS]; /* formats for remote addresses */
 };
 
+/*
+ * nx_rview_of: our view of nctx's routing tables (see nexus_route.h).
+ * node2srcrep and node2rep are either a snap's or (in bootstrap)
+ * nctx's.  the nx_* helpers below wrap the nx_rv_*() ones with it,
+ * the compiler folds the view away.
+ */
+inline struct nx_rview nx_rview_of(nexus_ctx_t nctx, const int* node2srcrep,
+                                   const int* node2rep) {
+  struct nx_rview rv;
+
+  rv.grank = nctx->grank;
+  rv.nodeid = nctx->nodeid;
+  rv.nnodes = nctx->nnodes;
+  rv.lsize = nctx->lsize;
+  rv.nstripes = nctx->nstripes;
+  rv.nrails = nctx->nrails;
+  rv.local2global = nctx->local2global;
+  rv.rank2node = nctx->rank2node;
+  rv.r2n = &nctx->r2n;
+  rv.grp = &nctx->grp;
+  rv.node2srcrep = node2srcrep;
+  rv.node2rep = node2rep;
+  return rv;
+}
+
+/*
+ * nx_rview_snap: our view of snap s's tables.  routes are computed as
+ * s->grank, which nexus_set_grank() can change by publishing a new snap.
+ */
+inline struct nx_rview nx_rview_snap(nexus_ctx_t nctx,
+                                     const struct nx_snap* s) {
+  struct nx_rview rv = nx_rview_of(nctx, s->node2srcrep, s->node2rep);
+
+  rv.grank = s->grank;
+  return rv;
+}
+
+/* nx_rank2node: return the node id of global rank "grank" */
+inline int nx_rank2node(nexus_ctx_t nctx, int grank) {
+  const struct nx_rview rv = nx_rview_of(nctx, NULL, NULL);
+  return nx_rv_rank2node(&rv, grank);
+}
+
+/* nx_lmap_slot: lmap slot of grank, or -1 if not local */
+inline int nx_lmap_slot(nexus_ctx_t nctx, int grank) {
+  const struct nx_rview rv = nx_rview_of(nctx, NULL, NULL);
+  return nx_rv_lmap_slot(&rv, grank);
+}
+
+/* nx_stripe_of: stripe that carries traffic to dest */
+inline int nx_stripe_of(nexus_ctx_t nctx, int dest) {
+  const struct nx_rview rv = nx_rview_of(nctx, NULL, NULL);
+  return nx_rv_stripe(&rv, dest);
+}
+
+/* nx_srcrep_slot: lmap slot of our rep for node destn on a stripe */
+inline int nx_srcrep_slot(nexus_ctx_t nctx, const int* node2srcrep,
+                          int destn, int stripe) {
+  const struct nx_rview rv = nx_rview_of(nctx, node2srcrep, NULL);
+  return nx_rv_srcrep_slot(&rv, destn, stripe);
+}
+
+/* nx_rail_of: rail for rmap slot (node, stripe) */
+inline int nx_rail_of(nexus_ctx_t nctx, int node, int stripe) {
+  const struct nx_rview rv = nx_rview_of(nctx, NULL, NULL);
+  return nx_rv_rail(&rv, node, stripe);
+}
+
+/* nx_group_gw: gateway node in group a for traffic to/from group b */
+inline int nx_group_gw(nexus_ctx_t nctx, int a, int b) {
+  const struct nx_rview rv = nx_rview_of(nctx, NULL, NULL);
+  return nx_rv_group_gw(&rv, a, b);
+}
+
+/* nx_group_hop: node we route towards to reach a rank on node destn */
+inline int nx_group_hop(nexus_ctx_t nctx, int destn, int* viagroup) {
+  const struct nx_rview rv = nx_rview_of(nctx, NULL, NULL);
+  return nx_rv_group_hop(&rv, destn, viagroup);
+}
+
+/* nx_rmap_needed: non-zero if we need the rmap addresses for node */
+inline int nx_rmap_needed(nexus_ctx_t nctx, int node) {
+  const struct nx_rview rv = nx_rview_of(nctx, NULL, NULL);
+  return nx_rv_rmap_needed(&rv, node);
+}
+
+/*
+ * nx_snap_enter: start reading nctx's tables and return the current
+ * snap.  this is a store to our own nx_reader and a fence, no locks.
+ * calls may nest (the outermost one sets our epoch).
+ */
+struct nx_reader* nx_reader_attach();
+uint64_t nx_reader_oldest();
+
+inline const struct nx_snap* nx_snap_enter(nexus_ctx_t nctx) {
+  struct nx_reader* r = nx_self;
+
+  if (r == NULL) r = nx_reader_attach();
+  if (r->depth++ == 0) {
+    r->epoch.store(nx_epoch.load(std::memory_order_acquire),
+                   std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+  return nctx->snap.load(std::memory_order_acquire);
+}
+
+/*
+ * nx_snap_exit: done with the snap from the matching nx_snap_enter()
+ */
+inline void nx_snap_exit() {
+  struct nx_reader* const r = nx_self;
+
+  if (--r->depth == 0) r->epoch.store(0, std::memory_order_release);
+}
+
+/*
+ * nx_phase_end: add the time since start to a bootstrap phase and
+ * return the current time (the start of the next phase).
+ */
+inline double nx_phase_end(nexus_ctx_t nctx, int phase, double start) {
+  const double now = MPI_Wtime();
+  nctx->ptime[phase] += now - start;
+  return now;
+}
+
+/*
+ * nx_stats_count: count a next hop lookup that returned ret for dest
+ * with next hop rank.  the caller checks that nctx->stats is set.
+ */
+inline void nx_stats_count(nexus_ctx_t nctx, nexus_ret_t ret, int dest,
+                           int rank) {
+  struct nx_stats* const st = nctx->stats;
+  int slot;
+
+  st->hops[ret].fetch_add(1, std::memory_order_relaxed);
+  if (st->lslot == NULL) return;
+  switch (ret) {
+    case NX_ISLOCAL:
+    case NX_SRCREP:
+      slot = nx_lmap_slot(nctx, rank);
+      if (slot != -1) st->lslot[slot].fetch_add(1, std::memory_order_relaxed);
+      break;
+    case NX_DESTREP:
+    case NX_GROUPREP:
+      slot = nx_rank2node(nctx, rank) * nctx->nstripes +
+             nx_stripe_of(nctx, dest);
+      st->rslot[slot].fetch_add(1, std::memory_order_relaxed);
+      break;
+    default:
+      break;
+  }
+}
+
 /*
  * internal function prototypes
  */
+int nx_build_reps(nexus_ctx_t nctx);
+int nx_build_groups(nexus_ctx_t nctx);
+int nx_addrfmt_setup(MPI_Comm comm, const char* myaddr,
+                     struct nx_addrfmt* fmt);
+void nx_addr_encode(const struct nx_addrfmt* fmt, const char* addr,
+                    void* rec);
+const char* nx_addr_decode(const struct nx_addrfmt* fmt, const void* rec,
+                           char* buf, int bufsz);
+int nx_addrwin_open(nexus_ctx_t nctx, struct nx_addrwin* aw);
+int nx_addrwin_get(nexus_ctx_t nctx, struct nx_addrwin* aw, int rail, int n,
+                   const int* granks, char* recs);
+void nx_addrwin_close(struct nx_addrwin* aw);
+int nx_addrwin_rmap(nexus_ctx_t nctx, int recsz);
+int nx_build_node2rep(nexus_ctx_t nctx);
+#ifdef NEXUS_PMIX
+int nx_pmix_open(nexus_ctx_t nctx, struct nx_addrwin* aw, int sz);
+int nx_pmix_get(struct nx_addrwin* aw, int off, int recsz, int n,
+                const int* granks, char* recs);
+void nx_pmix_close(struct nx_addrwin* aw);
+#endif
+void nx_win_init(struct nx_lookup_win* w, int limit, int maxlimit,
+                 int adaptive);
 int nx_build_lmap(nexus_ctx_t nctx);
 int nx_build_rmap(nexus_ctx_t nctx);
+int nx_build_rtab(nexus_ctx_t nctx, struct nx_snap* s);
+int nx_lookup_recs(nexus_ctx_t nctx, progressor_handle_t* phand,
+                   const struct nx_addrfmt* fmt, int n, const int* granks,
+                   const int* slots, const char* recs, nexus_map_t* map);
+void nx_repair_destroy(nexus_ctx_t nctx);
+void nx_export_destroy(nexus_ctx_t nctx);
+struct nx_snap* nx_snap_new(nexus_ctx_t nctx);
+void nx_snap_publish(nexus_ctx_t nctx, struct nx_snap* s);
+void nx_snap_abort(nexus_ctx_t nctx, struct nx_snap* s);
+struct nx_snap* nx_snap_pin(nexus_ctx_t nctx);
+void nx_snap_unpin(struct nx_snap* s);
+void nx_snap_destroy(nexus_ctx_t nctx);
+int nx_direct_init(nexus_ctx_t nctx, int cap);
+int nx_direct_get(nexus_ctx_t nctx, int dest, hg_addr_t* addr);
+void nx_direct_destroy(nexus_ctx_t nctx);
+int nx_stats_init(nexus_ctx_t nctx, int level);
+int nx_lazy_init(nexus_ctx_t nctx, int n, int recsz);
+void nx_lazy_add(nexus_ctx_t nctx, int slot, int grank, const char* rec);
+int nx_lazy_known(nexus_ctx_t nctx, int slot);
+nexus_ret_t nx_lazy_get(nexus_ctx_t nctx, int slot, hg_addr_t* addr);
+hg_addr_t nx_lazy_peek(nexus_ctx_t nctx, int slot);
+void nx_lazy_drop(nexus_ctx_t nctx, int slot, struct nx_snap* s);
+void nx_lazy_destroy(nexus_ctx_t nctx);
+void nx_stats_destroy(nexus_ctx_t nctx);
+int nx_bootstrap_done(nexus_ctx_t nctx);
+int nx_warmup_register(nexus_ctx_t nctx);
+int nx_warmup(nexus_ctx_t nctx);
+nexus_ctx_t nx_bootstrap(progressor_handle_t** nethands, int nrails,
+                         progressor_handle_t* localhand, MPI_Comm comm,
+                         int dupcomm, nexus_ctx_t base, MPI_Comm applocal);
 void nx_destroy(nexus_ctx_t nctx, int do_barrier);
+int nx_localsetup(nexus_ctx_t nctx);
 int nx_mpisetup(nexus_ctx_t nctx);
+int nx_tabfile_load(nexus_ctx_t nctx, const char* prefix);
+void nx_tabfile_save(nexus_ctx_t nctx, const char* prefix, int stripes);
+void nx_tabfile_unmap(nexus_ctx_t nctx);
+int nx_topo_share(nexus_ctx_t nctx, nexus_ctx_t base);
+void nx_topo_unref(nexus_ctx_t nctx);
+nexus_ret_t nx_route(nexus_ctx_t nctx, const struct nx_snap* s, int dest,
+                     int* rank, hg_addr_t* addr, int* rail, int lookup);
@@ -36,10 +36,66 @@
  */
 struct nexus_iter {
     nexus_ctx_t nctx;                          /* context that owns iterator */
-    int islocal;                               /*  is mapit for local? */
-    std::map<int,hg_addr_t>::iterator mapit;   /* the C++ iterator */
+    int islocal;                               /*  is map for local? */
+    struct nx_snap *snap;                      /* pinned snap map is in */
+    const nexus_map_t *map;                    /* map we are walking */
+    size_t slot;                               /* current map slot */
 };
 
+/*
+ * nx_export: one nexus_export() array.  it pins the snap it was built
+ * from, so the addrs in it stay valid until nexus_destroy().
+ */
+struct nx_export {
+    struct nx_snap *snap;                      /* pinned snap we are from */
+    int islocal;                               /* is array for local? */
+    int nunres;                                /* lazy entries w/o addr */
+    std::vector<nexus_export_t> ents;          /* the array */
+};
+
+namespace {
+/*
+ * nx_iter_addr: return the address of the iterator's current slot
+ * (which may have been resolved lazily)
+ */
+hg_addr_t nx_iter_addr(nexus_iter_t nit) {
+    hg_addr_t addr = (*nit->map)[nit->slot].addr;
+
+    if (addr == HG_ADDR_NULL && !nit->islocal && nit->nctx->lazy)
+        addr = nx_lazy_peek(nit->nctx, nit->slot);
+    return(addr);
+}
+
+/*
+ * nx_iter_skip: private utility function to advance the iterator past
+ * any unused map slots.
+ */
+void nx_iter_skip(nexus_iter_t nit) {
+    while (nit->slot < nit->map->size() && nx_iter_addr(nit) == HG_ADDR_NULL)
+        nit->slot++;
+}
+
+/*
+ * nx_export_refresh: fill in the addrs of x's lazy entries that have
+ * resolved since we built it.  this is done in place (w/snaplock), so
+ * lazy resolution doesn't make us build (and keep) a new array.
+ */
+void nx_export_refresh(nexus_ctx_t nctx, struct nx_export *x) {
+    hg_addr_t addr;
+    size_t i;
+
+    for (i = 0 ; x->nunres > 0 && i < x->ents.size() ; i++) {
+        if (x->ents[i].addr != HG_ADDR_NULL)
+            continue;
+        addr = nx_lazy_peek(nctx, x->ents[i].queue - nctx->lsize);
+        if (addr != HG_ADDR_NULL) {
+            x->ents[i].addr = addr;
+            x->nunres--;
+        }
+    }
+}
+}  // namespace
+
 /*
  * nexus_iter_alloc: allocate a new iterator.  nctx must remain active
  * while iter is allocated.  free iterator when done.
@@ -50,7 +106,10 @@ nexus_iter_t nexus_iter(nexus_ctx_t nctx, int local) {
     nit = new struct nexus_iter;   /* malloc */
     nit->nctx = nctx;
     nit->islocal = (local != 0);
-    nit->mapit = (nit->islocal) ? nctx->lmap.begin() : nctx->rmap.begin();
+    nit->snap = nx_snap_pin(nctx);     /* walk one version of the maps */
+    nit->map = (nit->islocal) ? &nit->snap->lmap : &nit->snap->rmap;
+    nit->slot = 0;
+    nx_iter_skip(nit);
     return(nit);
 }
 
@@ -59,6 +118,7 @@ nexus_iter_t nexus_iter(nexus_ctx_t nctx, int local) {
  */
 void nexus_iter_free(nexus_iter_t *nitp) {
     if (*nitp) {
+        nx_snap_unpin((*nitp)->snap);
         delete *nitp;
         *nitp = NULL;
     }
@@ -68,34 +128,31 @@ void nexus_iter_free(nexus_iter_t *nitp) {
  * nexus_iter_atend: return non-zero if we are at the end of the map
  */
 int nexus_iter_atend(nexus_iter_t nit) {
-    if (nit->islocal)
-        return(nit->mapit == nit->nctx->lmap.end());
-    return(nit->mapit == nit->nctx->rmap.end());
+    return(nit->slot >= nit->map->size());
 }
 
 /*
  * nexus_iter_advance: advance the iterator
  */
 void nexus_iter_advance(nexus_iter_t nit) {
-    if (!nexus_iter_atend(nit))
-        nit->mapit++;
+    if (!nexus_iter_atend(nit)) {
+        nit->slot++;
+        nx_iter_skip(nit);
+    }
 }
 
 /*
  * nexus_iter_addr: return current hgaddr of iterator
  */
 hg_addr_t nexus_iter_addr(nexus_iter_t nit) {
-    return(nit->mapit->second);
+    return(nx_iter_addr(nit));
 }
 
 /*
  * nexus_iter_globalrank: return current global rank of iterator
  */
 int nexus_iter_globalrank(nexus_iter_t nit) {
-    int subrank, grank;
-    subrank = nit->mapit->first;
-    grank = (nit->islocal) ? subrank : nit->nctx->node2rep[subrank];
-    return(grank);
+    return((*nit->map)[nit->slot].grank);
 }
 
 /*
@@ -103,6 +160,80 @@ int nexus_iter_globalrank(nexus_iter_t nit) {
  */
 int nexus_iter_subrank(nexus_iter_t nit) {
     int ret;
-    ret = (nit->islocal) ? 0 : nit->mapit->first;
+    ret = (nit->islocal) ? 0 : (int)nit->slot / nit->nctx->nstripes;
     return(ret);
 }
+
+/*
+ * nexus_iter_rail: return rail of iterator's current address
+ */
+int nexus_iter_rail(nexus_iter_t nit) {
+    return((*nit->map)[nit->slot].rail);
+}
+
+/*
+ * nexus_export: return a map as an array.  arrays are kept until
+ * nexus_destroy(), so we only build a new one when the maps change
+ * (i.e. once per snap).  lazily resolved addrs are filled in in place.
+ */
+const nexus_export_t *nexus_export(nexus_ctx_t nctx, int local, int *n) {
+    struct nx_export *x = NULL;
+    const nexus_map_t *map;
+    nexus_export_t ent;
+    struct nx_snap *s;
+    size_t i;
+    int held;
+
+    s = nx_snap_pin(nctx);
+    pthread_mutex_lock(&nctx->snaplock);
+    for (i = nctx->exports.size() ; i > 0 ; i--) {   /* newest first */
+        if (nctx->exports[i - 1]->islocal == (local != 0)) {
+            x = nctx->exports[i - 1];
+            break;
+        }
+    }
+    if (x && x->snap == s) {
+        nx_snap_unpin(s);                  /* x already holds it */
+        nx_export_refresh(nctx, x);
+    } else {
+        x = new struct nx_export;
+        x->snap = s;
+        x->islocal = (local != 0);
+        x->nunres = 0;
+        map = (x->islocal) ? &s->lmap : &s->rmap;
+        for (i = 0 ; i < map->size() ; i++) {
+            ent.addr = (*map)[i].addr;
+            held = (ent.addr != HG_ADDR_NULL);
+            if (!held && !x->islocal && nctx->lazy &&
+                nx_lazy_known(nctx, i)) {
+                ent.addr = nx_lazy_peek(nctx, i);
+                held = 1;
+                if (ent.addr == HG_ADDR_NULL) x->nunres++;
+            }
+            if (!held) continue;
+            ent.grank = (x->islocal) ? (*map)[i].grank : s->node2rep[i];
+            ent.subrank = (x->islocal) ? 0 : (int)i / nctx->nstripes;
+            ent.queue = (x->islocal) ? (int)i : nctx->lsize + (int)i;
+            ent.rail = (*map)[i].rail;
+            x->ents.push_back(ent);
+        }
+        nctx->exports.push_back(x);
+    }
+    pthread_mutex_unlock(&nctx->snaplock);
+
+    *n = (int)x->ents.size();
+    return((x->ents.empty()) ? NULL : &x->ents[0]);
+}
+
+/*
+ * nx_export_destroy: free all nexus_export() arrays
+ */
+void nx_export_destroy(nexus_ctx_t nctx) {
+    size_t i;
+
+    for (i = 0 ; i < nctx->exports.size() ; i++) {
+        nx_snap_unpin(nctx->exports[i]->snap);
+        delete nctx->exports[i];
+    }
+    nctx->exports.clear();
+}
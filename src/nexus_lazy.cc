@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_lazy.cc  on demand lookup of remote addresses
+ *
+ * with NEXUS_LAZY set, nx_build_rmap() exchanges the remote addresses
+ * as usual but only saves the encoded records of the rmap entries we
+ * hold (nx_lazy_add()) rather than looking them all up.  the first
+ * nexus_next_hop() that needs an unresolved entry starts its lookup and
+ * returns NX_PENDING.  the snaps are immutable, so resolved addresses
+ * are kept here (in addrs[]) rather than in the rmap.  a resolved entry
+ * only costs an extra load and bootstrap time no longer depends on how
+ * many nodes we might talk to.
+ *
+ * lookup callbacks run in the progressor's thread, so the entries are
+ * protected by a mutex.  readers only take it for entries that are not
+ * resolved yet.  as in nexus_direct.cc, finished lookups are idled by
+ * the next call in here.
+ */
+
+#include <assert.h>
+
+#include "nexus_internal.h"
+
+#define NX_LZ_LATER   0         /* not looked up yet (or will retry) */
+#define NX_LZ_PENDING 1         /* lookup in progress */
+#define NX_LZ_READY   2         /* addrs[] is set */
+#define NX_LZ_FAILED  3         /* gave up after NX_LOOKUP_TRIES tries */
+
+struct nx_lazy;
+
+struct nx_lzent {
+  struct nx_lazy* lz;           /* our nx_lazy */
+  int slot;                     /* rmap slot */
+  int grank;                    /* rank we are looking up */
+  int rail;                     /* rail of the slot */
+  int state;                    /* NX_LZ_* */
+  int tries;                    /* lookups started */
+};
+
+struct nx_lazy {
+  nexus_ctx_t nx;               /* context that owns us */
+  pthread_mutex_t lock;         /* protects everything below */
+  pthread_cond_t cv;            /* waiters for lookups sleep here */
+  std::vector<nx_lzent> ents;   /* entries we may look up */
+  std::atomic<hg_addr_t>* addrs; /* ents[] index -> resolved address */
+  std::vector<int> slot2ent;    /* rmap slot -> ents[] index (or -1) */
+  std::vector<char> recs;       /* encoded address of each entry */
+  int recsz;                    /* size of one recs[] record */
+  int pending;                  /* lookups in flight */
+  int unidled[NX_MAX_RAILS];    /* finished lookups not yet idled */
+  char* url;                    /* buffer for a decoded url */
+};
+
+namespace {
+/* nx_lazy_reap: idle the progressors for finished lookups (w/lock) */
+void nx_lazy_reap(struct nx_lazy* lz) {
+  int rail;
+
+  for (rail = 0 ; rail < lz->nx->nrails ; rail++) {
+    for ( ; lz->unidled[rail] > 0 ; lz->unidled[rail]--)
+      mercury_progressor_idle(lz->nx->hg_rail[rail]);
+  }
+}
+
+/* nx_lazy_cb: lookup callback, runs in the progressor's thread */
+hg_return_t nx_lazy_cb(const struct hg_cb_info* info) {
+  nx_lzent* const e = (nx_lzent*)info->arg;
+  struct nx_lazy* const lz = e->lz;
+
+  pthread_mutex_lock(&lz->lock);
+  if (e->state != NX_LZ_PENDING) {  /* dropped while pending */
+    if (info->ret == HG_SUCCESS)
+      HG_Addr_free(mercury_progressor_hgclass(lz->nx->hg_rail[e->rail]),
+                   info->info.lookup.addr);
+  } else if (info->ret == HG_SUCCESS) {
+    lz->addrs[e - &lz->ents[0]].store(info->info.lookup.addr,
+                                      std::memory_order_release);
+    e->state = NX_LZ_READY;
+  } else {
+    e->state = NX_LZ_LATER;         /* next caller retries it */
+  }
+  lz->pending--;
+  lz->unidled[e->rail]++;
+  pthread_cond_broadcast(&lz->cv);
+  pthread_mutex_unlock(&lz->lock);
+  return HG_SUCCESS;
+}
+
+/*
+ * nx_lazy_start: make sure entry i is resolved or being looked up
+ * (w/lock).  return NX_SUCCESS if it is resolved, NX_PENDING if its
+ * lookup is in progress, or NX_NOTFOUND if it failed for good.
+ */
+nexus_ret_t nx_lazy_start(struct nx_lazy* lz, int i) {
+  nexus_ctx_t nx = lz->nx;
+  nx_lzent* const e = &lz->ents[i];
+  const int rail = e->rail;
+  progressor_handle_t* const phand = nx->hg_rail[rail];
+  hg_return_t hret;
+
+  while (e->state == NX_LZ_LATER) {
+    if (e->tries++ >= NX_LOOKUP_TRIES ||
+        mercury_progressor_needed(phand) != HG_SUCCESS) {
+      fprintf(stderr, "nx_lazy_start: NX-%d: lookup rank %d failed\n",
+              nexus_global_rank(nx), e->grank);
+      e->state = NX_LZ_FAILED;
+      break;
+    }
+    e->state = NX_LZ_PENDING;
+    lz->pending++;
+    hret = HG_Addr_lookup(mercury_progressor_hgcontext(phand), &nx_lazy_cb,
+                          e, nx_addr_decode(&nx->rfmt[rail],
+                                            &lz->recs[i * lz->recsz],
+                                            lz->url, nx->rfmt[rail].strsz),
+                          HG_OP_ID_IGNORE);
+    if (hret != HG_SUCCESS) {       /* no callback coming, try again */
+      e->state = NX_LZ_LATER;
+      lz->pending--;
+      lz->unidled[rail]++;
+    }
+  }
+
+  if (e->state == NX_LZ_READY) return NX_SUCCESS;
+  return (e->state == NX_LZ_PENDING) ? NX_PENDING : NX_NOTFOUND;
+}
+}  // namespace
+
+/*
+ * nx_lazy_init: get ready to save up to "n" rmap entries with "recsz"
+ * byte records.  return -1 on error.
+ */
+int nx_lazy_init(nexus_ctx_t nx, int n, int recsz) {
+  struct nx_lazy* lz;
+  int rail, strsz;
+
+  lz = new nx_lazy;
+  lz->nx = nx;
+  pthread_mutex_init(&lz->lock, NULL);
+  pthread_cond_init(&lz->cv, NULL);
+  lz->ents.reserve(n);
+  lz->slot2ent.assign(nx->rmap.size(), -1);
+  lz->recs.reserve(n * recsz);
+  lz->recsz = recsz;
+  lz->addrs = new std::atomic<hg_addr_t>[(n > 0) ? n : 1];
+  lz->pending = 0;
+  for (strsz = 0, rail = 0 ; rail < NX_MAX_RAILS ; rail++) {
+    lz->unidled[rail] = 0;
+    if (rail < nx->nrails && nx->rfmt[rail].strsz > strsz)
+      strsz = nx->rfmt[rail].strsz;
+  }
+  lz->url = (char *)malloc(strsz);
+  nx->lazy = lz;                    /* nx_lazy_destroy() cleans up */
+
+  if (!lz->url) {
+    fprintf(stderr, "nx_lazy_init: malloc failed\n");
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * nx_lazy_add: save the encoded remote address of rank "grank" for rmap
+ * slot "slot" so we can look it up when it is first needed
+ */
+void nx_lazy_add(nexus_ctx_t nx, int slot, int grank, const char* rec) {
+  struct nx_lazy* const lz = nx->lazy;
+  nx_lzent e;
+
+  e.lz = lz;
+  e.slot = slot;
+  e.grank = grank;
+  e.rail = nx->rmap[slot].rail;
+  e.state = NX_LZ_LATER;
+  e.tries = 0;
+  lz->addrs[lz->ents.size()].store(HG_ADDR_NULL);
+  lz->slot2ent[slot] = lz->ents.size();
+  lz->ents.push_back(e);
+  lz->recs.insert(lz->recs.end(), rec, rec + lz->recsz);
+  nx->rmap[slot].grank = grank;
+}
+
+/*
+ * nx_lazy_known: return non-zero if rmap slot "slot" has an address we
+ * can look up
+ */
+int nx_lazy_known(nexus_ctx_t nx, int slot) {
+  return nx->lazy->slot2ent[slot] != -1;
+}
+
+/*
+ * nx_lazy_get: get the address of rmap slot "slot", starting its lookup
+ * if needed.  return NX_SUCCESS (addr set), NX_PENDING, or NX_NOTFOUND.
+ */
+nexus_ret_t nx_lazy_get(nexus_ctx_t nx, int slot, hg_addr_t* addr) {
+  struct nx_lazy* const lz = nx->lazy;
+  const int i = lz->slot2ent[slot];
+  nexus_ret_t rv;
+
+  if (i == -1) return NX_NOTFOUND;
+  if ((*addr = lz->addrs[i].load(std::memory_order_acquire)) != HG_ADDR_NULL)
+    return NX_SUCCESS;              /* resolved, no need to lock */
+  pthread_mutex_lock(&lz->lock);
+  nx_lazy_reap(lz);
+  rv = nx_lazy_start(lz, i);
+  if (rv == NX_SUCCESS) *addr = lz->addrs[i].load(std::memory_order_relaxed);
+  pthread_mutex_unlock(&lz->lock);
+  return rv;
+}
+
+/*
+ * nx_lazy_peek: return the address of rmap slot "slot" if it has been
+ * resolved (without starting a lookup), else HG_ADDR_NULL
+ */
+hg_addr_t nx_lazy_peek(nexus_ctx_t nx, int slot) {
+  struct nx_lazy* const lz = nx->lazy;
+  const int i = lz->slot2ent[slot];
+
+  if (i == -1) return HG_ADDR_NULL;
+  return lz->addrs[i].load(std::memory_order_acquire);
+}
+
+/*
+ * nx_lazy_drop: forget rmap slot "slot" for good (nexus_repair()
+ * changed or dropped its peer).  a resolved address goes to s's rdead
+ * list, since readers of older snaps may still be using it.  a lookup
+ * in progress is freed by its callback.
+ */
+void nx_lazy_drop(nexus_ctx_t nx, int slot, struct nx_snap* s) {
+  struct nx_lazy* const lz = nx->lazy;
+  const int i = lz->slot2ent[slot];
+  nexus_mapent_t ent;
+
+  if (i == -1) return;
+  pthread_mutex_lock(&lz->lock);
+  ent.addr = lz->addrs[i].exchange(HG_ADDR_NULL);
+  if (ent.addr != HG_ADDR_NULL) {
+    ent.grank = lz->ents[i].grank;
+    ent.rail = lz->ents[i].rail;
+    s->rdead.push_back(ent);
+  }
+  lz->ents[i].state = NX_LZ_FAILED;
+  pthread_mutex_unlock(&lz->lock);
+}
+
+/*
+ * nx_lazy_destroy: wait for lookups and free our records and the
+ * addresses we resolved
+ */
+void nx_lazy_destroy(nexus_ctx_t nx) {
+  struct nx_lazy* lz = nx->lazy;
+  hg_addr_t addr;
+  size_t i;
+
+  pthread_mutex_lock(&lz->lock);
+  while (lz->pending > 0)
+    pthread_cond_wait(&lz->cv, &lz->lock);
+  nx_lazy_reap(lz);
+  pthread_mutex_unlock(&lz->lock);
+
+  for (i = 0 ; i < lz->ents.size() ; i++) {
+    if ((addr = lz->addrs[i].load()) != HG_ADDR_NULL)
+      HG_Addr_free(mercury_progressor_hgclass(nx->hg_rail[lz->ents[i].rail]),
+                   addr);
+  }
+  delete[] lz->addrs;
+  if (lz->url) free(lz->url);
+  pthread_cond_destroy(&lz->cv);
+  pthread_mutex_destroy(&lz->lock);
+  delete lz;
+  nx->lazy = NULL;
+}
+
+/*
+ * nexus_prefetch: start looking up the rmap entries we hold for the
+ * nodes of dests (and wait for them if "wait" is set)
+ */
+nexus_ret_t nexus_prefetch(nexus_ctx_t nctx, const int* dests, int n,
+                           int wait) {
+  struct nx_lazy* lz;
+  nexus_ret_t rv, r;
+  int d, destn, viagroup, s, i;
+  assert(nctx != NULL);
+
+  if (n < 0 || (n > 0 && !dests)) return NX_INVAL;
+  if ((lz = nctx->lazy) == NULL) return NX_SUCCESS;   /* all resolved */
+
+  pthread_mutex_lock(&lz->lock);
+  for (;;) {
+    nx_lazy_reap(lz);
+    rv = NX_SUCCESS;
+    for (d = 0 ; d < n ; d++) {
+      if (dests[d] < 0 || dests[d] >= nctx->gsize) continue;
+      destn = nx_rank2node(nctx, dests[d]);
+      if (destn == nctx->nodeid) continue;
+      destn = nx_group_hop(nctx, destn, &viagroup);
+      for (s = 0 ; s < nctx->nstripes ; s++) {
+        i = lz->slot2ent[destn * nctx->nstripes + s];
+        if (i == -1) continue;      /* not ours to look up */
+        r = nx_lazy_start(lz, i);   /* also retries failed lookups */
+        if (r == NX_NOTFOUND || (r == NX_PENDING && rv == NX_SUCCESS))
+          rv = r;
+      }
+    }
+    if (!wait || rv != NX_PENDING) break;
+    pthread_cond_wait(&lz->cv, &lz->lock);   /* until a lookup is done */
+  }
+  pthread_mutex_unlock(&lz->lock);
+  return rv;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_part.cc  partition a batch of dests by next hop queue
+ *
+ * queue numbers are dense: queues [0, lsize) are the lmap slots (local
+ * ranks) and queues [lsize, lsize+nnodes*nstripes) are the rmap slots.
+ * if direct routes are enabled, the next queue collects dests that have
+ * one.  the last queue collects dests that nexus cannot route.
+ */
+
+#include <assert.h>
+
+#include "nexus_internal.h"
+
+namespace {
+thread_local std::vector<int> nx_part_qs;  /* nexus_partition() scratch */
+
+/*
+ * nx_queue_of: return the queue number of the next hop to dest in snap
+ * s.  nx_rv_step() gives us the hop's map slot.  a route table is built
+ * with nx_rv_step() from the same snap, so it would give the same hop.
+ */
+int nx_queue_of(nexus_ctx_t nctx, const struct nx_snap* s,
+                const struct nx_rview* rv, int dest) {
+  const int nrmap = nctx->lsize + nctx->nnodes * nctx->nstripes;
+  const int reject = nrmap + (nctx->direct != NULL);
+  int hop, next, slot;
+  hg_addr_t addr;
+
+  if (dest < 0 || dest >= nctx->gsize) return reject;
+  if (nctx->ndirect.load(std::memory_order_relaxed) > 0 &&
+      nx_direct_get(nctx, dest, &addr) == 0)
+    return nrmap;                   /* NX_DIRECT, as nexus_next_hop() */
+  hop = nx_rv_step(rv, dest, &next, &slot);
+  switch (hop) {
+    case NX_HOP_DONE:               /* to ourself */
+      slot = nx_rv_lmap_slot(rv, dest);
+      if (slot == -1) return reject;
+      /* FALLTHROUGH */
+    case NX_HOP_LOCAL:
+    case NX_HOP_SRCREP:
+      return (s->lmap[slot].addr == HG_ADDR_NULL) ? reject : slot;
+    default:                        /* NX_HOP_DESTREP, NX_HOP_GROUPREP */
+      if (s->rmap[slot].addr == HG_ADDR_NULL &&
+          (nctx->lazy == NULL || !nx_lazy_known(nctx, slot)))
+        return reject;
+      return nctx->lsize + slot;
+  }
+}
+}  // namespace
+
+/*
+ * nexus_partition_nqueues: number of queues used by nexus_partition
+ */
+int nexus_partition_nqueues(nexus_ctx_t nctx) {
+  assert(nctx != NULL);
+  return nctx->lsize + nctx->nnodes * nctx->nstripes +
+         (nctx->direct != NULL) + 1;
+}
+
+/*
+ * nexus_partition: counting sort a batch of dests by next hop queue.
+ * on return, perm[offsets[q]] .. perm[offsets[q+1]-1] are the indices
+ * (into dests[], in order) of the dests whose next hop is queue q.
+ */
+nexus_ret_t nexus_partition(nexus_ctx_t nctx, const int* dests, int n,
+                            int* offsets, int* perm) {
+  const struct nx_snap* s;
+  std::vector<int>& qs = nx_part_qs;
+  struct nx_rview rv;
+  int nq, q, i, sum;
+  assert(nctx != NULL);
+
+  if (n < 0 || !offsets || (n > 0 && (!dests || !perm)))
+    return NX_INVAL;
+  nq = nexus_partition_nqueues(nctx);
+  if ((int)qs.size() < n) qs.resize(n);
+  s = nx_snap_enter(nctx);
+  rv = nx_rview_snap(nctx, s);
+
+  /* find each dest's queue once and count dests per queue */
+  memset(offsets, 0, sizeof(*offsets) * (nq + 1));
+  for (i = 0 ; i < n ; i++)
+    offsets[qs[i] = nx_queue_of(nctx, s, &rv, dests[i])]++;
+  nx_snap_exit();
+
+  /* convert counts to end offsets */
+  for (q = 0, sum = 0 ; q < nq ; q++) {
+    sum += offsets[q];
+    offsets[q] = sum;
+  }
+  offsets[nq] = n;
+
+  /* scatter backwards so each queue keeps the order of dests[] */
+  for (i = n - 1 ; i >= 0 ; i--)
+    perm[--offsets[qs[i]]] = i;
+
+  return NX_SUCCESS;
+}
+
+/*
+ * nexus_partition_queue: get the next hop of a queue
+ */
+nexus_ret_t nexus_partition_queue(nexus_ctx_t nctx, int q, int* rank,
+                                  hg_addr_t* addr) {
+  const struct nx_snap* s;
+  nexus_ret_t ret;
+  assert(nctx != NULL);
+
+  if (q < 0 || q >= nexus_partition_nqueues(nctx) - 1)
+    return NX_INVAL;
+  if (q == nctx->lsize + nctx->nnodes * nctx->nstripes) {
+    *rank = -1;                     /* direct: each dest is its own hop */
+    *addr = HG_ADDR_NULL;
+    return NX_DIRECT;
+  }
+  s = nx_snap_enter(nctx);
+  if (q < nctx->lsize) {
+    *rank = nctx->local2global[q];
+    *addr = s->lmap[q].addr;
+    nx_snap_exit();
+    return (*addr == HG_ADDR_NULL) ? NX_NOTFOUND : NX_ISLOCAL;
+  }
+
+  q -= nctx->lsize;
+  if (s->rmap.empty()) {
+    nx_snap_exit();
+    return NX_NOTFOUND;
+  }
+  *rank = s->rmap[q].grank;
+  *addr = s->rmap[q].addr;
+  ret = NX_SUCCESS;
+  if (*addr == HG_ADDR_NULL)         /* not resolved yet if lazy */
+    ret = (nctx->lazy) ? nx_lazy_get(nctx, q, addr) : NX_NOTFOUND;
+  nx_snap_exit();                   /* after the lazy addr is loaded */
+  if (ret != NX_SUCCESS) return ret;
+  if (nctx->grp.ngroups > 1 &&
+      nctx->grp.node2group[q / nctx->nstripes] != nctx->grp.mygroup)
+    return NX_GROUPREP;
+  return NX_DESTREP;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_pmix.cc  fetch address records from the PMIx server
+ *
+ * with NEXUS_ADDR_XCHG=pmix, an nx_addrwin publishes our records with
+ * PMIx_Put() under a key that is new for each window and fences
+ * without collecting any data.  peers then PMIx_Get() just the records
+ * of the procs they need, which the resource manager's servers fetch
+ * from the owner's node on demand (direct modex).
+ *
+ * this only replaces the address exchange, it is not an MPI-free
+ * bootstrap: topology discovery, the lmap, node2rep[] and our key
+ * agreement still use MPI, so mycomm's procs must all be in our
+ * namespace with their MPI_COMM_WORLD rank as their PMIx rank (as with
+ * open mpi).
+ */
+
+#include <pmix.h>
+
+#include "nexus_internal.h"
+
+namespace {
+std::atomic<int> nx_pmix_seq(0);  /* last key sequence number used */
+}  // namespace
+
+/*
+ * nx_pmix: PMIx state of an nx_addrwin
+ */
+struct nx_pmix {
+  pmix_proc_t me;               /* our proc (has our nspace) */
+  int inited;                   /* true if we must PMIx_Finalize() */
+  MPI_Group grp;                /* mycomm's group */
+  MPI_Group wgrp;               /* MPI_COMM_WORLD's group (PMIx ranks) */
+  char key[PMIX_MAX_KEYLEN+1];  /* key our records are under */
+  int sz;                       /* size of each proc's records */
+};
+
+/*
+ * nx_pmix_open: publish the sz bytes of records in aw->recs and fence
+ * (collective over mycomm).  every proc in mycomm must agree on the key,
+ * so we take one past the largest sequence number anyone has used.
+ * return -1 on error.
+ */
+int nx_pmix_open(nexus_ctx_t nx, struct nx_addrwin* aw, int sz) {
+  struct nx_pmix* px;
+  std::vector<pmix_proc_t> procs;
+  std::vector<int> ranks, wranks;
+  pmix_value_t val;
+  int in[2], out[2], wrank, cmp, i, err = 0;
+
+  px = new nx_pmix;
+  px->inited = 0;
+  px->grp = px->wgrp = MPI_GROUP_NULL;
+  px->sz = sz;
+  aw->pmix = px;
+
+  if (PMIx_Init(&px->me, NULL, 0) != PMIX_SUCCESS) {
+    err = 1;
+  } else {
+    px->inited = 1;
+    if (MPI_Comm_rank(MPI_COMM_WORLD, &wrank) != MPI_SUCCESS ||
+        (pmix_rank_t)wrank != px->me.rank ||
+        MPI_Comm_group(nx->mycomm, &px->grp) != MPI_SUCCESS ||
+        MPI_Comm_group(MPI_COMM_WORLD, &px->wgrp) != MPI_SUCCESS)
+      err = 1;
+  }
+
+  /* fence just our comm's procs, or all of the namespace for comm world */
+  if (!err && MPI_Comm_compare(nx->mycomm, MPI_COMM_WORLD,
+                               &cmp) == MPI_SUCCESS &&
+      (cmp == MPI_IDENT || cmp == MPI_CONGRUENT)) {
+    procs.resize(1);
+    PMIX_LOAD_PROCID(&procs[0], px->me.nspace, PMIX_RANK_WILDCARD);
+  } else if (!err) {
+    ranks.resize(nx->gsize);
+    wranks.resize(nx->gsize);
+    for (i = 0 ; i < nx->gsize ; i++)
+      ranks[i] = i;
+    if (MPI_Group_translate_ranks(px->grp, nx->gsize, &ranks[0], px->wgrp,
+                                  &wranks[0]) != MPI_SUCCESS) {
+      err = 1;
+    } else {
+      procs.resize(nx->gsize);
+      for (i = 0 ; i < nx->gsize ; i++)
+        PMIX_LOAD_PROCID(&procs[i], px->me.nspace, wranks[i]);
+    }
+  }
+
+  /* agree on errors before the fence, so no one waits in it alone */
+  in[0] = err;
+  in[1] = nx_pmix_seq.load() + 1;
+  if (MPI_Allreduce(in, out, 2, MPI_INT, MPI_MAX,
+                    nx->mycomm) != MPI_SUCCESS || out[0]) {
+    if (err)
+      fprintf(stderr, "nx_pmix_open: NX-%d: PMIx init or rank translate "
+              "failed, or our PMIx rank is not our MPI_COMM_WORLD rank\n",
+              nx->grank);
+    return(-1);
+  }
+  nx_pmix_seq.store(out[1]);
+  snprintf(px->key, sizeof(px->key), "nexus.addrs.%d", out[1]);
+
+  val.type = PMIX_BYTE_OBJECT;
+  val.data.bo.bytes = aw->recs;
+  val.data.bo.size = sz;
+  if (PMIx_Put(PMIX_GLOBAL, px->key, &val) != PMIX_SUCCESS ||
+      PMIx_Commit() != PMIX_SUCCESS) {
+    fprintf(stderr, "nx_pmix_open: put %s failed\n", px->key);
+    err = 1;                        /* still fence, or peers will hang */
+  }
+  if (PMIx_Fence(&procs[0], procs.size(), NULL, 0) != PMIX_SUCCESS) {
+    fprintf(stderr, "nx_pmix_open: fence failed\n");
+    err = 1;
+  }
+  return(err ? -1 : 0);
+}
+
+/*
+ * nx_pmix_get: fetch the recsz byte record at off from each of n ranks
+ * into recs[].  return -1 on error.
+ */
+int nx_pmix_get(struct nx_addrwin* aw, int off, int recsz, int n,
+                const int* granks, char* recs) {
+  struct nx_pmix* px = aw->pmix;
+  std::vector<int> wranks(n);
+  pmix_value_t* val;
+  pmix_proc_t proc;
+  int i;
+
+  if (MPI_Group_translate_ranks(px->grp, n, (int*)granks, px->wgrp,
+                                &wranks[0]) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_pmix_get: rank translate failed\n");
+    return(-1);
+  }
+  for (i = 0 ; i < n ; i++) {
+    PMIX_LOAD_PROCID(&proc, px->me.nspace, wranks[i]);
+    if (PMIx_Get(&proc, px->key, NULL, 0, &val) != PMIX_SUCCESS) {
+      fprintf(stderr, "nx_pmix_get: get %s from %d failed\n", px->key,
+              granks[i]);
+      return(-1);
+    }
+    if (val->type != PMIX_BYTE_OBJECT || (int)val->data.bo.size != px->sz) {
+      fprintf(stderr, "nx_pmix_get: bad %s from %d\n", px->key, granks[i]);
+      PMIX_VALUE_RELEASE(val);
+      return(-1);
+    }
+    memcpy(recs + i * recsz, val->data.bo.bytes + off, recsz);
+    PMIX_VALUE_RELEASE(val);
+  }
+  return(0);
+}
+
+/*
+ * nx_pmix_close: free PMIx state.  our published records stay with the
+ * server until the job ends (PMIx can't unpublish them).
+ */
+void nx_pmix_close(struct nx_addrwin* aw) {
+  struct nx_pmix* px = aw->pmix;
+
+  if (px->grp != MPI_GROUP_NULL) MPI_Group_free(&px->grp);
+  if (px->wgrp != MPI_GROUP_NULL) MPI_Group_free(&px->wgrp);
+  if (px->inited) PMIx_Finalize(NULL, 0);
+  delete px;
+  aw->pmix = NULL;
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * nexus_rep.cc  rep selection policies
+ *
+ * a rep policy picks which of a node's local ranks handles the traffic
+ * between that node and each remote node.  the choice is used in both
+ * directions: node a's rep for node b is the srcrep for a's dests on b
+ * and it is also the destrep that b's rep for a sends to.  so a node
+ * only needs to make its own choices, and it learns the other nodes'
+ * choices in the nx_build_rmap() exchange.  nothing here uses MPI or
+ * mercury (nexus-plan links this file too).
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nexus_route.h"
+
+namespace {
+
+/* nx_rep_readint: read an int from a one line sysfs file */
+int nx_rep_readint(const char* path, int* val) {
+  FILE* fp;
+  int rv;
+
+  if ((fp = fopen(path, "r")) == NULL) return(-1);
+  rv = fscanf(fp, "%d", val);
+  fclose(fp);
+  return((rv == 1) ? 0 : -1);
+}
+
+/* nx_rep_nicnuma: return numa node of nic (or first hca if NULL), or -1 */
+int nx_rep_nicnuma(const char* nic) {
+  char path[PATH_MAX];
+  struct dirent* de;
+  DIR* dp;
+  int numa = -1;
+
+  if (nic == NULL || nic[0] == '\0') {
+    if ((dp = opendir("/sys/class/infiniband")) == NULL) return(-1);
+    while ((de = readdir(dp)) != NULL) {
+      if (de->d_name[0] == '.') continue;
+      if (snprintf(path, sizeof(path),
+                   "/sys/class/infiniband/%s/device/numa_node",
+                   de->d_name) >= (int)sizeof(path))
+        continue;                   /* name too long, skip it */
+      if (nx_rep_readint(path, &numa) == 0) break;
+    }
+    closedir(dp);
+    return(numa);
+  }
+
+  if (snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+               nic) < (int)sizeof(path) &&
+      nx_rep_readint(path, &numa) == 0)
+    return(numa);
+  if (snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node",
+               nic) < (int)sizeof(path) &&
+      nx_rep_readint(path, &numa) == 0)
+    return(numa);
+  return(-1);
+}
+
+/*
+ * nx_rep_cpusin: parse a sysfs cpulist (e.g. "0-7,16-23") into set.
+ * return -1 on error.
+ */
+int nx_rep_cpusin(const char* path, cpu_set_t* set) {
+  char buf[4096], *p, *ep;
+  long lo, hi;
+  FILE* fp;
+
+  if ((fp = fopen(path, "r")) == NULL) return(-1);
+  p = fgets(buf, sizeof(buf), fp);
+  fclose(fp);
+  if (p == NULL) return(-1);
+
+  CPU_ZERO(set);
+  while (isdigit((unsigned char)*p)) {
+    lo = hi = strtol(p, &ep, 10);
+    if (*ep == '-') hi = strtol(ep + 1, &ep, 10);
+    for ( ; lo <= hi && lo < CPU_SETSIZE ; lo++)
+      CPU_SET(lo, set);
+    p = (*ep == ',') ? ep + 1 : ep;
+  }
+  return(0);
+}
+
+} // namespace
+
+/*
+ * nx_rep_policy_byname: convert a policy name to NX_REP_* (-1 if bad)
+ */
+int nx_rep_policy_byname(const char* name) {
+  if (strcmp(name, "modulo") == 0) return(NX_REP_MODULO);
+  if (strcmp(name, "nic") == 0) return(NX_REP_NIC);
+  if (strcmp(name, "user") == 0) return(NX_REP_USER);
+  if (strcmp(name, "balanced") == 0) return(NX_REP_BALANCED);
+  return(-1);
+}
+
+/*
+ * nx_rep_nearnic: return 1 if all the cpus we may run on are in the numa
+ * node of the given nic (NULL means the first infiniband hca), 0 if not,
+ * and -1 if we can't tell.
+ */
+int nx_rep_nearnic(const char* nic) {
+  cpu_set_t mine, near;
+  char path[64];
+  int numa, c;
+
+  if ((numa = nx_rep_nicnuma(nic)) < 0) return(-1);
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           numa);
+  if (nx_rep_cpusin(path, &near) < 0) return(-1);
+  if (sched_getaffinity(0, sizeof(mine), &mine) != 0) return(-1);
+
+  for (c = 0 ; c < CPU_SETSIZE ; c++) {
+    if (CPU_ISSET(c, &mine) && !CPU_ISSET(c, &near)) return(0);
+  }
+  return(1);
+}
+
+/*
+ * nx_rep_fill: apply a rep policy.  set node2srcrep[i] to the local rank
+ * that handles node i for every node.  return -1 if the policy gave us
+ * a bad local rank.
+ *
+ * modulo gives local rank r the nodes r, r+lsize, ... including our
+ * own node, so when lsize does not divide nnodes (or our node id falls
+ * in a short residue class) some ranks get one more remote peer than
+ * others.  balanced only counts the nodes we need rmap entries for
+ * (all of them without groups, see nx_rv_rmap_needed()).  it takes
+ * the remote ones in node id order starting after our node and deals
+ * out their stripes round-robin starting at local rank (nodeid %
+ * lsize).  stripe s of a node is on the s'th rank after its stripe 0
+ * rep (see nx_rv_srcrep_slot()), so node k in that order starts at
+ * rank (nodeid + k * nstripes) % lsize.  every rank then has floor or
+ * ceil of (remote needed nodes * nstripes)/lsize rep links, and which
+ * ranks get the extra one rotates from node to node.  this balances
+ * the number of rep links per rank, not the traffic over them.  nodes
+ * we don't need (and our own) keep their modulo rep, it is not used.
+ *
+ * with more than one rail, nic picks reps for node i from the ranks near
+ * the nic of the rail that node i's stripe 0 is on (see nx_rv_rail()),
+ * so that the rep drives the hca it is closest to.
+ */
+int nx_rep_fill(const struct nx_repinfo* ri, int* node2srcrep) {
+  int *elig = NULL, nelig[NX_MAX_RAILS], rail, r, i, j, k;
+  struct nx_groups nogroups;
+  struct nx_rview rv;
+
+  if (ri->policy == NX_REP_NIC) {   /* list eligible local ranks per rail */
+    elig = (int*)malloc(sizeof(int) * ri->lsize * ri->nrails);
+    if (!elig) return(-1);
+    for (rail = 0 ; rail < ri->nrails ; rail++) {
+      int* const re = elig + rail * ri->lsize;
+      for (nelig[rail] = 0, r = 0 ; r < ri->lsize ; r++) {
+        if (ri->eligible[r] & (1 << rail)) re[nelig[rail]++] = r;
+      }
+      if (nelig[rail] == 0) {       /* nobody near the nic, use everyone */
+        for ( ; nelig[rail] < ri->lsize ; nelig[rail]++)
+          re[nelig[rail]] = nelig[rail];
+      }
+    }
+  }
+
+  if (ri->policy == NX_REP_BALANCED) {  /* deal out the needed nodes */
+    memset(&rv, 0, sizeof(rv));
+    memset(&nogroups, 0, sizeof(nogroups));
+    nogroups.ngroups = 1;
+    rv.nodeid = ri->nodeid;
+    rv.nnodes = ri->nnodes;
+    rv.grp = (ri->grp) ? ri->grp : &nogroups;
+    node2srcrep[ri->nodeid] = ri->nodeid % ri->lsize;
+    for (k = 0, j = 1 ; j < ri->nnodes ; j++) {
+      i = (ri->nodeid + j) % ri->nnodes;
+      node2srcrep[i] = (nx_rv_rmap_needed(&rv, i)) ?
+          (int)((ri->nodeid + (long)k++ * ri->nstripes) % ri->lsize) :
+          i % ri->lsize;
+    }
+  }
+
+  for (i = 0 ; i < ri->nnodes ; i++) {
+    switch (ri->policy) {
+      case NX_REP_NIC:
+        rail = (ri->nodeid + i) % ri->nrails;
+        r = elig[rail * ri->lsize + (i / ri->nrails) % nelig[rail]];
+        break;
+      case NX_REP_USER:
+        r = ri->fn(ri->arg, ri->nodeid, ri->lsize, ri->nnodes, i);
+        break;
+      case NX_REP_BALANCED:
+        r = node2srcrep[i];
+        break;
+      default:
+        r = i % ri->lsize;
+    }
+    if (r < 0 || r >= ri->lsize) {
+      fprintf(stderr, "nx_rep_fill: bad rep local rank %d for node %d\n",
+              r, i);
+      if (elig) free(elig);
+      return(-1);
+    }
+    node2srcrep[i] = r;
+  }
+
+  if (elig) free(elig);
+  return(0);
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_repair.cc  incremental repair of the routing tables
+ *
+ * when some ranks' endpoints go bad we don't want to tear down and
+ * bootstrap again.  nexus_repair() keeps a cumulative set of dropped
+ * ranks and recomputes only the node pairs that involve a changed
+ * node.  the rep pair for two nodes is the bootstrap pair, shifted
+ * to the next local ranks until every stripe's rep is up on that node.
+ * the shift only depends on the pair's bootstrap rep and the dropped
+ * ranks on the node, so both ends of a pair agree on it without
+ * talking.  we can't re-run the rep policy instead: its inputs (e.g.
+ * the nic policy's eligible ranks) are only known on the node itself.
+ * each proc exposes its encoded addresses (one per rail and the local
+ * one) in an MPI window and only fetches the ones its changed entries
+ * need.  all of that works on private copies, the changes are only
+ * copied into a new snap at the end, so readers keep using the old
+ * tables until it is published.
+ */
+
+#include <assert.h>
+
+#include "nexus_internal.h"
+
+/*
+ * nx_repair: repair state.  rep0 and srcrep0 are the bootstrap
+ * node2rep[] and node2srcrep[] that the shifts are relative to.
+ */
+struct nx_repair {
+  std::vector<char> down;       /* global rank -> non-zero if dropped */
+  std::vector<int> rep0;        /* bootstrap node2rep[] */
+  std::vector<int> srcrep0;     /* bootstrap node2srcrep[] */
+};
+
+namespace {
+/* nx_fetch: an address record to get from a rank's window */
+struct nx_fetch {
+  int grank;                    /* rank to get it from */
+  int slot;                     /* map slot to look it up into */
+  int rail;                     /* rail (-1 for the lmap) */
+};
+
+/*
+ * nx_node_ranks: put node's global ranks in rank order in list (for
+ * our node that is local2global[])
+ */
+void nx_node_ranks(nexus_ctx_t nx, int node, std::vector<int>* list) {
+  int r;
+
+  list->clear();
+  if (node == nx->nodeid) {
+    list->assign(nx->local2global, nx->local2global + nx->lsize);
+  } else if (nx->r2n.kind == NX_R2N_BLOCK) {
+    for (r = node * nx->r2n.ppn ; r < (node + 1) * nx->r2n.ppn &&
+         r < nx->gsize ; r++)
+      list->push_back(r);
+  } else if (nx->r2n.kind == NX_R2N_RR) {
+    for (r = node ; r < nx->gsize ; r += nx->nnodes)
+      list->push_back(r);
+  } else {
+    for (r = 0 ; r < nx->gsize ; r++)
+      if (nx_rank2node(nx, r) == node) list->push_back(r);
+  }
+}
+
+/*
+ * nx_shift: how many local ranks to move a node pair's reps from its
+ * bootstrap rep (list[b0]) so that all its stripes' reps are up.  if
+ * there aren't enough ranks left, settle for an up rep on stripe 0.
+ */
+int nx_shift(const std::vector<char>& down, const std::vector<int>& list,
+             int b0, int nstripes) {
+  const int l = list.size();
+  int t, s;
+
+  for (t = 0 ; t < l ; t++) {
+    for (s = 0 ; s < nstripes && !down[list[(b0 + t + s) % l]] ; s++)
+      ;
+    if (s == nstripes) return(t);
+  }
+  for (t = 0 ; t < l ; t++)
+    if (!down[list[(b0 + t) % l]]) return(t);
+  return(0);
+}
+
+/* nx_retire: move a map entry's addr to a dead list */
+void nx_retire(nexus_mapent_t* ent, nexus_map_t* dead) {
+  if (ent->addr == HG_ADDR_NULL) return;
+  dead->push_back(*ent);
+  ent->addr = HG_ADDR_NULL;
+}
+
+/*
+ * nx_repair_lookup: fetch the records of fetch list f from aw and look
+ * them up into got[] (one entry per fetch, not yet in any snap).
+ * return -1 on error.
+ */
+int nx_repair_lookup(nexus_ctx_t nx, struct nx_addrwin* aw,
+                     const std::vector<nx_fetch>& f, nexus_map_t* got) {
+  const nexus_mapent_t none = { HG_ADDR_NULL, -1, 0 };
+  std::vector<int> granks, slots;
+  std::vector<char> recs;
+  const struct nx_addrfmt* fmt;
+  int retval = 0, rail;
+  size_t i;
+
+  got->assign(f.size(), none);
+  for (rail = -1 ; rail < nx->nrails ; rail++) {
+    fmt = (rail < 0) ? &nx->lfmt : &nx->rfmt[rail];
+    granks.clear();
+    slots.clear();
+    for (i = 0 ; i < f.size() ; i++) {
+      if (f[i].rail != rail) continue;
+      granks.push_back(f[i].grank);
+      slots.push_back(i);
+    }
+    if (granks.empty()) continue;
+    recs.resize(granks.size() * fmt->recsz);
+    if (nx_addrwin_get(nx, aw, rail, granks.size(), &granks[0],
+                       &recs[0]) < 0)
+      return(-1);
+    if (nx_lookup_recs(nx, (rail < 0) ? nx->hg_local : nx->hg_rail[rail],
+                       fmt, granks.size(), &granks[0], &slots[0], &recs[0],
+                       got) < 0) {
+      fprintf(stderr, "nx_repair_lookup: lookups failed\n");
+      retval = -1;                  /* finish the other rails */
+    }
+  }
+
+  return(retval);
+}
+
+/* nx_repair_free: free the addrs nx_repair_lookup() got */
+void nx_repair_free(nexus_ctx_t nx, const std::vector<nx_fetch>& f,
+                    nexus_map_t* got) {
+  size_t i;
+
+  for (i = 0 ; i < got->size() ; i++) {
+    if ((*got)[i].addr == HG_ADDR_NULL) continue;
+    HG_Addr_free(mercury_progressor_hgclass((f[i].rail < 0) ? nx->hg_local :
+                 nx->hg_rail[f[i].rail]), (*got)[i].addr);
+  }
+  got->clear();
+}
+}  // namespace
+
+/*
+ * nx_repair_destroy: free the repair state
+ */
+void nx_repair_destroy(nexus_ctx_t nx) {
+  delete nx->repair;
+  nx->repair = NULL;
+}
+
+/*
+ * nexus_repair: drop or refresh ranks (collective over mycomm).  the
+ * exchange and lookups work from the current snap and private copies,
+ * snaplock is only held to copy our changes into a new snap and
+ * publish it.
+ */
+nexus_ret_t nexus_repair(nexus_ctx_t nctx, const int* ranks, int n,
+                         int drop) {
+  struct nx_repair* rp;
+  struct nx_snap* cur;
+  struct nx_snap* s;
+  std::vector<char> down, listed, changed;
+  std::vector<int> list, mine, srcrep, rep, lret, rret, rheld;
+  std::vector<nx_fetch> fetch;
+  nexus_map_t got;
+  nexus_map_t* map;
+  nx_fetch f;
+  struct nx_addrwin aw;
+  int err = 0, gerr, rail;
+  int i, x, st, q, h0, h1, p0, p1, all, l = 0, b0 = 0, t = 0;
+  nexus_ret_t rv = NX_SUCCESS;
+  assert(nctx != NULL);
+
+  if (n < 0 || (n > 0 && !ranks)) return NX_INVAL;
+  for (i = 0 ; i < n ; i++)         /* same list everywhere, so no MPI */
+    if (ranks[i] < 0 || ranks[i] >= nctx->gsize) return NX_INVAL;
+
+  if ((rp = nctx->repair) == NULL) {
+    rp = nctx->repair = new nx_repair;
+    rp->down.assign(nctx->gsize, 0);
+  }
+  down = rp->down;                  /* commit only if we get through */
+  listed.assign(nctx->gsize, 0);
+  changed.assign(nctx->nnodes, 0);
+  for (i = 0 ; i < n ; i++) {
+    down[ranks[i]] = (drop != 0);
+    listed[ranks[i]] = 1;
+    changed[nx_rank2node(nctx, ranks[i])] = 1;
+  }
+
+  cur = nx_snap_pin(nctx);          /* only repairs change the reps */
+  if (rp->srcrep0.empty()) {        /* first repair: save bootstrap reps */
+    rp->srcrep0.assign(cur->node2srcrep, cur->node2srcrep + nctx->nnodes);
+    if (cur->node2rep)
+      rp->rep0.assign(cur->node2rep,
+                      cur->node2rep + nctx->nnodes * nctx->nstripes);
+  }
+
+  /* lmap: drop or look up our listed local peers again */
+  for (i = 0 ; changed[nctx->nodeid] && i < nctx->lsize ; i++) {
+    if (!listed[nctx->local2global[i]]) continue;
+    lret.push_back(i);
+    if (drop) continue;
+    f.grank = nctx->local2global[i];
+    f.slot = i;
+    f.rail = -1;
+    fetch.push_back(f);
+  }
+
+  /*
+   * rmap: if our node changed, all our pairs may have new srcreps.
+   * otherwise only the pairs with a changed node do.  we retire the
+   * entries we no longer hold or whose peer changed (or is listed) and
+   * look up the ones we hold now.  lazy entries are dropped once we
+   * know the repair is going ahead.
+   */
+  all = changed[nctx->nodeid];
+  if (nctx->nnodes > 1) {
+    srcrep.assign(cur->node2srcrep, cur->node2srcrep + nctx->nnodes);
+    rep.assign(cur->node2rep, cur->node2rep + nctx->nnodes * nctx->nstripes);
+    nx_node_ranks(nctx, nctx->nodeid, &mine);
+  }
+  for (x = 0 ; all && nctx->nnodes > 1 && x < nctx->nnodes ; x++)
+    srcrep[x] = (rp->srcrep0[x] + nx_shift(down, mine, rp->srcrep0[x],
+                 nctx->nstripes)) % nctx->lsize;
+  for (x = 0 ; nctx->nnodes > 1 && x < nctx->nnodes ; x++) {
+    if (x == nctx->nodeid || (!all && !changed[x])) continue;
+    if (changed[x]) {               /* x's reps for us */
+      nx_node_ranks(nctx, x, &list);
+      l = list.size();
+      for (b0 = 0 ; b0 < l && list[b0] != rp->rep0[x * nctx->nstripes] ;
+           b0++)
+        ;
+      t = nx_shift(down, list, b0, nctx->nstripes);
+    }
+    for (st = 0 ; st < nctx->nstripes ; st++) {
+      q = x * nctx->nstripes + st;
+      h0 = nx_srcrep_slot(nctx, cur->node2srcrep, x, st);
+      h1 = nx_srcrep_slot(nctx, &srcrep[0], x, st);
+      p0 = rep[q];
+      if (changed[x]) rep[q] = list[(b0 + t + st) % l];
+      p1 = rep[q];
+      if (!nx_rmap_needed(nctx, x)) continue;
+      if (h0 == nctx->lrank && (h1 != h0 || p1 != p0 || listed[p0]))
+        rret.push_back(q);
+      if (h1 != nctx->lrank || (h0 == h1 && p1 == p0 && !listed[p1]))
+        continue;
+      rheld.push_back(q);
+      if (down[p1]) continue;       /* wait for a refresh */
+      f.grank = p1;
+      f.slot = q;
+      f.rail = cur->rmap[q].rail;
+      fetch.push_back(f);
+    }
+  }
+  nx_snap_unpin(cur);
+
+  /*
+   * publish our addresses.  like bootstrap, we run the progressors
+   * before that so peers can look us up right away, until everyone
+   * is done in nx_bootstrap_done().
+   */
+  if (mercury_progressor_needed(nctx->hg_local) != HG_SUCCESS)
+    err = 1;
+  for (rail = 0 ; !err && nctx->nnodes > 1 && rail < nctx->nrails ; rail++) {
+    if (mercury_progressor_needed(nctx->hg_rail[rail]) != HG_SUCCESS) {
+      while (--rail >= 0)
+        mercury_progressor_idle(nctx->hg_rail[rail]);
+      mercury_progressor_idle(nctx->hg_local);
+      err = 1;
+    }
+  }
+
+  /* fail together if anyone could not get this far */
+  if (MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX,
+                    nctx->mycomm) != MPI_SUCCESS || gerr) {
+    fprintf(stderr, "nexus_repair: NX-%d: setup failed\n",
+            nexus_global_rank(nctx));
+    if (!err) {
+      mercury_progressor_idle(nctx->hg_local);
+      for (rail = 0 ; nctx->nnodes > 1 && rail < nctx->nrails ; rail++)
+        mercury_progressor_idle(nctx->hg_rail[rail]);
+    }
+    return NX_ERROR;
+  }
+
+  /* failed lookups leave their entries unresolved */
+  if (nx_addrwin_open(nctx, &aw) < 0) {
+    rv = NX_ERROR;
+  } else {
+    if (nx_repair_lookup(nctx, &aw, fetch, &got) < 0)
+      rv = NX_ERROR;
+    nx_addrwin_close(&aw);
+  }
+  for (i = 0 ; i < n ; i++)         /* direct routes to listed ranks */
+    nexus_demote(nctx, ranks[i]);
+
+  /*
+   * now copy our changes into a new snap.  peers have moved on, so if
+   * we can't get one our tables stay as they were and we just fail.
+   */
+  if ((s = nx_snap_new(nctx)) == NULL) {
+    nx_repair_free(nctx, fetch, &got);
+    nx_bootstrap_done(nctx);
+    return NX_ERROR;
+  }
+  if (nctx->nnodes > 1) {
+    memcpy(s->node2srcrep, &srcrep[0], sizeof(int) * nctx->nnodes);
+    memcpy(s->node2rep, &rep[0], sizeof(int) * rep.size());
+  }
+  for (i = 0 ; i < (int)lret.size() ; i++)
+    nx_retire(&s->lmap[lret[i]], &s->ldead);
+  for (i = 0 ; i < (int)rret.size() ; i++) {
+    nx_retire(&s->rmap[rret[i]], &s->rdead);
+    s->rmap[rret[i]].grank = -1;
+    if (nctx->lazy) nx_lazy_drop(nctx, rret[i], s);
+  }
+  for (i = 0 ; i < (int)rheld.size() ; i++)
+    s->rmap[rheld[i]].grank = rep[rheld[i]];
+  for (i = 0 ; i < (int)got.size() ; i++) {
+    map = (fetch[i].rail < 0) ? &s->lmap : &s->rmap;
+    (*map)[fetch[i].slot].addr = got[i].addr;
+  }
+  if (s->rtab)                      /* already allocated, can't fail */
+    nx_build_rtab(nctx, s);
+  nx_snap_publish(nctx, s);
+  rp->down.swap(down);
+  if (nx_bootstrap_done(nctx) < 0)
+    rv = NX_ERROR;
+
+  return rv;
+}
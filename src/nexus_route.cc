@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_route.cc  table building that needs no MPI or mercury
+ *
+ * the library calls these from bootstrap once it has gathered the
+ * inputs, and nexus-plan calls them on a made up layout (see
+ * nexus_route.h).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nexus_route.h"
+
+/*
+ * nx_r2n_build: look at the layout of rank2node[] and pick its compressed
+ * form (see nx_r2n).  the caller frees rank2node[] if it is no longer
+ * needed (kind != NX_R2N_DENSE).  return -1 on error.
+ */
+int nx_r2n_build(struct nx_r2n* r2n, const int* rank2node, int gsize,
+                 int nnodes) {
+  int isblock, isrr, r, n;
+
+  /* node 0 has rank 0 (reps are ordered by grank), so its run is ppn */
+  for (r2n->ppn = 1 ; r2n->ppn < gsize &&
+       rank2node[r2n->ppn] == 0 ; r2n->ppn++)
+    /*null*/;
+
+  isblock = isrr = 1;
+  for (r = 0, n = 1 ; r < gsize ; r++) {
+    if (rank2node[r] != r / r2n->ppn) isblock = 0;
+    if (rank2node[r] != r % nnodes) isrr = 0;
+    if (r && rank2node[r] != rank2node[r - 1]) n++;
+  }
+
+  r2n->nruns = n;
+  r2n->runstart = r2n->runnode = NULL;
+  if (isblock) {
+    r2n->kind = NX_R2N_BLOCK;
+  } else if (isrr) {
+    r2n->kind = NX_R2N_RR;
+  } else if (2 * n < gsize) {           /* runs are smaller than dense */
+    r2n->runstart = (int *)malloc(sizeof(int) * 2 * n);
+    if (!r2n->runstart)
+      return(-1);
+    r2n->runnode = r2n->runstart + n;
+    for (r = 0, n = 0 ; r < gsize ; r++) {
+      if (r == 0 || rank2node[r] != rank2node[r - 1]) {
+        r2n->runstart[n] = r;
+        r2n->runnode[n] = rank2node[r];
+        n++;
+      }
+    }
+    r2n->kind = NX_R2N_RUNS;
+  } else {
+    r2n->kind = NX_R2N_DENSE;
+  }
+  return(0);
+}
+
+/*
+ * nx_groups_index: set ngroups from a filled in node2group[] and, if
+ * there is more than one group, counting sort the nodes by group into
+ * gstart[]/gnodes[].  mygroup is left to the caller.  return -1 on
+ * error (the caller frees whatever we allocated).
+ */
+int nx_groups_index(struct nx_groups* grp, int nnodes) {
+  int *pos, i, g;
+
+  grp->ngroups = 1;
+  for (i = 0 ; i < nnodes ; i++) {
+    if (grp->node2group[i] >= grp->ngroups)
+      grp->ngroups = grp->node2group[i] + 1;
+  }
+  if (grp->ngroups == 1)
+    return(0);
+
+  grp->gstart = (int *)malloc(sizeof(int) * (grp->ngroups + 1));
+  grp->gnodes = (int *)malloc(sizeof(int) * nnodes);
+  pos = (int *)malloc(sizeof(int) * grp->ngroups);
+  if (!grp->gstart || !grp->gnodes || !pos) {
+    if (pos) free(pos);
+    return(-1);
+  }
+  memset(grp->gstart, 0, sizeof(int) * (grp->ngroups + 1));
+  for (i = 0 ; i < nnodes ; i++)
+    grp->gstart[grp->node2group[i] + 1]++;
+  for (g = 0 ; g < grp->ngroups ; g++) {
+    grp->gstart[g + 1] += grp->gstart[g];
+    pos[g] = grp->gstart[g];
+  }
+  for (i = 0 ; i < nnodes ; i++)
+    grp->gnodes[pos[grp->node2group[i]]++] = i;
+  free(pos);
+  return(0);
+}
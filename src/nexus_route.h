@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+
+/*
+ * nexus_route.h  the routing computation, without MPI or mercury
+ *
+ * everything a rank needs to pick its reps and next hops is a function
+ * of the layout (rank2node[], each node's local2global[]), the node
+ * groups, and the rep tables.  this file has that part of nexus, so
+ * that nexus-plan can run it on a made up layout.  the library keeps
+ * its nexus_ctx versions of these (see nexus_internal.h), which just
+ * wrap an nx_rview around the context's tables.
+ */
+
+#include <stdint.h>
+
+#define NX_MAX_RAILS 8          /* max remote progressors */
+
+/*
+ * nx_r2n: compressed form of rank2node[].  launchers usually place
+ * ranks in blocks (node = rank / ppn) or round-robin (node = rank %
+ * nnodes), which need no table at all.  otherwise we keep a sorted list
+ * of runs of consecutive ranks on the same node if that is smaller than
+ * the dense table (NX_R2N_RUNS), else the dense rank2node[] itself.
+ */
+#define NX_R2N_DENSE 0          /* rank2node[grank] */
+#define NX_R2N_BLOCK 1          /* grank / ppn */
+#define NX_R2N_RR    2          /* grank % nnodes */
+#define NX_R2N_RUNS  3          /* binary search runstart[] */
+
+struct nx_r2n {
+  int kind;                     /* NX_R2N_* */
+  int ppn;                      /* ranks per node (NX_R2N_BLOCK) */
+  int nruns;                    /* number of runs (NX_R2N_RUNS) */
+  int* runstart;                /* first rank of each run (sorted) */
+  int* runnode;                 /* node id of each run */
+};
+
+/*
+ * nx_repinfo: input to a rep selection policy (see nexus_rep.cc).  a
+ * policy only needs info about the node it is choosing reps on.
+ */
+#define NX_REP_MODULO 0         /* peer node id % lsize */
+#define NX_REP_NIC    1         /* modulo over ranks near the nic */
+#define NX_REP_USER   2         /* nexus_set_rep_policy() callback */
+#define NX_REP_BALANCED 3       /* even peers per local rank, rotated */
+
+struct nx_repinfo {
+  int policy;                   /* NX_REP_* */
+  int nodeid;                   /* node we are choosing reps on */
+  int lsize;                    /* number of ranks on that node */
+  int nnodes;                   /* total number of nodes */
+  int nrails;                   /* number of remote rails */
+  int nstripes;                 /* number of rep pairs per node pair */
+  const int* eligible;          /* NX_REP_NIC: rails a local rank is near */
+  const struct nx_groups* grp;  /* NX_REP_BALANCED: groups (NULL if none) */
+  int (*fn)(void*, int, int, int, int); /* NX_REP_USER nexus_rep_fn_t */
+  void* arg;                    /* arg for fn */
+};
+
+/*
+ * nx_groups: optional grouping of nodes (e.g. by rack or switch).  with
+ * more than one group, a node only looks up the reps of the nodes in
+ * its own group plus one gateway node in each of the groups it is the
+ * gateway to (see nx_rv_group_gw() and nx_rv_group_hop()).  group
+ * members are kept in node id order in a CSR layout.
+ */
+#define NX_GROUP_KEYSZ 64       /* max group key size (incl. null) */
+
+struct nx_groups {
+  int ngroups;                  /* number of groups (1 if not grouping) */
+  int mygroup;                  /* our node's group */
+  int* node2group;              /* node id -> group */
+  int* gstart;                  /* group -> first gnodes[] index */
+  int* gnodes;                  /* nodes of each group (CSR) */
+};
+
+/*
+ * nx_rview: one rank's view of the routing tables.  this is all the
+ * nx_rv_*() functions look at.  node2srcrep[] and node2rep[] are either
+ * a snap's or (in bootstrap) the context's, and node2rep may be NULL
+ * for anything but nx_rv_step().
+ */
+struct nx_rview {
+  int grank;                    /* global rank doing the routing */
+  int nodeid;                   /* its node */
+  int nnodes;                   /* total number of nodes */
+  int lsize;                    /* number of ranks on its node */
+  int nstripes;                 /* rep pairs per node pair */
+  int nrails;                   /* number of remote rails */
+  const int* local2global;      /* its node's local rank -> global rank */
+  const int* rank2node;         /* global rank -> node (NX_R2N_DENSE) */
+  const struct nx_r2n* r2n;     /* how we map global rank to node id */
+  const struct nx_groups* grp;  /* node groups (grp->mygroup is ours) */
+  const int* node2srcrep;       /* node -> local rank of our rep for it */
+  const int* node2rep;          /* rmap slot -> that rep's global rank */
+};
+
+/*
+ * nx_rv_rank2node: return the node id of global rank "grank"
+ */
+inline int nx_rv_rank2node(const struct nx_rview* rv, int grank) {
+  const struct nx_r2n* const r2n = rv->r2n;
+  int lo, hi, mid;
+
+  switch (r2n->kind) {
+    case NX_R2N_BLOCK:
+      return grank / r2n->ppn;
+    case NX_R2N_RR:
+      return grank % rv->nnodes;
+    case NX_R2N_RUNS:
+      lo = 0;                   /* find last run starting at or before */
+      hi = r2n->nruns - 1;
+      while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (r2n->runstart[mid] <= grank)
+          lo = mid;
+        else
+          hi = mid - 1;
+      }
+      return r2n->runnode[lo];
+    default:
+      return rv->rank2node[grank];
+  }
+}
+
+/*
+ * nx_rv_lmap_slot: return the lmap slot (i.e. the local rank) of global
+ * rank "grank" or -1 if grank is not on our node.  local2global[] is
+ * sorted by global rank because our local comm split preserves the
+ * rank order of mycomm, so for block and round-robin layouts the slot
+ * is just arithmetic.
+ */
+inline int nx_rv_lmap_slot(const struct nx_rview* rv, int grank) {
+  int lo, hi, mid;
+
+  if (nx_rv_rank2node(rv, grank) != rv->nodeid) return -1;
+  if (rv->r2n->kind == NX_R2N_BLOCK) return grank % rv->r2n->ppn;
+  if (rv->r2n->kind == NX_R2N_RR) return grank / rv->nnodes;
+  lo = 0;
+  hi = rv->lsize - 1;
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (rv->local2global[mid] == grank) return mid;
+    if (rv->local2global[mid] < grank)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return -1;
+}
+
+/*
+ * nx_rv_stripe: pick the stripe (i.e. which of the nstripes rep pairs
+ * between two nodes) that carries traffic to dest.  this must only
+ * depend on dest, since srcreps route with no knowledge of the src.
+ */
+inline int nx_rv_stripe(const struct nx_rview* rv, int dest) {
+  if (rv->nstripes == 1) return 0;
+  return (int)((((uint32_t)dest * 2654435761u) >> 16) % rv->nstripes);
+}
+
+/*
+ * nx_rv_srcrep_slot: lmap slot of our rep for node destn on a stripe.
+ * stripe s uses the s'th local rank after the policy's choice, so
+ * different stripes use different ranks (nstripes <= every lsize).
+ */
+inline int nx_rv_srcrep_slot(const struct nx_rview* rv, int destn,
+                             int stripe) {
+  const int r = rv->node2srcrep[destn] + stripe;
+  return (r < rv->lsize) ? r : r - rv->lsize;
+}
+
+/*
+ * nx_rv_rail: rail for rmap slot (node, stripe).  it must be the same at
+ * both ends of a node pair, since the rep pair for it is shared by the
+ * traffic in both directions.  stripes of a pair move to the next rail.
+ */
+inline int nx_rv_rail(const struct nx_rview* rv, int node, int stripe) {
+  if (rv->nrails == 1) return 0;
+  return (rv->nodeid + node + stripe) % rv->nrails;
+}
+
+/*
+ * nx_rv_group_gw: gateway node in group a for traffic to/from group b.
+ * group b's gateway for a is nx_rv_group_gw(b, a), and those two nodes'
+ * reps for each other are the link between the groups.
+ */
+inline int nx_rv_group_gw(const struct nx_rview* rv, int a, int b) {
+  const struct nx_groups* const grp = rv->grp;
+  return grp->gnodes[grp->gstart[a] + b % (grp->gstart[a+1] - grp->gstart[a])];
+}
+
+/*
+ * nx_rv_group_hop: return the node we route towards to reach a rank on
+ * node destn.  that is destn itself if it is in our group.  otherwise
+ * it is our group's gateway node to destn's group, or the gateway node
+ * on the other side if we are on our group's gateway (and *viagroup is
+ * set).
+ */
+inline int nx_rv_group_hop(const struct nx_rview* rv, int destn,
+                           int* viagroup) {
+  int dg, gw;
+
+  *viagroup = 0;
+  if (rv->grp->ngroups <= 1) return destn;
+  dg = rv->grp->node2group[destn];
+  if (dg == rv->grp->mygroup) return destn;
+  gw = nx_rv_group_gw(rv, rv->grp->mygroup, dg);
+  if (gw != rv->nodeid) return gw;
+  *viagroup = 1;
+  return nx_rv_group_gw(rv, dg, rv->grp->mygroup);
+}
+
+/*
+ * nx_rv_rmap_needed: return non-zero if we need the rmap addresses for
+ * node: all nodes if we are not grouping, otherwise the nodes in our
+ * group and the gateway nodes we are the other end of.
+ */
+inline int nx_rv_rmap_needed(const struct nx_rview* rv, int node) {
+  int g;
+
+  if (rv->grp->ngroups <= 1) return 1;
+  g = rv->grp->node2group[node];
+  if (g == rv->grp->mygroup) return 1;
+  return nx_rv_group_gw(rv, rv->grp->mygroup, g) == rv->nodeid &&
+         nx_rv_group_gw(rv, g, rv->grp->mygroup) == node;
+}
+
+/*
+ * nx_rv_step: pick the next hop towards dest.  this is nexus_next_hop()
+ * without the addresses: *rank gets the next hop's global rank and
+ * *slot the lmap (NX_HOP_LOCAL, NX_HOP_SRCREP) or rmap (NX_HOP_DESTREP,
+ * NX_HOP_GROUPREP) slot its address is in.  returns NX_HOP_*.
+ */
+#define NX_HOP_DONE     0       /* we are dest */
+#define NX_HOP_LOCAL    1       /* dest is on our node (NX_ISLOCAL) */
+#define NX_HOP_SRCREP   2       /* go to our rep for dest (NX_SRCREP) */
+#define NX_HOP_DESTREP  3       /* we are the rep, cross (NX_DESTREP) */
+#define NX_HOP_GROUPREP 4       /* cross to dest's group (NX_GROUPREP) */
+
+inline int nx_rv_step(const struct nx_rview* rv, int dest, int* rank,
+                      int* slot) {
+  int destn, stripe, srcslot, viagroup;
+
+  /* stop here if we are the final hop */
+  if (rv->grank == dest) return NX_HOP_DONE;
+
+  /* if dest is local, the next stop is the final dest */
+  if ((*slot = nx_rv_lmap_slot(rv, dest)) != -1) {
+    *rank = dest;
+    return NX_HOP_LOCAL;
+  }
+
+  /* dest >> dest node (or gateway node if in another group) and stripe */
+  destn = nx_rv_group_hop(rv, nx_rv_rank2node(rv, dest), &viagroup);
+  stripe = nx_rv_stripe(rv, dest);
+  /* dest node >> src rep */
+  srcslot = nx_rv_srcrep_slot(rv, destn, stripe);
+  if (rv->local2global[srcslot] != rv->grank) {
+    *slot = srcslot;
+    *rank = rv->local2global[srcslot];
+    return NX_HOP_SRCREP;
+  }
+  /* we are the src rep, dest node >> dest rep */
+  *slot = destn * rv->nstripes + stripe;
+  *rank = rv->node2rep[*slot];
+  return (viagroup) ? NX_HOP_GROUPREP : NX_HOP_DESTREP;
+}
+
+/*
+ * pure function prototypes (nexus_rep.cc and nexus_route.cc)
+ */
+int nx_rep_policy_byname(const char* name);
+int nx_rep_nearnic(const char* nic);
+int nx_rep_fill(const struct nx_repinfo* ri, int* node2srcrep);
+int nx_r2n_build(struct nx_r2n* r2n, const int* rank2node, int gsize,
+                 int nnodes);
+int nx_groups_index(struct nx_groups* grp, int nnodes);
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_snap.cc  versioned routing tables with epoch based reclamation
+ *
+ * nexus_next_hop() and friends may be called from many threads while
+ * the tables are being updated (e.g. a repair).  readers reach the
+ * tables through nctx->snap and never lock.  a reader announces the
+ * epoch it started in with nx_snap_enter() and clears it in
+ * nx_snap_exit().  a writer builds a new snap, swaps it in, bumps the
+ * epoch and retires the old snap with the new epoch.  once no reader
+ * is left in an older epoch (and no one has it pinned) nobody can see
+ * the old snap and we free it.
+ *
+ * the epoch and the reader records are process wide, so a thread has
+ * one record no matter how many contexts it reads.
+ */
+
+#include <assert.h>
+
+#include <new>
+
+#include "nexus_internal.h"
+
+std::atomic<uint64_t> nx_epoch(1);
+thread_local struct nx_reader* nx_self = NULL;
+
+namespace {
+std::atomic<struct nx_reader*> nx_readers(NULL);   /* all records */
+
+/* nx_reader_release: gives a thread's record back when the thread exits */
+struct nx_reader_release {
+  struct nx_reader* r;
+  ~nx_reader_release() {
+    if (r) r->inuse.store(0, std::memory_order_release);
+  }
+};
+thread_local struct nx_reader_release nx_self_release = { NULL };
+
+/*
+ * nx_snap_free: free a snap's tables.  if "addrs" is set we also free
+ * the addresses in its maps (i.e. it is the last snap), otherwise we
+ * only free the addresses it was told to free when it was replaced.
+ */
+void nx_snap_free(nexus_ctx_t nx, struct nx_snap* s, int addrs) {
+  hg_class_t* lcls = mercury_progressor_hgclass(nx->hg_local);
+  nexus_map_t::iterator it;
+
+  for (it = s->ldead.begin() ; it != s->ldead.end() ; ++it)
+    HG_Addr_free(lcls, it->addr);
+  for (it = s->rdead.begin() ; it != s->rdead.end() ; ++it)
+    HG_Addr_free(mercury_progressor_hgclass(nx->hg_rail[it->rail]),
+                 it->addr);
+  if (addrs) {
+    for (it = s->lmap.begin() ; it != s->lmap.end() ; ++it) {
+      if (it->addr != HG_ADDR_NULL) HG_Addr_free(lcls, it->addr);
+    }
+    for (it = s->rmap.begin() ; it != s->rmap.end() ; ++it) {
+      if (it->addr != HG_ADDR_NULL)
+        HG_Addr_free(mercury_progressor_hgclass(nx->hg_rail[it->rail]),
+                     it->addr);
+    }
+  }
+  if (!s->inshm) {
+    if (s->node2rep) free(s->node2rep);
+    if (s->node2srcrep) free(s->node2srcrep);
+  }
+  if (s->rtab) free(s->rtab);
+  delete s;
+}
+
+/*
+ * nx_snap_reclaim: free the retired snaps no reader can still see
+ * (w/snaplock).  retired[] is in epoch order, so we stop at the first
+ * one that is still busy.
+ */
+void nx_snap_reclaim(nexus_ctx_t nx) {
+  const uint64_t oldest = nx_reader_oldest();
+  size_t n;
+
+  for (n = 0 ; n < nx->retired.size() ; n++) {
+    if (nx->retired[n]->retired > oldest ||
+        nx->retired[n]->pins.load(std::memory_order_acquire) > 0)
+      break;
+    nx_snap_free(nx, nx->retired[n], 0);
+  }
+  nx->retired.erase(nx->retired.begin(), nx->retired.begin() + n);
+}
+}  // namespace
+
+/*
+ * nx_reader_oldest: return the oldest epoch a reader is in (UINT64_MAX
+ * if there are no readers).  anything retired in an epoch at or before
+ * it can no longer be seen.
+ */
+uint64_t nx_reader_oldest() {
+  uint64_t oldest = UINT64_MAX, e;
+  struct nx_reader* r;
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (r = nx_readers.load(std::memory_order_acquire) ; r ; r = r->next) {
+    e = r->epoch.load(std::memory_order_acquire);
+    if (e != 0 && e < oldest) oldest = e;
+  }
+  return(oldest);
+}
+
+/*
+ * nx_reader_attach: give the calling thread a reader record (reusing
+ * one from a thread that has exited if we can)
+ */
+struct nx_reader* nx_reader_attach() {
+  struct nx_reader* r;
+  void* mem;
+  int zero;
+
+  for (r = nx_readers.load(std::memory_order_acquire) ; r ; r = r->next) {
+    zero = 0;
+    if (r->inuse.load(std::memory_order_relaxed) == 0 &&
+        r->inuse.compare_exchange_strong(zero, 1))
+      break;
+  }
+  if (r == NULL) {
+    if (posix_memalign(&mem, 64, sizeof(*r)) != 0) {
+      fprintf(stderr, "nx_reader_attach: malloc failed\n");
+      abort();                      /* readers have no way to fail */
+    }
+    r = new (mem) nx_reader;
+    r->epoch = 0;
+    r->inuse = 1;
+    r->next = nx_readers.load(std::memory_order_relaxed);
+    while (!nx_readers.compare_exchange_weak(r->next, r))
+      ;
+  }
+  r->depth = 0;
+  nx_self = nx_self_release.r = r;
+  return(r);
+}
+
+/*
+ * nx_snap_new: return a new (unpublished) snap.  the first one takes
+ * over the tables bootstrap built in nctx, later ones are copies of the
+ * current snap.  we hold snaplock until the caller publishes or aborts
+ * it, so updates are serialized.  return NULL on error.
+ */
+struct nx_snap* nx_snap_new(nexus_ctx_t nx) {
+  struct nx_snap* cur;
+  struct nx_snap* s;
+  size_t sz;
+  void* mem;
+
+  pthread_mutex_lock(&nx->snaplock);
+  cur = nx->snap.load(std::memory_order_relaxed);
+  s = new nx_snap;
+  s->node2rep = s->node2srcrep = NULL;
+  s->rtab = NULL;
+  s->pins = 0;
+  s->retired = 0;
+
+  if (cur == NULL) {                /* first one: take bootstrap's tables */
+    s->version = 1;
+    s->grank = nx->grank;
+    s->lmap.swap(nx->lmap);
+    s->rmap.swap(nx->rmap);
+    s->node2rep = nx->node2rep;
+    s->node2srcrep = nx->node2srcrep;
+    s->inshm = (nx->shmwin != MPI_WIN_NULL || nx->tabmap[1] != NULL);
+    nx->node2rep = nx->node2srcrep = NULL;
+    return(s);
+  }
+
+  s->version = cur->version + 1;
+  s->grank = cur->grank;
+  s->lmap = cur->lmap;
+  s->rmap = cur->rmap;
+  s->inshm = 0;
+  sz = sizeof(int) * nx->nnodes * nx->nstripes;
+  if (cur->node2rep && (s->node2rep = (int *)malloc(sz)) == NULL)
+    goto error;
+  if (cur->node2rep) memcpy(s->node2rep, cur->node2rep, sz);
+  sz = sizeof(int) * nx->nnodes;
+  if ((s->node2srcrep = (int *)malloc(sz)) == NULL)
+    goto error;
+  memcpy(s->node2srcrep, cur->node2srcrep, sz);
+  if (cur->rtab) {
+    sz = sizeof(nexus_route_t) * nx->gsize;
+    if (posix_memalign(&mem, 64, sz) != 0)
+      goto error;
+    s->rtab = (nexus_route_t *)mem;
+    memcpy(s->rtab, cur->rtab, sz);
+  }
+  return(s);
+
+error:
+  fprintf(stderr, "nx_snap_new: malloc failed\n");
+  nx_snap_abort(nx, s);
+  return(NULL);
+}
+
+/*
+ * nx_snap_publish: make s the current snap and retire the old one
+ * (which takes over s's dead addrs).  drops snaplock.
+ */
+void nx_snap_publish(nexus_ctx_t nx, struct nx_snap* s) {
+  struct nx_snap* old;
+
+  old = nx->snap.exchange(s);
+  if (old) {
+    old->retired = nx_epoch.fetch_add(1) + 1;
+    old->ldead.swap(s->ldead);
+    old->rdead.swap(s->rdead);
+    nx->retired.push_back(old);
+    nx_snap_reclaim(nx);
+  }
+  pthread_mutex_unlock(&nx->snaplock);
+}
+
+/*
+ * nx_snap_abort: drop an unpublished snap (none of its addrs are freed,
+ * the current snap still has them).  drops snaplock.
+ */
+void nx_snap_abort(nexus_ctx_t nx, struct nx_snap* s) {
+  if (nx->snap.load(std::memory_order_relaxed) == NULL) {
+    s->lmap.swap(nx->lmap);         /* give bootstrap's tables back */
+    s->rmap.swap(nx->rmap);
+    nx->node2rep = s->node2rep;
+    nx->node2srcrep = s->node2srcrep;
+    s->node2rep = s->node2srcrep = NULL;
+  }
+  s->ldead.clear();
+  s->rdead.clear();
+  s->inshm = 0;
+  nx_snap_free(nx, s, 0);
+  pthread_mutex_unlock(&nx->snaplock);
+}
+
+/*
+ * nx_snap_pin: return the current snap with a ref that keeps it from
+ * being freed, for readers that hold it across calls (e.g. iterators)
+ */
+struct nx_snap* nx_snap_pin(nexus_ctx_t nx) {
+  struct nx_snap* s;
+
+  s = (struct nx_snap *)nx_snap_enter(nx);
+  s->pins.fetch_add(1);
+  nx_snap_exit();
+  return(s);
+}
+
+/*
+ * nx_snap_unpin: drop a nx_snap_pin() ref.  a retired snap is freed by
+ * the next update (or nexus_destroy()).
+ */
+void nx_snap_unpin(struct nx_snap* s) {
+  s->pins.fetch_sub(1, std::memory_order_release);
+}
+
+/*
+ * nx_snap_destroy: free every snap.  the app must be done calling
+ * nexus, so we don't wait for readers.
+ */
+void nx_snap_destroy(nexus_ctx_t nx) {
+  struct nx_snap* s;
+  size_t n;
+
+  pthread_mutex_lock(&nx->snaplock);
+  for (n = 0 ; n < nx->retired.size() ; n++)
+    nx_snap_free(nx, nx->retired[n], 0);
+  nx->retired.clear();
+  if ((s = nx->snap.exchange(NULL)) != NULL)
+    nx_snap_free(nx, s, 1);
+  pthread_mutex_unlock(&nx->snaplock);
+}
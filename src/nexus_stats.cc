@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_stats.cc  routing counters and bootstrap times
+ *
+ * when NEXUS_STATS is set, nexus_next_hop() counts its results by hop
+ * type and (NEXUS_STATS=2) by the lmap or rmap slot of the next hop.
+ * the counters are relaxed atomics, so counting costs one uncontended
+ * add per lookup when a single thread routes.  nexus_stats_reduce()
+ * summarizes them over all ranks, which shows how even the rep load is
+ * (e.g. a local rank that is the srcrep for many hot dests has a large
+ * inbound count).
+ *
+ * bootstrap always records the time it spends in each phase (see
+ * nx_phase_end()) and a log2 histogram of its address lookup latencies
+ * (nx_hist_add()).  nexus_bootstrap_report() gathers them on rank 0
+ * and writes them out as JSON.
+ */
+
+#include <algorithm>
+
+#include "nexus_internal.h"
+
+namespace {
+/* nx_stats_copy: read a counter array */
+void nx_stats_copy(const std::atomic<uint64_t>* src, uint64_t* dst, int n) {
+  int i;
+
+  for (i = 0 ; i < n ; i++)
+    dst[i] = src[i].load(std::memory_order_relaxed);
+}
+
+/* nx_hist_usec: upper bound (usec) of the bucket with the q'th entry */
+uint64_t nx_hist_usec(const uint64_t* hist, uint64_t q) {
+  uint64_t seen = 0;
+  int b;
+
+  for (b = 0 ; b < NEXUS_HIST_NBUCKETS - 1 ; b++) {
+    seen += hist[b];
+    if (seen > q) break;
+  }
+  return (uint64_t)1 << b;
+}
+
+/* nx_report_hist: write one lookup histogram as a JSON object */
+void nx_report_hist(FILE* fp, const char* name, const uint64_t* hist,
+                    int last) {
+  uint64_t n = 0;
+  int b, top = 0;
+
+  for (b = 0 ; b < NEXUS_HIST_NBUCKETS ; b++) {
+    n += hist[b];
+    if (hist[b]) top = b;
+  }
+  fprintf(fp, "    \"%s\": {\"count\": %llu", name, (unsigned long long)n);
+  if (n) {
+    fprintf(fp, ", \"p50_usec\": %llu, \"p99_usec\": %llu",
+            (unsigned long long)nx_hist_usec(hist, n / 2),
+            (unsigned long long)nx_hist_usec(hist, n - 1 - n / 100));
+  }
+  fprintf(fp, ", \"buckets\": [");
+  for (b = 0 ; n && b <= top ; b++)
+    fprintf(fp, "%s%llu", (b) ? ", " : "", (unsigned long long)hist[b]);
+  fprintf(fp, "]}%s\n", (last) ? "" : ",");
+}
+
+/* nx_stats_zero: zero a counter array */
+void nx_stats_zero(std::atomic<uint64_t>* ctr, int n) {
+  int i;
+
+  for (i = 0 ; i < n ; i++)
+    ctr[i].store(0, std::memory_order_relaxed);
+}
+}  // namespace
+
+/*
+ * nx_stats_init: start counting.  level 1 counts by hop type and
+ * level 2 also counts by next hop slot.  return -1 on error.
+ */
+int nx_stats_init(nexus_ctx_t nctx, int level) {
+  const struct nx_snap* const s = nctx->snap.load();
+  struct nx_stats* st;
+
+  st = new nx_stats;
+  nx_stats_zero(st->hops, NEXUS_STATS_NTYPES);
+  st->lslot = st->rslot = NULL;
+  st->nlslots = s->lmap.size();     /* map sizes never change */
+  st->nrslots = s->rmap.size();
+  if (level > 1) {
+    st->lslot = new std::atomic<uint64_t>[st->nlslots];
+    st->rslot = new std::atomic<uint64_t>[st->nrslots];
+    nx_stats_zero(st->lslot, st->nlslots);
+    nx_stats_zero(st->rslot, st->nrslots);
+  }
+  nctx->stats = st;
+  return(0);
+}
+
+/* nx_stats_destroy: free counters */
+void nx_stats_destroy(nexus_ctx_t nctx) {
+  delete[] nctx->stats->lslot;
+  delete[] nctx->stats->rslot;
+  delete nctx->stats;
+  nctx->stats = NULL;
+}
+
+/*
+ * nexus_stats: get our routing counters
+ */
+nexus_ret_t nexus_stats(nexus_ctx_t nctx, nexus_stats_t* st) {
+  if (nctx->stats == NULL) return NX_ERROR;
+  nx_stats_copy(nctx->stats->hops, st->hops, NEXUS_STATS_NTYPES);
+  return NX_SUCCESS;
+}
+
+/*
+ * nexus_stats_slots: get our per next hop counters
+ */
+int nexus_stats_slots(nexus_ctx_t nctx, int local, uint64_t* counts, int n) {
+  const std::atomic<uint64_t>* ctr;
+  int nslots;
+
+  if (nctx->stats == NULL || nctx->stats->lslot == NULL) return -1;
+  ctr = (local) ? nctx->stats->lslot : nctx->stats->rslot;
+  nslots = (local) ? nctx->stats->nlslots : nctx->stats->nrslots;
+  nx_stats_copy(ctr, counts, (n < nslots) ? n : nslots);
+  return nslots;
+}
+
+/*
+ * nexus_stats_reset: zero our routing counters
+ */
+void nexus_stats_reset(nexus_ctx_t nctx) {
+  if (nctx->stats == NULL) return;
+  nx_stats_zero(nctx->stats->hops, NEXUS_STATS_NTYPES);
+  if (nctx->stats->lslot) {
+    nx_stats_zero(nctx->stats->lslot, nctx->stats->nlslots);
+    nx_stats_zero(nctx->stats->rslot, nctx->stats->nrslots);
+  }
+}
+
+/*
+ * nexus_stats_reduce: summarize routing counters over all ranks.  the
+ * inbound count of a rank is the sum of the local slot counters that
+ * its local peers have for it.
+ */
+nexus_ret_t nexus_stats_reduce(nexus_ctx_t nctx, nexus_stats_summary_t* sum) {
+  const int nctr = NEXUS_STATS_NTYPES + 1;    /* hops[] + inbound */
+  std::vector<uint64_t> lslot(nctx->lsize, 0);
+  uint64_t val[nctr], lo[nctr], hi[nctr], tot[nctr];
+  int cand[nctr], maxrank[nctr];
+  nexus_stat_range_t* r;
+  int i;
+
+  memset(val, 0, sizeof(val));
+  if (nctx->stats) {
+    nx_stats_copy(nctx->stats->hops, val, NEXUS_STATS_NTYPES);
+    if (nctx->stats->lslot)
+      nx_stats_copy(nctx->stats->lslot, lslot.data(), nctx->lsize);
+  }
+
+  if (MPI_Reduce_scatter_block(lslot.data(), &val[NEXUS_STATS_NTYPES], 1,
+                               MPI_UINT64_T, MPI_SUM, nctx->localcomm) !=
+          MPI_SUCCESS ||
+      MPI_Allreduce(val, lo, nctr, MPI_UINT64_T, MPI_MIN, nctx->mycomm) !=
+          MPI_SUCCESS ||
+      MPI_Allreduce(val, hi, nctr, MPI_UINT64_T, MPI_MAX, nctx->mycomm) !=
+          MPI_SUCCESS ||
+      MPI_Allreduce(val, tot, nctr, MPI_UINT64_T, MPI_SUM, nctx->mycomm) !=
+          MPI_SUCCESS) {
+    fprintf(stderr, "nexus_stats_reduce: counter reduce failed\n");
+    return NX_ERROR;
+  }
+
+  for (i = 0 ; i < nctr ; i++)       /* lowest rank holding the max */
+    cand[i] = (val[i] == hi[i]) ? nctx->grank : nctx->gsize;
+  if (MPI_Allreduce(cand, maxrank, nctr, MPI_INT, MPI_MIN, nctx->mycomm) !=
+      MPI_SUCCESS) {
+    fprintf(stderr, "nexus_stats_reduce: maxrank reduce failed\n");
+    return NX_ERROR;
+  }
+
+  for (i = 0 ; i < nctr ; i++) {
+    r = (i < NEXUS_STATS_NTYPES) ? &sum->hops[i] : &sum->inbound;
+    r->min = lo[i];
+    r->max = hi[i];
+    r->avg = (double)tot[i] / nctx->gsize;
+    r->maxrank = maxrank[i];
+  }
+  return NX_SUCCESS;
+}
+
+/*
+ * nexus_bootstrap_times: get our bootstrap times and lookup histograms
+ */
+nexus_ret_t nexus_bootstrap_times(nexus_ctx_t nctx, nexus_boot_times_t* bt) {
+  int i;
+
+  for (i = 0 ; i < NX_NPHASES ; i++)
+    bt->secs[i] = nctx->ptime[i];
+  nx_stats_copy(nctx->lhist, bt->lhist, NEXUS_HIST_NBUCKETS);
+  nx_stats_copy(nctx->rhist, bt->rhist, NEXUS_HIST_NBUCKETS);
+  return NX_SUCCESS;
+}
+
+/*
+ * nexus_bootstrap_report: write a JSON report of all ranks' bootstrap
+ * times.  rank 0 gathers every rank's phase times (so it can get the
+ * p99) and the sum of the histograms.
+ */
+nexus_ret_t nexus_bootstrap_report(nexus_ctx_t nctx, const char* outfile) {
+  static const char* const names[NX_NPHASES] = {
+    "mpisetup", "reps", "lmap_xchg", "lmap_lookup", "rmap_xchg",
+    "rmap_lookup", "warmup", "barrier", "total" };
+  nexus_ret_t ret = NX_SUCCESS;
+  uint64_t hist[2 * NEXUS_HIST_NBUCKETS], tot[2 * NEXUS_HIST_NBUCKETS];
+  std::vector<double> all, col;
+  double sum;
+  int i, r, maxrank;
+  FILE* fp;
+
+  all.resize((nctx->grank == 0) ? nctx->gsize * NX_NPHASES : 0);
+  nx_stats_copy(nctx->lhist, hist, NEXUS_HIST_NBUCKETS);
+  nx_stats_copy(nctx->rhist, hist + NEXUS_HIST_NBUCKETS, NEXUS_HIST_NBUCKETS);
+  if (MPI_Gather(nctx->ptime, NX_NPHASES, MPI_DOUBLE, all.data(),
+                 NX_NPHASES, MPI_DOUBLE, 0, nctx->mycomm) != MPI_SUCCESS ||
+      MPI_Reduce(hist, tot, 2 * NEXUS_HIST_NBUCKETS, MPI_UINT64_T, MPI_SUM, 0,
+                 nctx->mycomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nexus_bootstrap_report: gather failed\n");
+    return NX_ERROR;
+  }
+  if (nctx->grank != 0)
+    return NX_SUCCESS;
+
+  if (outfile == NULL) {
+    fp = stdout;
+  } else if ((fp = fopen(outfile, "w")) == NULL) {
+    perror("nexus_bootstrap_report");
+    return NX_ERROR;
+  }
+
+  fprintf(fp, "{\n  \"ranks\": %d, \"nodes\": %d, \"rails\": %d,\n",
+          nctx->gsize, nctx->nnodes, nctx->nrails);
+  fprintf(fp, "  \"phases\": {\n");
+  col.resize(nctx->gsize);
+  for (i = 0 ; i < NX_NPHASES ; i++) {
+    sum = 0;
+    maxrank = 0;
+    for (r = 0 ; r < nctx->gsize ; r++) {
+      col[r] = all[r * NX_NPHASES + i];
+      sum += col[r];
+      if (col[r] > col[maxrank]) maxrank = r;
+    }
+    fprintf(fp, "    \"%s\": {\"max_ms\": %.3f, \"maxrank\": %d, "
+            "\"avg_ms\": %.3f, ", names[i], col[maxrank] * 1000.0, maxrank,
+            sum * 1000.0 / nctx->gsize);
+    std::sort(col.begin(), col.end());
+    fprintf(fp, "\"min_ms\": %.3f, \"p99_ms\": %.3f}%s\n", col[0] * 1000.0,
+            col[(nctx->gsize * 99 + 99) / 100 - 1] * 1000.0,
+            (i == NX_NPHASES - 1) ? "" : ",");
+  }
+  fprintf(fp, "  },\n  \"lookups\": {\n");
+  nx_report_hist(fp, "local", tot, 0);
+  nx_report_hist(fp, "remote", tot + NEXUS_HIST_NBUCKETS, 1);
+  fprintf(fp, "  }\n}\n");
+
+  if (fp == stdout) {
+    fflush(fp);
+  } else if (fclose(fp) != 0) {
+    perror("nexus_bootstrap_report");
+    ret = NX_ERROR;
+  }
+  return ret;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_tabfile.cc  save and reuse the topology tables across runs
+ *
+ * a job that restarts on the same allocation builds the same rank2node,
+ * local2global, node2rep and node2srcrep tables every time.  with
+ * NEXUS_TABLE_CACHE set to a path prefix, a bootstrap that built them
+ * saves them in a binary file for the whole job (rank2node and the node
+ * groups) plus one file per node (its local2global, node2rep and
+ * node2srcrep), written by rank 0 and the local roots.  the next
+ * bootstrap maps the files read only (so all local procs share the
+ * pages) and checks them with one allreduce: every proc must find files
+ * from the same save that match its own rank, node and settings.  if
+ * anyone doesn't, everyone builds the tables the normal way (and saves
+ * them again).  with the tables known, each proc fetches just the
+ * remote addresses it needs (nx_addrwin_rmap()) instead of doing the
+ * rep exchange.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nexus_internal.h"
+
+#define NX_TAB_MAGIC    0x4e585442    /* "NXTB": job file */
+#define NX_TAB_NMAGIC   0x4e58544e    /* "NXTN": node file */
+#define NX_TAB_VERSION  1
+
+namespace {
+/*
+ * nx_tabhdr: job file header.  it is followed by rank2node[gsize] (if
+ * NX_R2N_DENSE) or runstart[nruns] and runnode[nruns] (if NX_R2N_RUNS),
+ * and by node2group[nnodes], gstart[ngroups+1] and gnodes[nnodes] if
+ * ngroups > 1.  all ints are in host byte order.
+ */
+struct nx_tabhdr {
+  uint32_t magic;               /* NX_TAB_MAGIC */
+  uint32_t version;             /* NX_TAB_VERSION */
+  uint64_t id;                  /* save id (also in the node files) */
+  int32_t gsize;                /* ranks in the job */
+  int32_t nnodes;               /* nodes in the job */
+  int32_t stripes;              /* NEXUS_STRIPES we were asked for */
+  int32_t nstripes;             /* stripes we used */
+  int32_t nrails;               /* rails */
+  int32_t policy;               /* rep policy */
+  int32_t groupsize;            /* NEXUS_GROUP_SIZE */
+  int32_t grouphost;            /* NEXUS_GROUP_HOSTCHARS */
+  int32_t r2nkind;              /* NX_R2N_* */
+  int32_t ppn;                  /* ranks per node (NX_R2N_BLOCK) */
+  int32_t nruns;                /* runs (NX_R2N_RUNS) */
+  int32_t ngroups;              /* node groups */
+};
+
+/*
+ * nx_tabnode: node file header.  it is followed by local2global[lsize],
+ * node2rep[nnodes*nstripes] (if nnodes > 1) and node2srcrep[nnodes].
+ */
+struct nx_tabnode {
+  uint32_t magic;               /* NX_TAB_NMAGIC */
+  uint32_t version;             /* NX_TAB_VERSION */
+  uint64_t id;                  /* save id (same as the job file's) */
+  uint64_t hosthash;            /* hash of the local root's hostname */
+  uint64_t keyhash;             /* hash of the local root's group key */
+  int32_t nodeid;               /* node the file is for */
+  int32_t lsize;                /* ranks on the node */
+};
+
+/* nx_tab_hash: FNV-1a hash of a string */
+uint64_t nx_tab_hash(const char* s) {
+  uint64_t h = 14695981039346656037ULL;
+
+  for ( ; *s ; s++)
+    h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+  return(h);
+}
+
+/* nx_tab_hosthash: hash of our hostname (0 if we can't get it) */
+uint64_t nx_tab_hosthash() {
+  char host[256];
+
+  memset(host, 0, sizeof(host));
+  if (gethostname(host, sizeof(host) - 1) != 0)
+    return(0);
+  return(nx_tab_hash(host));
+}
+
+/*
+ * nx_tab_map: map file fn read only and check it holds at least "min"
+ * bytes.  return the mapping (and its size in *len) or NULL.
+ */
+void* nx_tab_map(const char* fn, size_t min, size_t* len) {
+  struct stat st;
+  void* base;
+  int fd;
+
+  if ((fd = open(fn, O_RDONLY)) < 0)
+    return(NULL);
+  base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= min) {
+    *len = st.st_size;
+    base = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  return((base == MAP_FAILED) ? NULL : base);
+}
+
+/*
+ * nx_tab_write: write the n byte chunks of a file to a temp file and
+ * rename it into place, so readers never see a partial file.  return
+ * -1 on error.
+ */
+int nx_tab_write(const char* fn, int grank, const void** bufs,
+                 const size_t* lens, int n) {
+  char tmp[PATH_MAX];
+  FILE* fp;
+  int i, rv = 0;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp%d", fn, grank);
+  if ((fp = fopen(tmp, "w")) == NULL)
+    return(-1);
+  for (i = 0 ; i < n ; i++) {
+    if (lens[i] && fwrite(bufs[i], lens[i], 1, fp) != 1) rv = -1;
+  }
+  if (fclose(fp) != 0) rv = -1;
+  if (rv == 0 && rename(tmp, fn) != 0) rv = -1;
+  if (rv < 0) unlink(tmp);
+  return(rv);
+}
+
+/*
+ * nx_tab_check: check the mapped files against our rank and settings
+ * and point nx's tables into them.  return the save id or 0 if they
+ * don't match.
+ */
+uint64_t nx_tab_check(nexus_ctx_t nx, const char* prefix) {
+  const struct nx_tabhdr* h;
+  const struct nx_tabnode* nh;
+  char fn[PATH_MAX];
+  const int32_t* p;
+  size_t need;
+
+  h = (const struct nx_tabhdr*)nx_tab_map(prefix, sizeof(*h),
+                                          &nx->tablen[0]);
+  if ((nx->tabmap[0] = (void*)h) == NULL)
+    return(0);
+  if (h->magic != NX_TAB_MAGIC || h->version != NX_TAB_VERSION ||
+      h->id == 0 || h->gsize != nx->gsize || h->nnodes < 1 ||
+      h->stripes != nx->nstripes || h->nrails != nx->nrails ||
+      h->policy != nx->rep.policy || h->groupsize != nx->groupsize ||
+      h->grouphost != nx->grouphost || h->nstripes < 1 ||
+      h->ppn < 1 || h->nruns < 0 || h->ngroups < 1)
+    return(0);
+  need = sizeof(*h) + sizeof(int32_t) *
+         ((h->r2nkind == NX_R2N_DENSE) ? h->gsize :
+          (h->r2nkind == NX_R2N_RUNS) ? 2 * h->nruns : 0);
+  if (h->ngroups > 1)
+    need += sizeof(int32_t) * (2 * h->nnodes + h->ngroups + 1);
+  if (nx->tablen[0] < need)
+    return(0);
+
+  nx->nnodes = h->nnodes;
+  nx->nstripes = h->nstripes;
+  nx->r2n.kind = h->r2nkind;
+  nx->r2n.ppn = h->ppn;
+  nx->r2n.nruns = h->nruns;
+  p = (const int32_t*)(h + 1);
+  if (h->r2nkind == NX_R2N_DENSE) {
+    nx->rank2node = (int*)p;
+    p += h->gsize;
+  } else if (h->r2nkind == NX_R2N_RUNS) {
+    nx->r2n.runstart = (int*)p;
+    nx->r2n.runnode = (int*)p + h->nruns;
+    p += 2 * h->nruns;
+  }
+  nx->grp.ngroups = h->ngroups;
+  if (h->ngroups > 1) {
+    nx->grp.node2group = (int*)p;
+    nx->grp.gstart = (int*)p + h->nnodes;
+    nx->grp.gnodes = (int*)p + h->nnodes + h->ngroups + 1;
+  }
+  nx->nodeid = nx_rank2node(nx, nx->grank);
+  if (nx->nodeid < 0 || nx->nodeid >= nx->nnodes)
+    return(0);
+
+  snprintf(fn, sizeof(fn), "%s.%d", prefix, nx->nodeid);
+  nh = (const struct nx_tabnode*)nx_tab_map(fn, sizeof(*nh), &nx->tablen[1]);
+  if ((nx->tabmap[1] = (void*)nh) == NULL)
+    return(0);
+  need = sizeof(*nh) + sizeof(int32_t) * (nx->lsize + nx->nnodes *
+         ((nx->nnodes > 1) ? nx->nstripes + 1 : 1));
+  if (nh->magic != NX_TAB_NMAGIC || nh->version != NX_TAB_VERSION ||
+      nh->id != h->id || nh->nodeid != nx->nodeid ||
+      nh->lsize != nx->lsize || nx->tablen[1] < need ||
+      nh->hosthash != nx_tab_hosthash() ||
+      nh->keyhash != nx_tab_hash(nx->groupkey))
+    return(0);
+  p = (const int32_t*)(nh + 1);
+  if (p[nx->lrank] != nx->grank)    /* our node, but not our place in it */
+    return(0);
+
+  nx->local2global = (int*)p;
+  nx->lroot = nx->local2global[0];
+  p += nx->lsize;
+  if (nx->nnodes > 1) {
+    nx->node2rep = (int*)p;
+    p += nx->nnodes * nx->nstripes;
+  }
+  nx->node2srcrep = (int*)p;
+  if (h->ngroups > 1)
+    nx->grp.mygroup = nx->grp.node2group[nx->nodeid];
+  return(h->id);
+}
+}  // namespace
+
+/*
+ * nx_tabfile_unmap: drop nx's pointers into the table files and unmap
+ * them
+ */
+void nx_tabfile_unmap(nexus_ctx_t nx) {
+  int i;
+
+  if (nx->tabmap[0] == NULL && nx->tabmap[1] == NULL)
+    return;
+  nx->rank2node = nx->local2global = NULL;
+  nx->r2n.runstart = nx->r2n.runnode = NULL;
+  nx->node2rep = nx->node2srcrep = NULL;
+  nx->grp.node2group = nx->grp.gstart = nx->grp.gnodes = NULL;
+  for (i = 0 ; i < 2 ; i++) {
+    if (nx->tabmap[i]) munmap(nx->tabmap[i], nx->tablen[i]);
+    nx->tabmap[i] = NULL;
+  }
+}
+
+/*
+ * nx_tabfile_load: try to get our topology from the files at prefix
+ * instead of nx_mpisetup(), nx_build_reps() and nx_build_groups()
+ * (collective).  we only need our localcomm from MPI.  return 1 if we
+ * loaded them, 0 if someone couldn't (use the normal bootstrap), or -1
+ * on error.
+ */
+int nx_tabfile_load(nexus_ctx_t nx, const char* prefix) {
+  uint64_t in[2], out[2];
+
+  if (nx_localsetup(nx) < 0)
+    return(-1);
+
+  /* everyone must have the same save id (max of id == min of id) */
+  in[0] = nx_tab_check(nx, prefix);
+  in[1] = ~in[0];
+  if (MPI_Allreduce(in, out, 2, MPI_UINT64_T, MPI_MAX,
+                    nx->mycomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_tabfile_load: check allreduce failed\n");
+    return(-1);
+  }
+  if (out[0] != 0 && out[0] == ~out[1]) {
+    nx->rep.nodeid = nx->nodeid;
+    nx->rep.lsize = nx->lsize;
+    nx->rep.nnodes = nx->nnodes;
+    nx->rep.nrails = nx->nrails;
+    if (nx->grank == 0)
+      fprintf(stdout, "NX: TABLES FROM CACHE %s\n", prefix);
+    return(1);
+  }
+
+  /* start over with the normal bootstrap */
+  nx_tabfile_unmap(nx);
+  nx->r2n.kind = NX_R2N_DENSE;
+  nx->grp.ngroups = 1;
+  MPI_Comm_free(&nx->localcomm);
+  if (nx->grank == 0)
+    fprintf(stdout, "NX: TABLE CACHE %s DOES NOT MATCH, REBUILDING\n",
+            prefix);
+  return(0);
+}
+
+/*
+ * nx_tabfile_save: save the tables we just built to the files at
+ * prefix (collective).  rank 0 writes the job file and each local root
+ * its node's file.  failures are only reported, the next bootstrap
+ * will not match and rebuild them.
+ */
+void nx_tabfile_save(nexus_ctx_t nx, const char* prefix, int stripes) {
+  struct nx_tabhdr h;
+  struct nx_tabnode nh;
+  char fn[PATH_MAX];
+  const void* bufs[6];
+  size_t lens[6];
+  uint64_t id;
+  int n;
+
+  id = (nx->grank == 0) ? (((uint64_t)time(NULL) << 20) ^ getpid()) | 1 : 0;
+  if (MPI_Bcast(&id, 1, MPI_UINT64_T, 0, nx->mycomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_tabfile_save: id bcast failed\n");
+    return;
+  }
+
+  if (nx->grank == 0) {
+    memset(&h, 0, sizeof(h));
+    h.magic = NX_TAB_MAGIC;
+    h.version = NX_TAB_VERSION;
+    h.id = id;
+    h.gsize = nx->gsize;
+    h.nnodes = nx->nnodes;
+    h.stripes = stripes;
+    h.nstripes = nx->nstripes;
+    h.nrails = nx->nrails;
+    h.policy = nx->rep.policy;
+    h.groupsize = nx->groupsize;
+    h.grouphost = nx->grouphost;
+    h.r2nkind = nx->r2n.kind;
+    h.ppn = nx->r2n.ppn;
+    h.nruns = (nx->r2n.kind == NX_R2N_RUNS) ? nx->r2n.nruns : 0;
+    h.ngroups = nx->grp.ngroups;
+    n = 0;
+    bufs[n] = &h;
+    lens[n++] = sizeof(h);
+    if (h.r2nkind == NX_R2N_DENSE) {
+      bufs[n] = nx->rank2node;
+      lens[n++] = sizeof(int) * nx->gsize;
+    } else if (h.r2nkind == NX_R2N_RUNS) {
+      bufs[n] = nx->r2n.runstart;
+      lens[n++] = sizeof(int) * h.nruns;
+      bufs[n] = nx->r2n.runnode;
+      lens[n++] = sizeof(int) * h.nruns;
+    }
+    if (h.ngroups > 1) {
+      bufs[n] = nx->grp.node2group;
+      lens[n++] = sizeof(int) * nx->nnodes;
+      bufs[n] = nx->grp.gstart;
+      lens[n++] = sizeof(int) * (h.ngroups + 1);
+      bufs[n] = nx->grp.gnodes;
+      lens[n++] = sizeof(int) * nx->nnodes;
+    }
+    if (nx_tab_write(prefix, nx->grank, bufs, lens, n) < 0)
+      fprintf(stderr, "nx_tabfile_save: can't write %s\n", prefix);
+  }
+
+  if (nx->lrank == 0) {
+    memset(&nh, 0, sizeof(nh));
+    nh.magic = NX_TAB_NMAGIC;
+    nh.version = NX_TAB_VERSION;
+    nh.id = id;
+    nh.hosthash = nx_tab_hosthash();
+    nh.keyhash = nx_tab_hash(nx->groupkey);
+    nh.nodeid = nx->nodeid;
+    nh.lsize = nx->lsize;
+    n = 0;
+    bufs[n] = &nh;
+    lens[n++] = sizeof(nh);
+    bufs[n] = nx->local2global;
+    lens[n++] = sizeof(int) * nx->lsize;
+    if (nx->nnodes > 1) {
+      bufs[n] = nx->node2rep;
+      lens[n++] = sizeof(int) * nx->nnodes * nx->nstripes;
+    }
+    bufs[n] = nx->node2srcrep;
+    lens[n++] = sizeof(int) * nx->nnodes;
+    snprintf(fn, sizeof(fn), "%s.%d", prefix, nx->nodeid);
+    if (nx_tab_write(fn, nx->grank, bufs, lens, n) < 0)
+      fprintf(stderr, "nx_tabfile_save: can't write %s\n", fn);
+  }
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_topo.cc  share one context's topology with more contexts
+ *
+ * every context in a process sees the same rank2node[], local2global[]
+ * and node groups, and building them is most of what nexus_bootstrap()
+ * spends its collectives on.  nexus_bootstrap_shared() takes them from
+ * a base context instead.  the first time a context is shared, its
+ * tables (and the shm window or table files they may live in) move to
+ * a refcounted nx_topo, and the last context to use it frees them, so
+ * contexts may be destroyed in any order.  node2rep[] and node2srcrep[]
+ * are copied, since nexus_repair() changes them per context.  a shared
+ * context only dups the base's comms and looks up its own addresses
+ * (see nx_addrwin_rmap()).
+ */
+
+#include <sys/mman.h>
+
+#include "nexus_internal.h"
+
+/*
+ * nx_topo: tables shared by contexts.  they all point at them, but
+ * only we free them.
+ */
+struct nx_topo {
+  std::atomic<int> refs;        /* contexts using us */
+  int* local2global;            /* local rank -> global rank */
+  int* rank2node;               /* global rank -> node (if dense) */
+  int* runstart;                /* r2n runs (runnode follows it) */
+  int* node2group;              /* node groups (see nx_groups) */
+  int* gstart;
+  int* gnodes;
+  MPI_Win shmwin;               /* window rank2node[] is in (or NULL) */
+  void* tabmap[2];              /* table file mappings they are in */
+  size_t tablen[2];
+};
+
+namespace {
+/*
+ * nx_topo_get: return nx's topo, moving nx's tables to a new one if
+ * they are not shared yet.  caller holds nx's snaplock.
+ */
+struct nx_topo* nx_topo_get(nexus_ctx_t nx) {
+  struct nx_topo* t;
+  int i;
+
+  if (nx->topo)
+    return(nx->topo);
+  t = new nx_topo;
+  t->refs = 1;                      /* for nx */
+  t->local2global = nx->local2global;
+  t->rank2node = nx->rank2node;
+  t->runstart = nx->r2n.runstart;
+  t->node2group = nx->grp.node2group;
+  t->gstart = nx->grp.gstart;
+  t->gnodes = nx->grp.gnodes;
+  t->shmwin = nx->shmwin;           /* nx no longer frees these */
+  nx->shmwin = MPI_WIN_NULL;
+  for (i = 0 ; i < 2 ; i++) {
+    t->tabmap[i] = nx->tabmap[i];
+    t->tablen[i] = nx->tablen[i];
+    nx->tabmap[i] = NULL;
+  }
+  nx->topo = t;
+  return(t);
+}
+}  // namespace
+
+/*
+ * nx_topo_share: set up nx's topology from base's rather than with
+ * nx_mpisetup(), nx_build_reps() and nx_build_groups().  nx->mycomm
+ * must be a dup of base's.  collective over base's localcomm.  return
+ * -1 on error.
+ */
+int nx_topo_share(nexus_ctx_t nx, nexus_ctx_t base) {
+  const struct nx_snap* s;
+  size_t sz;
+
+  if (MPI_Comm_dup(base->localcomm, &nx->localcomm) != MPI_SUCCESS) {
+    fprintf(stderr, "nx_topo_share: localcomm dup failed\n");
+    return(-1);
+  }
+  nx->grank = base->grank;
+  nx->gsize = base->gsize;
+  nx->lrank = base->lrank;
+  nx->lsize = base->lsize;
+  nx->lroot = base->lroot;
+  nx->nodeid = base->nodeid;
+  nx->nnodes = base->nnodes;
+  nx->nstripes = base->nstripes;
+  nx->rep = base->rep;
+  nx->rep.nrails = nx->nrails;
+
+  pthread_mutex_lock(&base->snaplock);
+  nx->topo = nx_topo_get(base);
+  nx->topo->refs.fetch_add(1);
+  pthread_mutex_unlock(&base->snaplock);
+  nx->local2global = base->local2global;
+  nx->rank2node = base->rank2node;
+  nx->r2n = base->r2n;
+  nx->grp = base->grp;
+
+  /* our own copies of the rep tables, from base's current snap */
+  s = nx_snap_enter(base);
+  sz = sizeof(int) * nx->nnodes * nx->nstripes;
+  nx->node2srcrep = (int *)malloc(sizeof(int) * nx->nnodes);
+  if (nx->node2srcrep)
+    memcpy(nx->node2srcrep, s->node2srcrep, sizeof(int) * nx->nnodes);
+  if (s->node2rep && (nx->node2rep = (int *)malloc(sz)) != NULL)
+    memcpy(nx->node2rep, s->node2rep, sz);
+  nx_snap_exit();
+  if (!nx->node2srcrep || (nx->nnodes > 1 && !nx->node2rep)) {
+    fprintf(stderr, "nx_topo_share: malloc rep tables failed\n");
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * nx_topo_unref: drop nx's ref to its shared tables (and NULL nx's
+ * pointers to them).  the last ref frees them, which is collective
+ * over localcomm if they are in a shm window.
+ */
+void nx_topo_unref(nexus_ctx_t nx) {
+  struct nx_topo* const t = nx->topo;
+  int i;
+
+  nx->local2global = nx->rank2node = NULL;
+  nx->r2n.runstart = nx->r2n.runnode = NULL;
+  nx->grp.node2group = nx->grp.gstart = nx->grp.gnodes = NULL;
+  nx->topo = NULL;
+  if (t->refs.fetch_sub(1) != 1)
+    return;
+
+  if (t->tabmap[0] || t->tabmap[1]) {   /* everything is in the files */
+    for (i = 0 ; i < 2 ; i++) {
+      if (t->tabmap[i]) munmap(t->tabmap[i], t->tablen[i]);
+    }
+    delete t;
+    return;
+  }
+  if (t->shmwin != MPI_WIN_NULL) {
+    MPI_Win_unlock_all(t->shmwin);
+    MPI_Win_free(&t->shmwin);
+    t->rank2node = NULL;                /* was in shmwin */
+  }
+  if (t->local2global) free(t->local2global);
+  if (t->rank2node) free(t->rank2node);
+  if (t->runstart) free(t->runstart);
+  if (t->node2group) free(t->node2group);
+  if (t->gstart) free(t->gstart);
+  if (t->gnodes) free(t->gnodes);
+  delete t;
+}
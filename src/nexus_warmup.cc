@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2017-2019, Carnegie Mellon University and
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus_warmup.cc  connect to lmap and rmap peers during bootstrap
+ *
+ * HG_Addr_lookup() only resolves an address.  on many transports the
+ * connection is set up by the first rpc, so without a warm up the
+ * app's first flush pays for connecting to every peer at once.  when
+ * NEXUS_WARMUP is set, nx_warmup() sends an empty rpc to each lmap and
+ * rmap entry in a sliding window of NEXUS_WARMUP_LIMIT rpcs and waits
+ * for the replies.  every proc registers the rpc before it publishes
+ * its addresses (nx_warmup_register()) and keeps its progressors going
+ * until nx_bootstrap_done()'s barrier, so peers can always answer.
+ */
+
+#include "nexus_internal.h"
+
+#define NX_WARMUP_RPC "nexus_warmup"
+
+namespace {
+/* nx_warmup_target: one rpc to send */
+struct nx_warmup_target {
+  progressor_handle_t* phand;  /* progressor addr belongs to */
+  hg_id_t id;                  /* rpc id in phand's class */
+  hg_addr_t addr;              /* peer to warm up */
+};
+
+/*
+ * nx_warmup_ctx: state for a warm up.  like the lookups, callbacks
+ * refill the window and the caller waits for the last one.
+ */
+struct nx_warmup_ctx {
+  std::vector<nx_warmup_target> tgts; /* rpcs to send */
+  int limit;                   /* max rpcs in flight */
+  std::atomic<int> next;       /* next tgts[] entry to start */
+  std::atomic<int> inflight;   /* rpcs in flight */
+  std::atomic<int> pending;    /* not done + threads in our code */
+  std::atomic<int> nfailed;    /* rpcs that failed */
+  pthread_mutex_t mutex;       /* protects finished */
+  pthread_cond_t cv;           /* caller waits for last callback here */
+  int finished;                /* set when pending drops to zero */
+};
+
+/* nx_warmup_unref: drop a pending count, wake caller if it was the last */
+void nx_warmup_unref(struct nx_warmup_ctx* ctx) {
+  if (ctx->pending.fetch_sub(1) == 1) {
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->finished = 1;
+    pthread_cond_signal(&ctx->cv);
+    pthread_mutex_unlock(&ctx->mutex);
+  }
+}
+
+/* nx_warmup_handler: rpc handler, just reply */
+hg_return_t nx_warmup_handler(hg_handle_t handle) {
+  HG_Respond(handle, NULL, NULL, NULL);
+  HG_Destroy(handle);
+  return HG_SUCCESS;
+}
+
+hg_return_t nx_warmup_cb(const struct hg_cb_info* info);
+
+/*
+ * nx_warmup_fill: start rpcs until the window is full or we run out.
+ * rpcs that fail to start are counted and finished here.
+ */
+void nx_warmup_fill(struct nx_warmup_ctx* ctx) {
+  hg_handle_t handle;
+  int n, i;
+
+  for (;;) {
+    n = ctx->inflight.load();
+    if (n >= ctx->limit) return;
+    if (!ctx->inflight.compare_exchange_weak(n, n + 1)) continue;
+    if ((i = ctx->next.fetch_add(1)) >= (int)ctx->tgts.size()) {
+      ctx->inflight.fetch_sub(1);
+      return;
+    }
+    const nx_warmup_target* const t = &ctx->tgts[i];
+    if (HG_Create(mercury_progressor_hgcontext(t->phand), t->addr, t->id,
+                  &handle) != HG_SUCCESS) {
+      handle = HG_HANDLE_NULL;
+    } else if (HG_Forward(handle, &nx_warmup_cb, ctx, NULL) == HG_SUCCESS) {
+      continue;                     /* nx_warmup_cb() will finish it */
+    }
+    if (handle != HG_HANDLE_NULL) HG_Destroy(handle);
+    ctx->nfailed.fetch_add(1);
+    ctx->inflight.fetch_sub(1);
+    nx_warmup_unref(ctx);
+  }
+}
+
+/* nx_warmup_cb: forward callback, count the result and refill */
+hg_return_t nx_warmup_cb(const struct hg_cb_info* info) {
+  struct nx_warmup_ctx* const ctx = (struct nx_warmup_ctx*)info->arg;
+
+  ctx->pending.fetch_add(1);        /* hold ctx while we are running */
+  ctx->inflight.fetch_sub(1);
+  if (info->ret != HG_SUCCESS) ctx->nfailed.fetch_add(1);
+  HG_Destroy(info->info.forward.handle);
+  nx_warmup_unref(ctx);
+
+  nx_warmup_fill(ctx);
+  nx_warmup_unref(ctx);
+  return HG_SUCCESS;
+}
+
+/* nx_warmup_id: register (or find) our rpc in phand's class */
+int nx_warmup_id(progressor_handle_t* phand, hg_id_t* id) {
+  hg_class_t* cls = mercury_progressor_hgclass(phand);
+  hg_bool_t flag;
+
+  if (HG_Registered_name(cls, NX_WARMUP_RPC, id, &flag) == HG_SUCCESS &&
+      flag)
+    return(0);                      /* e.g. from an earlier bootstrap */
+  *id = HG_Register_name(cls, NX_WARMUP_RPC, NULL, NULL, &nx_warmup_handler);
+  return((*id == 0) ? -1 : 0);
+}
+}  // namespace
+
+/*
+ * nx_warmup_register: register the warm up rpc with all our
+ * progressors.  return -1 on error.
+ */
+int nx_warmup_register(nexus_ctx_t nx) {
+  int rail;
+
+  if (nx_warmup_id(nx->hg_local, &nx->warmup_lid) < 0) {
+    fprintf(stderr, "nx_warmup_register: local register failed\n");
+    return(-1);
+  }
+  for (rail = 0 ; rail < nx->nrails ; rail++) {
+    if (nx_warmup_id(nx->hg_rail[rail], &nx->warmup_rid[rail]) < 0) {
+      fprintf(stderr, "nx_warmup_register: remote register failed\n");
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+/*
+ * nx_warmup: send a warm up rpc to every lmap and rmap peer and wait
+ * for the replies.  failed rpcs are reported but are not an error, the
+ * app will just pay for those connections later.  return the number of
+ * rpcs sent.
+ */
+int nx_warmup(nexus_ctx_t nx) {
+  struct nx_warmup_ctx ctx;
+  nx_warmup_target t;
+  size_t i;
+
+  for (i = 0 ; i < nx->lmap.size() ; i++) {
+    if ((int)i == nx->lrank || nx->lmap[i].addr == HG_ADDR_NULL) continue;
+    t.phand = nx->hg_local;
+    t.id = nx->warmup_lid;
+    t.addr = nx->lmap[i].addr;
+    ctx.tgts.push_back(t);
+  }
+  for (i = 0 ; i < nx->rmap.size() ; i++) {
+    if (nx->rmap[i].addr == HG_ADDR_NULL) continue;
+    t.phand = nx->hg_rail[nx->rmap[i].rail];
+    t.id = nx->warmup_rid[nx->rmap[i].rail];
+    t.addr = nx->rmap[i].addr;
+    ctx.tgts.push_back(t);
+  }
+  if (ctx.tgts.empty())
+    return(0);
+
+  ctx.limit = nx->warmup_limit;
+  ctx.next = 0;
+  ctx.inflight = 0;
+  ctx.pending = (int)ctx.tgts.size() + 1;   /* +1 for us while we fill */
+  ctx.nfailed = 0;
+  ctx.finished = 0;
+  pthread_mutex_init(&ctx.mutex, NULL);
+  pthread_cond_init(&ctx.cv, NULL);
+
+  nx_warmup_fill(&ctx);
+  nx_warmup_unref(&ctx);
+
+  pthread_mutex_lock(&ctx.mutex);
+  while (!ctx.finished)
+    pthread_cond_wait(&ctx.cv, &ctx.mutex);
+  pthread_mutex_unlock(&ctx.mutex);
+
+  if (ctx.nfailed.load())
+    fprintf(stderr, "nx_warmup: NX-%d: %d of %d warm up rpcs failed\n",
+            nexus_global_rank(nx), ctx.nfailed.load(),
+            (int)ctx.tgts.size());
+  pthread_cond_destroy(&ctx.cv);
+  pthread_mutex_destroy(&ctx.mutex);
+  return((int)ctx.tgts.size());
+}
@@ -183,18 +183,20 @@ for ($nodeid = 0 ; $nodeid < $nnodes ; $nodeid++) {
         undef(%rmap);
         while (<$fh>) {
             chop;
-            unless (/rmap (\d+) (\S+)$/) {
+            # striped rmaps (NEXUS_STRIPES > 1) use "node.stripe"
+            unless (/rmap (\d+(\.\d+)?) (\S+)$/) {
                 die "rmap format error in file $mapfile";
             }
-            $rmap{$1} = $2;
+            $rmap{$1} = $3;
         }
         close($fh);
         print "    rmap:\n";
         for ($peer = 0 ; $peer < $nnodes ; $peer++) {
-            $v = $rmap{$peer};
-            next unless (defined($v));
-            $v = $addrmap{$v};
-            print "      $peer => $v\n";
+            foreach $k (sort { ($a =~ /\.(\d+)$/)[0] <=> ($b =~ /\.(\d+)$/)[0] }
+                        grep(/^$peer(\.\d+)?$/, keys(%rmap))) {
+                $v = $addrmap{$rmap{$k}};
+                print "      $k => $v\n";
+            }
         }
         print "    end\n";
     }
@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus-bench  measure nexus routing throughput, bootstrap times, and
+ * the memory used by the nexus tables
+ *
+ * each rank times nexus_next_hop(), nexus_next_hop_batch(), and
+ * nexus_partition() over pre-generated dests drawn from a uniform, a
+ * skewed (zipf), and a node-local distribution with 1 and -t threads.
+ * it then reports the per phase bootstrap times (see
+ * nexus_bootstrap_times()) and how much our RSS grew during bootstrap.
+ * rank 0 prints the avg and max of each number over all ranks as CSV
+ * (or JSON with -j).  run it at several rank counts (and with the
+ * NEXUS_* options) to compare them.
+ */
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/utsname.h>
+
+#include <mpi.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+ * ipurl and mpi_localcfg helper routines
+ */
+/* start: ipurl */
+#include <ifaddrs.h>
+#include <netdb.h>
+// #include <stdio.h>
+// #include <stdlib.h>
+#include <string.h>
+// #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+
+/*
+ * mercury_gen_ipurl: generate a mercury IP url using subnet spec
+ * to select the network to use.  if subnet is NULL or empty, we
+ * use the first non-127.0.0.1 IP address.
+ *
+ * @param protocol mercury protocol (e.g. "bmi+tcp")
+ * @param subnet IP subnet to use (e.g. "10.92")
+ * @param port port number to use, zero means any
+ * @param wa_base work-around base port (for bmi+tcp workaround)
+ * @param wa_stride work-around port stride (for bmi+tcp workaround)
+ * @return a malloc'd buffer with the new URL, or NULL on error
+ */
+char *mercury_gen_ipurl(char *protocol, char *subnet, int port,
+                        int wa_base, int wa_stride) {
+    int snetlen, rlen, so, n, lcv;
+    struct ifaddrs *ifaddr, *cur;
+    char tmpip[16];   /* strlen("111.222.333.444") == 15 */
+    char *ret;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    /* query socket layer to get our IP address list */
+    if (getifaddrs(&ifaddr) == -1) {
+        fprintf(stderr, "mercury_gen_ipurl: getifaddrs failed?\n");
+        return(NULL);
+    }
+
+    snetlen = (subnet) ? strlen(subnet) : 0;
+
+    /* walk list looking for match */
+    for (cur = ifaddr ; cur != NULL ; cur = cur->ifa_next) {
+
+        /* skip interfaces without an IP address */
+        if (cur->ifa_addr == NULL || cur->ifa_addr->sa_family != AF_INET)
+            continue;
+
+        /* get full IP address */
+        if (getnameinfo(cur->ifa_addr, sizeof(struct sockaddr_in),
+                        tmpip, sizeof(tmpip), NULL, 0, NI_NUMERICHOST) == -1)
+            continue;
+
+        if (snetlen == 0) {
+          if (strcmp(tmpip, "127.0.0.1") == 0)
+            continue; /* skip localhost */
+          break;      /* take first non-localhost match */
+        }
+        if (strncmp(subnet, tmpip, snetlen) == 0)
+          break;
+    }
+
+    /* dump the ifaddr list and return if there was no match */
+    freeifaddrs(ifaddr);
+    if (cur == NULL)
+        return(NULL);
+
+    rlen = strlen(protocol) + 32; /* +32 enough for ip, port, etc. */
+    ret = (char *)malloc(rlen);
+    if (ret == NULL)
+      return(NULL);
+
+    if (port != 0 || strcmp(protocol, "bmi+tcp") != 0) {
+        /* set port 0, let OS fill it, collect later w/HG_Addr_to_string */
+        snprintf(ret, rlen, "%s://%s:%d", protocol, tmpip, port);
+        return(ret);
+    }
+
+    /*
+     * XXX: bmi+tcp HG_Addr_to_string() is broken.  if we request
+     * port 0 (to let the OS fill it in) and later use HG_Addr_to_string()
+     * to request the actual port number allocated, it still returns
+     * 0 as the port number...  here's an attempt to hack around this
+     * problem.  we take wa_base and wa_stride as hints on how to pick
+     * a port number so that it doesn't conflict with other local ports.
+     * e.g. wa_base= X+my_local_rank, wa_stride=#local_ranks
+     */
+    if (wa_base < 1) wa_base = 10000;
+    if (wa_stride < 1) wa_stride = 1;
+    so = socket(PF_INET, SOCK_STREAM, 0);
+    if (so < 0) {
+        perror("socket");
+        free(ret);
+        return(NULL);
+    }
+    n = 1;
+    setsockopt(so, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n));
+    for (lcv = 0 ; lcv < 1024 ; lcv++) {   /* try up to 1024 times */
+        port = wa_base + (lcv * wa_stride);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        n = bind(so, (struct sockaddr*)&addr, addr_len);
+        if (n == 0) break;
+    }
+    close(so);
+
+    if (n != 0) {
+        perror("bind");
+        free(ret);
+        return(NULL);
+    }
+
+    snprintf(ret, rlen, "%s://%s:%d", protocol, tmpip, port);
+    return(ret);
+}
+/* end: ipurl  */
+/* start: mpi_localcfg */
+/**
+ * mpi_localcfg: get local-node mpi config (for working around bmi+tcp issues)
+ *
+ * assumes MPI has been init'd.  this is a collective MPI call.
+ *
+ * @param world our top-level comm
+ * @param lrnk local rank will be placed here
+ * @param lsz local size will be placed here
+ * @return 0 or -1 on error
+ */
+int mpi_localcfg(MPI_Comm world, int *lrnk, int *lsz) {
+    MPI_Comm local;
+    int ok;
+
+    /* split the world into local and remote */
+    if (MPI_Comm_split_type(world, MPI_COMM_TYPE_SHARED, 0,
+                            MPI_INFO_NULL, &local) != MPI_SUCCESS)
+    return(-1);
+
+    ok = MPI_Comm_rank(local, lrnk) == MPI_SUCCESS &&
+         MPI_Comm_size(local, lsz) == MPI_SUCCESS;
+
+    MPI_Comm_free(&local);    /* ignore errors */
+    return(ok ? 0 : -1);
+}
+/* end: mpi_localcfg */
+
+#include "deltafs-nexus_api.h"
+
+#include "deltafs-nexus_api.h"
+
+#define NDESTS 65536       /* pre-generated dests per thread (power of 2) */
+
+/* names of nexus_phase_t values */
+static const char *phasenames[NX_NPHASES] = {
+    "mpisetup", "reps", "lmap_xchg", "lmap_lookup", "rmap_xchg",
+    "rmap_lookup", "warmup", "barrier", "total"
+};
+
+/* dest distributions */
+enum { D_UNIFORM = 0, D_SKEWED, D_LOCAL, D_NDISTS };
+static const char *distnames[D_NDISTS] = { "uniform", "skewed", "local" };
+
+/* routing calls we time */
+enum { M_HOP = 0, M_BATCH, M_PARTITION, M_NMETHODS };
+static const char *methnames[M_NMETHODS] = {
+    "next_hop", "next_hop_batch", "partition"
+};
+
+/*
+ * result: one line of output.  "avg" and "max" are over all ranks.
+ */
+struct result {
+    std::string section;   /* route, bootstrap, or memory */
+    std::string name;      /* what we measured */
+    std::string dist;      /* dest distribution (route only) */
+    int threads;           /* threads per rank (route only) */
+    double avg;
+    double max;
+    const char *unit;
+};
+
+/*
+ * gs: global state
+ */
+struct gs {
+    nexus_ctx_t nctx;      /* nexus context */
+    int myrank;            /* my global rank */
+    int ranksize;          /* number of ranks */
+    long ops;              /* ops per thread per run */
+    int batch;             /* batch size for batch/partition */
+    int maxthreads;        /* max threads per rank */
+    int json;              /* output json rather than csv */
+    std::vector<double> zipf;      /* cdf for D_SKEWED */
+    std::vector<int> locals;       /* global ranks on our node */
+    std::vector<result> results;   /* rank 0 only */
+} g;
+
+/*
+ * bench_thread: state for one timing thread
+ */
+struct bench_thread {
+    pthread_t tid;
+    pthread_barrier_t *start;  /* wait here so all threads start at once */
+    int meth;                  /* M_* */
+    int *dests;                /* NDESTS dests to route to */
+    double nsop;               /* result: ns per op */
+    long sink;                 /* keep compiler from dropping work */
+};
+
+/*
+ * usage
+ */
+static void usage(const char *msg) {
+    if (msg) fprintf(stderr, "nexus-bench: %s\n", msg);
+    fprintf(stderr, "usage: nexus-bench [options] net-protocol [outfile]\n");
+    fprintf(stderr, "\noptions:\n");
+    fprintf(stderr, "\t-b size     batch size (default: 64)\n");
+    fprintf(stderr, "\t-j          output json rather than csv\n");
+    fprintf(stderr, "\t-n ops      ops per thread per run (default: 1M)\n");
+    fprintf(stderr, "\t-s subnet   subnet to pick IP from\n");
+    fprintf(stderr, "\t-t threads  also run with this many threads\n");
+    exit(1);
+}
+
+/*
+ * now_ns: monotonic time in ns
+ */
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * rss_kb: return our resident set size in KB (0 if unknown)
+ */
+static long rss_kb() {
+    char line[128];
+    long kb = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/status", "r")) == NULL)
+        return(0);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            kb = atol(line + 6);
+            break;
+        }
+    }
+    fclose(fp);
+    return(kb);
+}
+
+/*
+ * add_result: reduce a value over all ranks and save it on rank 0
+ */
+static void add_result(const char *section, const char *name,
+                       const char *dist, int threads, double val,
+                       const char *unit) {
+    double sum, max;
+    result r;
+
+    MPI_Reduce(&val, &sum, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&val, &max, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (g.myrank != 0)
+        return;
+    r.section = section;
+    r.name = name;
+    r.dist = dist;
+    r.threads = threads;
+    r.avg = sum / g.ranksize;
+    r.max = max;
+    r.unit = unit;
+    g.results.push_back(r);
+}
+
+/*
+ * gen_dests: fill dests[] using distribution "dist"
+ */
+static void gen_dests(int dist, int *dests, unsigned int seed) {
+    double u;
+    int i;
+
+    for (i = 0 ; i < NDESTS ; i++) {
+        switch (dist) {
+        case D_SKEWED:
+            u = rand_r(&seed) / ((double)RAND_MAX + 1);
+            dests[i] = std::lower_bound(g.zipf.begin(), g.zipf.end(), u) -
+                       g.zipf.begin();
+            if (dests[i] >= g.ranksize) dests[i] = g.ranksize - 1;
+            break;
+        case D_LOCAL:
+            dests[i] = g.locals[rand_r(&seed) % g.locals.size()];
+            break;
+        default:
+            dests[i] = rand_r(&seed) % g.ranksize;
+        }
+    }
+}
+
+/*
+ * run_thread: time g.ops routing ops
+ */
+static void *run_thread(void *arg) {
+    bench_thread *bt = (bench_thread *)arg;
+    int nq = nexus_partition_nqueues(g.nctx);
+    std::vector<int> ranks(g.batch), offsets(nq + 1), perm(g.batch);
+    std::vector<hg_addr_t> addrs(g.batch);
+    std::vector<nexus_ret_t> types(g.batch);
+    int pos = 0, rank;
+    hg_addr_t addr;
+    double start;
+    long i;
+
+    pthread_barrier_wait(bt->start);
+    start = now_ns();
+    for (i = 0 ; i < g.ops ; ) {
+        if (bt->meth == M_HOP) {
+            nexus_next_hop(g.nctx, bt->dests[i & (NDESTS - 1)], &rank, &addr);
+            bt->sink += rank;
+            i++;
+            continue;
+        }
+        if (pos + g.batch > NDESTS)
+            pos = 0;
+        if (bt->meth == M_BATCH) {
+            nexus_next_hop_batch(g.nctx, bt->dests + pos, g.batch,
+                                 ranks.data(), addrs.data(), types.data());
+            bt->sink += ranks[0];
+        } else {
+            nexus_partition(g.nctx, bt->dests + pos, g.batch,
+                            offsets.data(), perm.data());
+            bt->sink += perm[0];
+        }
+        pos += g.batch;
+        i += g.batch;
+    }
+    bt->nsop = (now_ns() - start) / i;
+    return(NULL);
+}
+
+/*
+ * bench_route: time one method and dest distribution with "nt" threads
+ * on every rank and record the mean ns/op of our threads
+ */
+static void bench_route(int meth, int dist, int nt) {
+    std::vector<bench_thread> bts(nt);
+    pthread_barrier_t start;
+    double nsop = 0;
+    long sink = 0;
+    int t;
+
+    pthread_barrier_init(&start, NULL, nt);
+    for (t = 0 ; t < nt ; t++) {
+        bts[t].start = &start;
+        bts[t].meth = meth;
+        bts[t].dests = (int *)malloc(NDESTS * sizeof(int));
+        bts[t].sink = 0;
+        if (!bts[t].dests) {
+            fprintf(stderr, "nexus-bench: malloc failed\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        gen_dests(dist, bts[t].dests, g.myrank * 1000 + t + 1);
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);    /* all ranks route at the same time */
+    for (t = 0 ; t < nt ; t++) {
+        if (pthread_create(&bts[t].tid, NULL, run_thread, &bts[t]) != 0) {
+            fprintf(stderr, "nexus-bench: pthread_create failed\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    for (t = 0 ; t < nt ; t++) {
+        pthread_join(bts[t].tid, NULL);
+        nsop += bts[t].nsop / nt;
+        sink += bts[t].sink;
+        free(bts[t].dests);
+    }
+    pthread_barrier_destroy(&start);
+    if (sink == -1) fprintf(stderr, " ");   /* use sink */
+
+    add_result("route", methnames[meth], distnames[dist], nt, nsop, "ns/op");
+}
+
+/*
+ * print_results: print results on rank 0
+ */
+static void print_results(FILE *fp) {
+    size_t i;
+
+    if (g.json) {
+        fprintf(fp, "{\n  \"ranks\": %d,\n  \"results\": [\n", g.ranksize);
+    } else {
+        fprintf(fp, "section,name,dist,threads,ranks,avg,max,unit\n");
+    }
+    for (i = 0 ; i < g.results.size() ; i++) {
+        const result &r = g.results[i];
+        if (!g.json) {
+            fprintf(fp, "%s,%s,%s,", r.section.c_str(), r.name.c_str(),
+                    r.dist.c_str());
+            if (r.threads) fprintf(fp, "%d", r.threads);
+            fprintf(fp, ",%d,%.3f,%.3f,%s\n", g.ranksize, r.avg, r.max,
+                    r.unit);
+            continue;
+        }
+        fprintf(fp, "    {\"section\": \"%s\", \"name\": \"%s\", ",
+                r.section.c_str(), r.name.c_str());
+        if (r.threads)
+            fprintf(fp, "\"dist\": \"%s\", \"threads\": %d, ",
+                    r.dist.c_str(), r.threads);
+        fprintf(fp, "\"avg\": %.3f, \"max\": %.3f, \"unit\": \"%s\"}%s\n",
+                r.avg, r.max, r.unit, (i + 1 < g.results.size()) ? "," : "");
+    }
+    if (g.json)
+        fprintf(fp, "  ]\n}\n");
+}
+
+/*
+ * usage: nexus-bench [options] net-protocol [outfile]
+ */
+int main(int argc, char **argv) {
+    int exitval = 0;
+    int opt, lr, ls, lbase, i, m, d, nt;
+    struct utsname uts;
+    struct hostent *he;
+    struct in_addr ia;
+    char *proto, *subnet, *outfile, *myurl = NULL;
+    hg_class_t *cls = NULL;
+    hg_context_t *ctx = NULL;
+    progressor_handle_t *prg = NULL;
+    nexus_boot_times_t bt;
+    nexus_iter_t nit;
+    long rss0;
+    double zsum;
+    FILE *fp;
+
+    g.ops = 1000000;
+    g.batch = 64;
+    g.maxthreads = 1;
+    g.json = 0;
+    subnet = NULL;
+    while ((opt = getopt(argc, argv, "b:jn:s:t:")) != -1) {
+        switch (opt) {
+        case 'b':
+            g.batch = atoi(optarg);
+            if (g.batch < 1 || g.batch > NDESTS) usage("bad batch size");
+            break;
+        case 'j':
+            g.json = 1;
+            break;
+        case 'n':
+            g.ops = atol(optarg);
+            if (g.ops < 1) usage("bad op count");
+            break;
+        case 's':
+            subnet = optarg;
+            break;
+        case 't':
+            g.maxthreads = atoi(optarg);
+            if (g.maxthreads < 1) usage("bad thread count");
+            break;
+        default:
+            usage(NULL);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (subnet == NULL) {   /* pick default IP address */
+        if (uname(&uts) < 0) {
+            perror("uname");
+            exit(1);
+        }
+        he = gethostbyname(uts.nodename);
+        if (!he || he->h_addrtype != AF_INET || he->h_length < 1) {
+            fprintf(stderr, "nexus-bench: gethostbyname(%s) failed\n",
+                    uts.nodename);
+            exit(1);
+        }
+        memcpy(&ia, he->h_addr, sizeof(ia));
+        subnet = inet_ntoa(ia);
+    }
+
+    if (argc < 1 || argc > 2)
+        usage("bad args");
+    proto = argv[0];
+    outfile = (argc == 2) ? argv[1] : NULL;
+
+    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Init failed\n");
+        exit(1);
+    }
+    MPI_Comm_rank(MPI_COMM_WORLD, &g.myrank);
+    MPI_Comm_size(MPI_COMM_WORLD, &g.ranksize);
+
+    if (strcmp(proto, "bmi+tcp") == 0) {
+        if (mpi_localcfg(MPI_COMM_WORLD, &lr, &ls) < 0) {
+            fprintf(stderr, "nexus-bench: mpi_localcfg failed!\n");
+            exitval = 1; goto done;
+        }
+        lbase = 10000 + lr;
+    } else {
+        lbase = lr = ls = 0;
+    }
+    myurl = mercury_gen_ipurl(proto, subnet, 0, lbase, ls);
+    if (!myurl) {
+        fprintf(stderr, "nexus-bench: mercury_gen_ipurl failed!\n");
+        exitval = 1; goto done;
+    }
+
+    if ((cls = HG_Init(myurl, HG_TRUE)) == NULL) {
+        fprintf(stderr, "nexus-bench: HG_Init(%s, TRUE) failed!\n", myurl);
+        exitval = 1; goto done;
+    }
+    if ((ctx = HG_Context_create(cls)) == NULL) {
+        fprintf(stderr, "nexus-bench: HG_Context_create() failed!\n");
+        exitval = 1; goto done;
+    }
+    if ((prg = mercury_progressor_init(cls, ctx)) == NULL) {
+        fprintf(stderr, "nexus-bench: progressor init failed!\n");
+        exitval = 1; goto done;
+    }
+
+    rss0 = rss_kb();
+    g.nctx = nexus_bootstrap(prg, NULL);
+    if (!g.nctx) {
+        fprintf(stderr, "nexus-bench: nexus bootstrap failed!\n");
+        exitval = 1; goto done;
+    }
+    add_result("memory", "rss_growth", "", 0, rss_kb() - rss0, "KB");
+
+    nexus_bootstrap_times(g.nctx, &bt);
+    for (i = 0 ; i < NX_NPHASES ; i++)
+        add_result("bootstrap", phasenames[i], "", 0, bt.secs[i] * 1000.0,
+                   "ms");
+
+    /* zipf (s=1) cdf over ranks, rank 0 is the hottest */
+    g.zipf.resize(g.ranksize);
+    for (zsum = 0, i = 0 ; i < g.ranksize ; i++)
+        g.zipf[i] = (zsum += 1.0 / (i + 1));
+    for (i = 0 ; i < g.ranksize ; i++)
+        g.zipf[i] /= zsum;
+    for (nit = nexus_iter(g.nctx, 1) ; !nexus_iter_atend(nit) ;
+         nexus_iter_advance(nit))
+        g.locals.push_back(nexus_iter_globalrank(nit));
+    nexus_iter_free(&nit);
+
+    for (nt = 1 ; ; nt = g.maxthreads) {
+        for (m = 0 ; m < M_NMETHODS ; m++) {
+            for (d = 0 ; d < D_NDISTS ; d++) {
+                bench_route(m, d, nt);
+            }
+        }
+        if (nt == g.maxthreads) break;
+    }
+
+    if (g.myrank == 0) {
+        fp = (outfile) ? fopen(outfile, "w") : stdout;
+        if (!fp) {
+            perror(outfile);
+            exitval = 1;
+        } else {
+            print_results(fp);
+            if (fp != stdout) fclose(fp);
+        }
+    }
+
+done:
+    if (myurl) free(myurl);
+    if (g.nctx) nexus_destroy(g.nctx);
+    if (prg) mercury_progressor_freehandle(prg);
+    if (ctx) HG_Context_destroy(ctx);
+    if (cls) HG_Finalize(cls);
+    MPI_Finalize();
+    exit(exitval);
+}
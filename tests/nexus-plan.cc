@@ -0,0 +1,603 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nexus-plan  offline route planner for capacity planning
+ *
+ * builds the routing tables every rank of a made up job would have
+ * (node count and ranks per node, or a hostfile) with the same code
+ * nexus_bootstrap() and nexus_next_hop() use (see src/nexus_route.h),
+ * without MPI or mercury.  for each rep policy it reports the remote
+ * peers, connections, and table memory per rank and, with -c, walks
+ * the route for every (src, dst) pair to check it and count how much
+ * traffic each rank relays.  the NEXUS_* options that change the
+ * tables are read from the environment like nexus_bootstrap() does,
+ * and the flags override them.
+ *
+ * we keep every node's node2srcrep[] (and node2rep[] with -c), so
+ * memory grows with nnodes^2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "nexus_route.h"
+
+#define MAXHOPS 8          /* more than any route should take */
+
+/* library table entry sizes (nexus_mapent_t and nexus_route_t) */
+#define MAPENT_SZ (sizeof(void *) + 2 * sizeof(int))
+#define ROUTE_SZ (sizeof(void *) + sizeof(int) + 2 * sizeof(short))
+
+/* names of NX_HOP_* values */
+static const char *hopnames[] = {
+    "done", "local", "srcrep", "destrep", "grouprep"
+};
+
+/*
+ * gs: global state (the layout, and the options that apply to it)
+ */
+struct gs {
+    int nnodes;                    /* number of nodes */
+    int gsize;                     /* number of ranks */
+    int rr;                        /* round-robin (not block) layout */
+    int nstripes;                  /* NEXUS_STRIPES */
+    int nrails;                    /* remote rails */
+    int groupsize;                 /* NEXUS_GROUP_SIZE */
+    int grouphost;                 /* NEXUS_GROUP_HOSTCHARS */
+    int shm;                       /* NEXUS_SHM_TABLES */
+    int rtab;                      /* NEXUS_ROUTE_TABLE */
+    int check;                     /* check every route */
+    int verbose;                   /* print per rank stats */
+    std::vector<std::string> hosts;  /* node -> hostname */
+    std::vector<int> lsizes;       /* node -> number of ranks on it */
+    std::vector<int> rank2node;    /* global rank -> node */
+    std::vector<int> lstart;       /* node -> its first l2g[] entry */
+    std::vector<int> l2g;          /* every node's local2global[] */
+    std::vector<int> eligible;     /* NX_REP_NIC: every rank near */
+    struct nx_r2n r2n;             /* compressed rank2node[] */
+    struct nx_groups grp;          /* node groups (mygroup unused) */
+} g;
+
+/*
+ * rankstat: per rank results for one policy
+ */
+struct rankstat {
+    int rpeers;                    /* rmap slots we are the src rep for */
+    long relay;                    /* routes we forward (-c) */
+    long bytes;                    /* our table memory */
+};
+
+/*
+ * usage
+ */
+static void usage(const char *msg) {
+    if (msg) fprintf(stderr, "nexus-plan: %s\n", msg);
+    fprintf(stderr, "usage: nexus-plan [options] -n nnodes [-l lsize]\n");
+    fprintf(stderr, "       nexus-plan [options] -f hostfile\n");
+    fprintf(stderr, "\noptions:\n");
+    fprintf(stderr, "\t-c          check the route of every (src, dst)\n");
+    fprintf(stderr, "\t-f file     hostfile (\"host[:n]\" or "
+                    "\"host slots=n\" per line)\n");
+    fprintf(stderr, "\t-g size     node group size (NEXUS_GROUP_SIZE)\n");
+    fprintf(stderr, "\t-k chars    group by hostname prefix "
+                    "(NEXUS_GROUP_HOSTCHARS)\n");
+    fprintf(stderr, "\t-l lsize    ranks per node (default: 1)\n");
+    fprintf(stderr, "\t-m layout   block or rr (default: block)\n");
+    fprintf(stderr, "\t-n nnodes   number of nodes\n");
+    fprintf(stderr, "\t-p list     rep policies (default: "
+                    "NEXUS_REP_POLICY or modulo,balanced)\n");
+    fprintf(stderr, "\t-r rails    remote rails (default: 1)\n");
+    fprintf(stderr, "\t-s stripes  stripes (NEXUS_STRIPES)\n");
+    fprintf(stderr, "\t-S          shared tables (NEXUS_SHM_TABLES)\n");
+    fprintf(stderr, "\t-t          dense route table (NEXUS_ROUTE_TABLE)\n");
+    fprintf(stderr, "\t-v          print per rank stats\n");
+    exit(1);
+}
+
+/*
+ * envint: return an int from the environment (or def if unset)
+ */
+static int envint(const char *name, int def) {
+    const char *env = getenv(name);
+    return((env && env[0]) ? atoi(env) : def);
+}
+
+/*
+ * read_hostfile: add the nodes listed in a hostfile.  a host listed
+ * more than once gets the sum of its slots.  return -1 on error.
+ */
+static int read_hostfile(const char *file, int lsize) {
+    std::map<std::string, int> host2node;
+    char line[1024], *p, *host, *arg, *colon;
+    int n, node;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        perror(file);
+        return(-1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((p = strchr(line, '#')) != NULL) *p = '\0';
+        host = strtok(line, " \t\r\n");
+        if (host == NULL) continue;
+        n = lsize;
+        if ((colon = strchr(host, ':')) != NULL) {
+            *colon = '\0';
+            n = atoi(colon + 1);
+        }
+        while ((arg = strtok(NULL, " \t\r\n")) != NULL) {
+            if (strncmp(arg, "slots=", 6) == 0) n = atoi(arg + 6);
+        }
+        if (n < 1) {
+            fprintf(stderr, "nexus-plan: %s: bad slots for %s\n", file, host);
+            fclose(fp);
+            return(-1);
+        }
+        std::map<std::string, int>::iterator it = host2node.find(host);
+        if (it == host2node.end()) {
+            node = g.hosts.size();
+            host2node[host] = node;
+            g.hosts.push_back(host);
+            g.lsizes.push_back(0);
+        } else {
+            node = it->second;
+        }
+        g.lsizes[node] += n;
+    }
+    fclose(fp);
+    return(0);
+}
+
+/*
+ * make_layout: place the ranks on the nodes (by block or round-robin)
+ * and build rank2node[], each node's local2global[], and the node
+ * groups.  node ids are in order of their lowest rank, as in
+ * nx_mpisetup(), which is the node order we were given for both
+ * layouts.  return -1 on error.
+ */
+static int make_layout() {
+    std::map<std::string, int> key2group;
+    std::vector<int> left, pos;
+    int r, n;
+
+    g.nnodes = g.lsizes.size();
+    for (g.gsize = 0, n = 0 ; n < g.nnodes ; n++)
+        g.gsize += g.lsizes[n];
+
+    g.rank2node.resize(g.gsize);
+    if (!g.rr) {
+        for (r = 0, n = 0 ; n < g.nnodes ; n++) {
+            for (int i = 0 ; i < g.lsizes[n] ; i++)
+                g.rank2node[r++] = n;
+        }
+    } else {                       /* next node with a free slot */
+        left = g.lsizes;
+        for (r = 0, n = 0 ; r < g.gsize ; n = (n + 1) % g.nnodes) {
+            if (left[n] > 0) {
+                left[n]--;
+                g.rank2node[r++] = n;
+            }
+        }
+    }
+
+    g.lstart.resize(g.nnodes + 1);
+    g.lstart[0] = 0;
+    for (n = 0 ; n < g.nnodes ; n++)
+        g.lstart[n + 1] = g.lstart[n] + g.lsizes[n];
+    g.l2g.resize(g.gsize);
+    pos.assign(g.lstart.begin(), g.lstart.end() - 1);
+    for (r = 0 ; r < g.gsize ; r++)   /* sorted, like our local comm */
+        g.l2g[pos[g.rank2node[r]]++] = r;
+
+    if (nx_r2n_build(&g.r2n, &g.rank2node[0], g.gsize, g.nnodes) < 0)
+        return(-1);
+
+    /* see nx_build_groups() */
+    g.grp.ngroups = 1;
+    g.grp.node2group = g.grp.gstart = g.grp.gnodes = NULL;
+    if (g.nnodes <= 1 || (g.grouphost <= 0 && g.groupsize <= 0))
+        return(0);
+    g.grp.node2group = (int *)malloc(sizeof(int) * g.nnodes);
+    if (!g.grp.node2group)
+        return(-1);
+    for (n = 0 ; n < g.nnodes ; n++) {
+        if (g.grouphost > 0) {
+            std::string key = g.hosts[n].substr(0, g.grouphost);
+            g.grp.node2group[n] = key2group.insert(std::make_pair(key,
+                                  (int)key2group.size())).first->second;
+        } else {
+            g.grp.node2group[n] = n / g.groupsize;
+        }
+    }
+    return(nx_groups_index(&g.grp, g.nnodes));
+}
+
+/*
+ * view_of: fill in rank grank's nx_rview.  grp is our copy of the
+ * groups with grank's node as mygroup.
+ */
+static void view_of(int grank, const int *n2s, const int *n2r,
+                    struct nx_groups *grp, struct nx_rview *rv) {
+    const int node = g.rank2node[grank];
+
+    *grp = g.grp;
+    if (grp->ngroups > 1) grp->mygroup = grp->node2group[node];
+    rv->grank = grank;
+    rv->nodeid = node;
+    rv->nnodes = g.nnodes;
+    rv->lsize = g.lsizes[node];
+    rv->nstripes = g.nstripes;
+    rv->nrails = g.nrails;
+    rv->local2global = &g.l2g[g.lstart[node]];
+    rv->rank2node = &g.rank2node[0];
+    rv->r2n = &g.r2n;
+    rv->grp = grp;
+    rv->node2srcrep = n2s + (size_t)node * g.nnodes;
+    rv->node2rep = (n2r) ? n2r + (size_t)node * g.nnodes * g.nstripes : NULL;
+}
+
+/*
+ * table_bytes: the memory nexus would use for rank grank's tables (see
+ * nexus_ctx and nx_snap).  with shared tables, the node's copy of
+ * rank2node[], node2rep[] and node2srcrep[] is counted on its local
+ * rank 0.
+ */
+static long table_bytes(int grank) {
+    const int node = g.rank2node[grank];
+    const int lsize = g.lsizes[node];
+    const long nslots = (long)g.nnodes * g.nstripes;
+    long b, shared;
+
+    b = lsize * MAPENT_SZ + lsize * sizeof(int);     /* lmap, l2g */
+    if (g.nnodes > 1)
+        b += nslots * MAPENT_SZ;                     /* rmap */
+    if (g.grp.ngroups > 1)
+        b += sizeof(int) * (2 * g.nnodes + g.grp.ngroups + 1);
+    if (g.rtab)
+        b += g.gsize * ROUTE_SZ;
+
+    shared = sizeof(int) * g.nnodes;                 /* node2srcrep */
+    if (g.nnodes > 1)
+        shared += sizeof(int) * nslots;              /* node2rep */
+    if (g.r2n.kind == NX_R2N_DENSE)
+        shared += sizeof(int) * g.gsize;
+    if (g.r2n.kind == NX_R2N_RUNS)                   /* never shared */
+        b += sizeof(int) * 2 * g.r2n.nruns;
+    if (!g.shm || g.l2g[g.lstart[node]] == grank)
+        b += shared;
+    return(b);
+}
+
+/*
+ * check_routes: walk the route of every (src, dst) pair.  every hop
+ * must be to a rank whose address the sender looked up and cross
+ * nodes only between paired reps, and the route must end at dst.
+ * counts relayed routes in st[].  return the number of bad routes.
+ */
+static long check_routes(const int *n2s, const int *n2r,
+                         std::vector<rankstat> &st) {
+    long bad = 0, nhops[MAXHOPS + 1], ntype[5], hopsum = 0;
+    struct nx_groups grp, pgrp;
+    struct nx_rview rv, pv;
+    int src, dst, cur, next, slot, h, t, maxh = 0;
+    const char *err;
+
+    memset(nhops, 0, sizeof(nhops));
+    memset(ntype, 0, sizeof(ntype));
+    for (src = 0 ; src < g.gsize ; src++) {
+        for (dst = 0 ; dst < g.gsize ; dst++) {
+            err = NULL;
+            for (cur = src, h = 0 ; !err ; cur = next, h++) {
+                view_of(cur, n2s, n2r, &grp, &rv);
+                t = nx_rv_step(&rv, dst, &next, &slot);
+                if (t == NX_HOP_DONE) break;
+                ntype[t]++;
+                if (h == MAXHOPS) {
+                    err = "too many hops";
+                } else if (t == NX_HOP_DESTREP || t == NX_HOP_GROUPREP) {
+                    /* next must be on a node we need, and pick us back */
+                    view_of(next, n2s, n2r, &pgrp, &pv);
+                    if (!nx_rv_rmap_needed(&rv, pv.nodeid) ||
+                        !nx_rv_rmap_needed(&pv, rv.nodeid) ||
+                        pv.local2global[nx_rv_srcrep_slot(&pv, rv.nodeid,
+                        slot % g.nstripes)] != next)
+                        err = "unpaired rep";
+                } else if (g.rank2node[next] != rv.nodeid) {
+                    err = "off node";
+                }
+                if (err)
+                    fprintf(stderr, "nexus-plan: %d->%d: %s %s hop "
+                            "%d->%d\n", src, dst, err, hopnames[t], cur,
+                            next);
+                else if (next != dst)
+                    st[next].relay++;
+            }
+            if (err) {
+                bad++;
+                continue;
+            }
+            nhops[h]++;
+            hopsum += h;
+            if (h > maxh) maxh = h;
+        }
+    }
+
+    printf("  routes: %ld checked, %ld bad, hops avg %.2f max %d\n",
+           (long)g.gsize * g.gsize, bad,
+           (double)hopsum / ((long)g.gsize * g.gsize - bad), maxh);
+    printf("  hops by type:");
+    for (t = NX_HOP_LOCAL ; t <= NX_HOP_GROUPREP ; t++)
+        printf(" %s %ld", hopnames[t], ntype[t]);
+    printf("\n  routes by hop count:");
+    for (h = 0 ; h <= maxh ; h++)
+        printf(" %d:%ld", h, nhops[h]);
+    printf("\n");
+    return(bad);
+}
+
+/*
+ * print_stat: print min, avg, and max of a per rank value
+ */
+static void print_stat(const char *name, const std::vector<double> &v) {
+    double min = v[0], max = v[0], sum = 0;
+
+    for (size_t i = 0 ; i < v.size() ; i++) {
+        if (v[i] < min) min = v[i];
+        if (v[i] > max) max = v[i];
+        sum += v[i];
+    }
+    printf("  %-22s min %.0f avg %.2f max %.0f\n", name, min,
+           sum / v.size(), max);
+}
+
+/*
+ * plan: build the tables for one rep policy and report on them.
+ * return the number of errors.
+ */
+static long plan(const char *pname, int policy) {
+    std::vector<int> n2s((size_t)g.nnodes * g.nnodes), n2r;
+    std::vector<rankstat> st(g.gsize);
+    std::vector<double> rp(g.gsize), conns(g.gsize), mem(g.gsize);
+    struct nx_repinfo ri;
+    struct nx_groups grp;
+    struct nx_rview rv;
+    long lookups = 0, total = 0, bad = 0;
+    int node, r, i, s, nslots, zero = 0;
+
+    /* each node applies the policy (nx_build_reps()) */
+    memset(&ri, 0, sizeof(ri));
+    ri.policy = policy;
+    ri.nnodes = g.nnodes;
+    ri.nrails = g.nrails;
+    ri.nstripes = g.nstripes;
+    ri.eligible = &g.eligible[0];
+    for (node = 0 ; node < g.nnodes ; node++) {
+        view_of(g.l2g[g.lstart[node]], NULL, NULL, &grp, &rv);
+        ri.nodeid = node;
+        ri.lsize = g.lsizes[node];
+        ri.grp = &grp;
+        if (nx_rep_fill(&ri, &n2s[(size_t)node * g.nnodes]) < 0)
+            return(1);
+    }
+
+    /* node2rep[] is what the rep alltoall in nx_build_rmap() gives us */
+    nslots = g.nnodes * g.nstripes;
+    if (g.check) {
+        n2r.resize((size_t)g.nnodes * nslots);
+        for (node = 0 ; node < g.nnodes ; node++) {
+            view_of(g.l2g[g.lstart[node]], &n2s[0], NULL, &grp, &rv);
+            for (i = 0 ; i < nslots ; i++) {
+                n2r[(size_t)(i / g.nstripes) * nslots +
+                    node * g.nstripes + i % g.nstripes] =
+                    rv.local2global[nx_rv_srcrep_slot(&rv, i / g.nstripes,
+                                                      i % g.nstripes)];
+            }
+        }
+    }
+
+    /* remote peers are the rmap slots nx_build_rmap() looks up */
+    for (r = 0 ; r < g.gsize ; r++) {
+        view_of(r, &n2s[0], NULL, &grp, &rv);
+        for (i = 0 ; i < g.nnodes ; i++) {
+            if (i == rv.nodeid || !nx_rv_rmap_needed(&rv, i)) continue;
+            for (s = 0 ; s < g.nstripes ; s++) {
+                if (rv.local2global[nx_rv_srcrep_slot(&rv, i, s)] == r)
+                    st[r].rpeers++;
+            }
+        }
+        st[r].bytes = table_bytes(r);
+        rp[r] = st[r].rpeers;
+        conns[r] = st[r].rpeers + rv.lsize - 1;
+        mem[r] = st[r].bytes;
+        lookups += st[r].rpeers;
+        total += st[r].bytes;
+        if (st[r].rpeers == 0) zero++;
+    }
+
+    printf("\npolicy %s:\n", pname);
+    print_stat("remote peers/rank", rp);
+    printf("  %-22s %d\n", "ranks w/o remote peers", zero);
+    print_stat("connections/rank", conns);
+    printf("  %-22s %ld\n", "remote lookups", lookups);
+    print_stat("table bytes/rank", mem);
+    printf("  %-22s %ld\n", "table bytes/job", total);
+
+    if (g.check) {
+        bad = check_routes(&n2s[0], &n2r[0], st);
+        for (r = 0 ; r < g.gsize ; r++)
+            rp[r] = st[r].relay;
+        print_stat("relayed routes/rank", rp);
+    }
+
+    if (g.verbose) {
+        printf("  rank node lrank rpeers conns bytes%s\n",
+               (g.check) ? " relay" : "");
+        for (r = 0 ; r < g.gsize ; r++) {
+            node = g.rank2node[r];
+            view_of(r, &n2s[0], NULL, &grp, &rv);
+            printf("  %d %d %d %d %d %ld", r, node, nx_rv_lmap_slot(&rv, r),
+                   st[r].rpeers, st[r].rpeers + g.lsizes[node] - 1,
+                   st[r].bytes);
+            if (g.check) printf(" %ld", st[r].relay);
+            printf("\n");
+        }
+    }
+    return(bad);
+}
+
+/*
+ * usage: nexus-plan [options] -n nnodes [-l lsize]
+ *        nexus-plan [options] -f hostfile
+ */
+int main(int argc, char **argv) {
+    const char *env, *hostfile = NULL;
+    static const char *r2nnames[] = { "dense", "block", "rr", "runs" };
+    char policies[256], *pname;
+    int opt, nnodes = 0, lsize = 1, minlsize, n, policy;
+    long bad = 0;
+
+    g.rr = 0;
+    g.nrails = 1;
+    g.nstripes = envint("NEXUS_STRIPES", 1);
+    g.groupsize = envint("NEXUS_GROUP_SIZE", 0);
+    g.grouphost = envint("NEXUS_GROUP_HOSTCHARS", 0);
+    g.shm = envint("NEXUS_SHM_TABLES", 0) > 0;
+    g.rtab = envint("NEXUS_ROUTE_TABLE", 0) > 0;
+    g.check = g.verbose = 0;
+    env = getenv("NEXUS_REP_POLICY");
+    snprintf(policies, sizeof(policies), "%s",
+             (env && env[0]) ? env : "modulo,balanced");
+
+    while ((opt = getopt(argc, argv, "cf:g:k:l:m:n:p:r:s:Stv")) != -1) {
+        switch (opt) {
+        case 'c':
+            g.check = 1;
+            break;
+        case 'f':
+            hostfile = optarg;
+            break;
+        case 'g':
+            g.groupsize = atoi(optarg);
+            break;
+        case 'k':
+            g.grouphost = atoi(optarg);
+            break;
+        case 'l':
+            lsize = atoi(optarg);
+            if (lsize < 1) usage("bad lsize");
+            break;
+        case 'm':
+            if (strcmp(optarg, "block") == 0)
+                g.rr = 0;
+            else if (strcmp(optarg, "rr") == 0)
+                g.rr = 1;
+            else
+                usage("bad layout");
+            break;
+        case 'n':
+            nnodes = atoi(optarg);
+            if (nnodes < 1) usage("bad node count");
+            break;
+        case 'p':
+            snprintf(policies, sizeof(policies), "%s", optarg);
+            break;
+        case 'r':
+            g.nrails = atoi(optarg);
+            if (g.nrails < 1 || g.nrails > NX_MAX_RAILS)
+                usage("bad rail count");
+            break;
+        case 's':
+            g.nstripes = atoi(optarg);
+            break;
+        case 'S':
+            g.shm = 1;
+            break;
+        case 't':
+            g.rtab = 1;
+            break;
+        case 'v':
+            g.verbose = 1;
+            break;
+        default:
+            usage(NULL);
+        }
+    }
+    if (optind != argc || (hostfile == NULL) == (nnodes == 0))
+        usage("need one of -n or -f");
+
+    if (hostfile) {
+        if (read_hostfile(hostfile, lsize) < 0) exit(1);
+        if (g.hosts.empty()) usage("empty hostfile");
+    } else {
+        for (n = 0 ; n < nnodes ; n++) {
+            char host[32];
+            snprintf(host, sizeof(host), "node%d", n);
+            g.hosts.push_back(host);
+            g.lsizes.push_back(lsize);
+        }
+    }
+    if (make_layout() < 0) {
+        fprintf(stderr, "nexus-plan: out of memory\n");
+        exit(1);
+    }
+
+    /* as in nexus_bootstrap() and nx_mpisetup() */
+    if (g.nstripes < 1) g.nstripes = 1;
+    for (minlsize = g.lsizes[0], n = 1 ; n < g.nnodes ; n++) {
+        if (g.lsizes[n] < minlsize) minlsize = g.lsizes[n];
+    }
+    if (g.nstripes > minlsize) g.nstripes = minlsize;
+    /* we can't see the nodes' nics, so every rank is near them all */
+    g.eligible.assign(g.gsize, (1 << g.nrails) - 1);
+
+    printf("layout: %d nodes, %d ranks (%s), rank2node %s\n", g.nnodes,
+           g.gsize, (g.rr) ? "round-robin" : "block", r2nnames[g.r2n.kind]);
+    printf("stripes %d, rails %d, groups %d%s%s\n", g.nstripes, g.nrails,
+           g.grp.ngroups, (g.shm) ? ", shm tables" : "",
+           (g.rtab) ? ", route table" : "");
+
+    for (pname = strtok(policies, ",") ; pname != NULL ;
+         pname = strtok(NULL, ",")) {
+        policy = nx_rep_policy_byname(pname);
+        if (policy < 0 || policy == NX_REP_USER) {
+            fprintf(stderr, "nexus-plan: can't plan rep policy %s\n", pname);
+            exit(1);
+        }
+        bad += plan(pname, policy);
+    }
+    exit((bad) ? 1 : 0);
+}
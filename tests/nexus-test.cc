@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <mpi.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "deltafs-nexus_api.h"
@@ -168,6 +169,7 @@ struct test_ctx {
     int ranksize;
 
     int count;
+    int async;      /* use split-phase bootstrap */
     char subnet[16];
     char proto[8];
 
@@ -186,6 +188,7 @@ static void usage(int ret)
     printf("usage: %s [options]\n"
            "\n"
            "options:\n"
+           " -a             use split-phase bootstrap\n"
            " -c count       number of RPCs to perform\n"
            " -p baseport    base port number\n"
            " -t proto       transport protocol\n"
@@ -237,13 +240,545 @@ void print_hg_addr(hg_class_t *hgcl, int rank, const char *str)
 }
 #endif
 
+/*
+ * check_prefetch: route to every rank (with NEXUS_LAZY the remote hops
+ * may be NX_PENDING), then prefetch them all and make sure nothing is
+ * pending after that
+ */
+static void check_prefetch(nexus_ctx_t nctx)
+{
+    int n = tctx.ranksize, rank;
+    hg_addr_t addr;
+    int *dests;
+
+    dests = (int *)malloc(n * sizeof(*dests));
+    if (!dests)
+        nx_fatal("check_prefetch malloc failed");
+
+    for (int i = 0; i < n; i++) {
+        dests[i] = i;
+        nexus_ret_t nret = nexus_next_hop(nctx, i, &rank, &addr);
+        if (nret == NX_ERROR || nret == NX_INVAL)
+            nx_fatal("nexus_next_hop failed");
+    }
+    if (nexus_prefetch(nctx, dests, n, 1) != NX_SUCCESS)
+        nx_fatal("nexus_prefetch failed");
+    for (int i = 0; i < n; i++) {
+        if (nexus_next_hop(nctx, i, &rank, &addr) == NX_PENDING)
+            nx_fatal("nexus_next_hop pending after nexus_prefetch");
+    }
+
+    free(dests);
+}
+
+/*
+ * check_batch: make sure nexus_next_hop_batch() agrees with
+ * nexus_next_hop() for every rank in the job (plus one bad rank)
+ */
+static void check_batch(nexus_ctx_t nctx)
+{
+    int n = tctx.ranksize + 1;
+    int *dests, *ranks;
+    hg_addr_t *addrs;
+    nexus_ret_t *types;
+
+    dests = (int *)malloc(n * sizeof(*dests));
+    ranks = (int *)malloc(n * sizeof(*ranks));
+    addrs = (hg_addr_t *)malloc(n * sizeof(*addrs));
+    types = (nexus_ret_t *)malloc(n * sizeof(*types));
+    if (!dests || !ranks || !addrs || !types)
+        nx_fatal("check_batch malloc failed");
+
+    for (int i = 0; i < n; i++)
+        dests[i] = n - 1 - i;    /* dests[0] is out of range */
+
+    if (nexus_next_hop_batch(nctx, dests, n, ranks, addrs, types) !=
+        NX_SUCCESS)
+        nx_fatal("nexus_next_hop_batch failed");
+
+    for (int i = 0; i < n; i++) {
+        int rank = -1;
+        hg_addr_t addr = HG_ADDR_NULL;
+        nexus_ret_t nret = nexus_next_hop(nctx, dests[i], &rank, &addr);
+
+        if (nret != types[i])
+            nx_fatal("nexus_next_hop_batch type mismatch");
+        if ((nret == NX_ISLOCAL || nret == NX_SRCREP || nret == NX_DESTREP ||
+             nret == NX_GROUPREP) && (rank != ranks[i] || addr != addrs[i]))
+            nx_fatal("nexus_next_hop_batch hop mismatch");
+    }
+
+    free(dests);
+    free(ranks);
+    free(addrs);
+    free(types);
+}
+
+/*
+ * check_threads: route to every rank from several threads while we
+ * keep replacing the tables (nexus_set_grank() republishes them when
+ * there is a route table) and make sure every thread sees the same
+ * hops as we did
+ */
+#define CHECK_NTHREADS 4
+
+struct check_hops {
+    nexus_ctx_t nctx;
+    int n;                               /* number of dests */
+    nexus_ret_t *types;                  /* expected hop of each dest */
+    int *ranks;
+    hg_addr_t *addrs;
+    int bad;                             /* set by a thread on mismatch */
+};
+
+static void *check_threads_main(void *arg)
+{
+    struct check_hops *ch = (struct check_hops *)arg;
+    int rank;
+    hg_addr_t addr;
+
+    for (int pass = 0; pass < 200; pass++) {
+        for (int i = 0; i < ch->n; i++) {
+            rank = -1;
+            addr = HG_ADDR_NULL;
+            if (nexus_next_hop(ch->nctx, i, &rank, &addr) != ch->types[i] ||
+                rank != ch->ranks[i] || addr != ch->addrs[i])
+                ch->bad = 1;
+        }
+    }
+    return NULL;
+}
+
+static void check_threads(nexus_ctx_t nctx)
+{
+    struct check_hops ch;
+    pthread_t thr[CHECK_NTHREADS];
+
+    ch.nctx = nctx;
+    ch.n = tctx.ranksize;
+    ch.types = (nexus_ret_t *)malloc(ch.n * sizeof(*ch.types));
+    ch.ranks = (int *)malloc(ch.n * sizeof(*ch.ranks));
+    ch.addrs = (hg_addr_t *)malloc(ch.n * sizeof(*ch.addrs));
+    ch.bad = 0;
+    if (!ch.types || !ch.ranks || !ch.addrs)
+        nx_fatal("check_threads malloc failed");
+
+    for (int i = 0; i < ch.n; i++) {
+        ch.ranks[i] = -1;
+        ch.addrs[i] = HG_ADDR_NULL;
+        ch.types[i] = nexus_next_hop(nctx, i, &ch.ranks[i], &ch.addrs[i]);
+        if (ch.types[i] == NX_PENDING)   /* lazy, don't let it change */
+            nx_fatal("check_threads: hop still pending");
+    }
+
+    for (int t = 0; t < CHECK_NTHREADS; t++) {
+        if (pthread_create(&thr[t], NULL, check_threads_main, &ch) != 0)
+            nx_fatal("check_threads: pthread_create failed");
+    }
+    for (int i = 0; i < 50; i++) {
+        if (nexus_set_grank(nctx, tctx.myrank) != NX_SUCCESS)
+            nx_fatal("nexus_set_grank failed");
+        usleep(100);
+    }
+    for (int t = 0; t < CHECK_NTHREADS; t++)
+        pthread_join(thr[t], NULL);
+    if (ch.bad)
+        nx_fatal("check_threads: threads saw a different hop");
+
+    free(ch.types);
+    free(ch.ranks);
+    free(ch.addrs);
+}
+
+/*
+ * check_repair: drop the last rank and make sure nobody routes through
+ * it anymore, then refresh it and make sure we are back to the hops we
+ * started with
+ */
+static void check_repair(nexus_ctx_t nctx)
+{
+    int n = tctx.ranksize, victim = tctx.ranksize - 1, rank;
+    hg_addr_t addr;
+    nexus_ret_t *types, nret;
+    int *ranks;
+
+    types = (nexus_ret_t *)malloc(n * sizeof(*types));
+    ranks = (int *)malloc(n * sizeof(*ranks));
+    if (!types || !ranks)
+        nx_fatal("check_repair malloc failed");
+
+    for (int i = 0; i < n; i++) {
+        ranks[i] = -1;
+        types[i] = nexus_next_hop(nctx, i, &ranks[i], &addr);
+    }
+
+    if (nexus_repair(nctx, &victim, 1, 1) != NX_SUCCESS)
+        nx_fatal("nexus_repair drop failed");
+    for (int i = 0; i < n; i++) {
+        rank = -1;
+        nret = nexus_next_hop(nctx, i, &rank, &addr);
+        if (nret == NX_ERROR || nret == NX_INVAL)
+            nx_fatal("nexus_next_hop failed after drop");
+        if (nret != NX_DONE && nret != NX_NOTFOUND && nret != NX_PENDING &&
+            rank == victim)
+            nx_fatal("check_repair: routed to a dropped rank");
+    }
+
+    if (nexus_repair(nctx, &victim, 1, 0) != NX_SUCCESS)
+        nx_fatal("nexus_repair refresh failed");
+    for (int i = 0; i < n; i++) {
+        rank = -1;
+        nret = nexus_next_hop(nctx, i, &rank, &addr);
+        if (nret != types[i] || (nret != NX_DONE && rank != ranks[i]))
+            nx_fatal("check_repair: hops changed after refresh");
+    }
+
+    free(types);
+    free(ranks);
+}
+
+/*
+ * check_stats: if NEXUS_STATS is set, route to every rank once and
+ * make sure the counters (and their per slot and reduced forms) add up
+ */
+static void check_stats(nexus_ctx_t nctx)
+{
+    nexus_stats_t st;
+    nexus_stats_summary_t sum;
+    uint64_t total = 0, *slots;
+    int nl, nr;
+
+    nexus_stats_reset(nctx);
+    if (nexus_stats(nctx, &st) != NX_SUCCESS)
+        return;                          /* not counting */
+
+    for (int i = 0; i < tctx.ranksize; i++) {
+        int rank;
+        hg_addr_t addr;
+        nexus_next_hop(nctx, i, &rank, &addr);
+    }
+    if (nexus_stats(nctx, &st) != NX_SUCCESS)
+        nx_fatal("nexus_stats failed");
+    for (int i = 0; i < NEXUS_STATS_NTYPES; i++)
+        total += st.hops[i];
+    if (total != (uint64_t)tctx.ranksize || st.hops[NX_DONE] != 1)
+        nx_fatal("nexus_stats bad hop counts");
+
+    nl = nexus_stats_slots(nctx, 1, NULL, 0);
+    nr = nexus_stats_slots(nctx, 0, NULL, 0);
+    if (nl >= 0) {
+        slots = (uint64_t *)malloc((nl + nr + 1) * sizeof(*slots));
+        if (!slots)
+            nx_fatal("check_stats malloc failed");
+        nexus_stats_slots(nctx, 1, slots, nl);
+        nexus_stats_slots(nctx, 0, slots + nl, nr);
+        for (int i = 0; i < nl + nr; i++)
+            total -= slots[i];
+        if (total != st.hops[NX_DONE] + st.hops[NX_NOTFOUND] +
+                     st.hops[NX_DIRECT])
+            nx_fatal("nexus_stats_slots bad counts");
+        free(slots);
+    }
+
+    if (nexus_stats_reduce(nctx, &sum) != NX_SUCCESS)
+        nx_fatal("nexus_stats_reduce failed");
+    if (sum.hops[NX_DONE].min != 1 || sum.hops[NX_DONE].max != 1 ||
+        sum.hops[NX_SRCREP].min > st.hops[NX_SRCREP] ||
+        sum.hops[NX_SRCREP].max < st.hops[NX_SRCREP] ||
+        sum.hops[NX_DESTREP].max < st.hops[NX_DESTREP])
+        nx_fatal("nexus_stats_reduce bad summary");
+    if (nl >= 0 && (sum.inbound.avg < sum.hops[NX_ISLOCAL].avg +
+                                      sum.hops[NX_SRCREP].avg - 0.001 ||
+                    sum.inbound.avg > sum.hops[NX_ISLOCAL].avg +
+                                      sum.hops[NX_SRCREP].avg + 0.001))
+        nx_fatal("nexus_stats_reduce bad inbound");
+    nexus_stats_reset(nctx);
+}
+
+/*
+ * check_partition: make sure nexus_partition() puts each dest in the
+ * queue of its next hop
+ */
+static void check_partition(nexus_ctx_t nctx)
+{
+    int n = tctx.ranksize, nq = nexus_partition_nqueues(nctx);
+    int *dests, *offsets, *perm;
+
+    dests = (int *)malloc(n * sizeof(*dests));
+    offsets = (int *)malloc((nq + 1) * sizeof(*offsets));
+    perm = (int *)malloc(n * sizeof(*perm));
+    if (!dests || !offsets || !perm)
+        nx_fatal("check_partition malloc failed");
+
+    for (int i = 0; i < n; i++)
+        dests[i] = rand() % n;
+
+    if (nexus_partition(nctx, dests, n, offsets, perm) != NX_SUCCESS)
+        nx_fatal("nexus_partition failed");
+    if (offsets[0] != 0 || offsets[nq] != n || offsets[nq - 1] != n)
+        nx_fatal("nexus_partition bad offsets");
+
+    for (int q = 0; q < nq - 1; q++) {
+        int qrank = -1;
+        hg_addr_t qaddr = HG_ADDR_NULL;
+        nexus_ret_t qret;
+
+        if (offsets[q] == offsets[q + 1])
+            continue;
+        qret = nexus_partition_queue(nctx, q, &qrank, &qaddr);
+        if ((q < nexus_local_size(nctx)) ? qret != NX_ISLOCAL
+                : (qret != NX_DESTREP && qret != NX_GROUPREP &&
+                   qret != NX_DIRECT))
+            nx_fatal("nexus_partition_queue failed");
+
+        for (int j = offsets[q]; j < offsets[q + 1]; j++) {
+            int rank = -1;
+            hg_addr_t addr = HG_ADDR_NULL;
+            nexus_ret_t nret = nexus_next_hop(nctx, dests[perm[j]],
+                                              &rank, &addr);
+            if (nret == NX_DONE)
+                rank = tctx.myrank;
+            if (qret == NX_DIRECT) {    /* each dest is its own hop */
+                if (nret != NX_DIRECT || rank != dests[perm[j]])
+                    nx_fatal("nexus_partition direct queue mismatch");
+            } else if (rank != qrank || (nret != NX_DONE && addr != qaddr))
+                nx_fatal("nexus_partition queue mismatch");
+            if (j > offsets[q] && perm[j] < perm[j - 1])
+                nx_fatal("nexus_partition order mismatch");
+        }
+    }
+
+    free(dests);
+    free(offsets);
+    free(perm);
+}
+
+/*
+ * check_export: make sure nexus_export() has the peers nexus_iter()
+ * walks and that their queues lead to them
+ */
+static void check_export(nexus_ctx_t nctx)
+{
+    for (int local = 0; local < 2; local++) {
+        const nexus_export_t *ents;
+        nexus_iter_t nit;
+        int n, i;
+
+        ents = nexus_export(nctx, local, &n);
+        if (n < 0 || (n > 0 && !ents) || nexus_export(nctx, local, &i) != ents)
+            nx_fatal("nexus_export failed");
+        nit = nexus_iter(nctx, local);
+        for (i = 0; i < n; i++) {
+            int qrank = -1;
+            hg_addr_t qaddr = HG_ADDR_NULL;
+
+            if (ents[i].addr == HG_ADDR_NULL)
+                continue;                  /* lazy, nexus_iter() skips it */
+            if (nexus_iter_atend(nit) ||
+                ents[i].addr != nexus_iter_addr(nit) ||
+                ents[i].grank != nexus_iter_globalrank(nit) ||
+                ents[i].subrank != nexus_iter_subrank(nit) ||
+                ents[i].rail != nexus_iter_rail(nit))
+                nx_fatal("nexus_export iter mismatch");
+            nexus_partition_queue(nctx, ents[i].queue, &qrank, &qaddr);
+            if (qrank != ents[i].grank || qaddr != ents[i].addr)
+                nx_fatal("nexus_export queue mismatch");
+            nexus_iter_advance(nit);
+        }
+        if (!nexus_iter_atend(nit))
+            nx_fatal("nexus_export missing entries");
+        nexus_iter_free(&nit);
+    }
+}
+
+/*
+ * check_inbound: gather everyone's next hops, follow every route in the
+ * job, and make sure nexus_inbound() lists exactly the ranks (and hop
+ * types) that hand us a message along the way
+ */
+static void check_inbound(nexus_ctx_t nctx)
+{
+    int n = tctx.ranksize, me = tctx.myrank, ni;
+    int *mine, *hops, *seen;
+    nexus_inbound_t *peers;
+    hg_addr_t addr;
+
+    mine = (int *)malloc(2 * n * sizeof(*mine));
+    hops = (int *)malloc(2 * n * n * sizeof(*hops));
+    seen = (int *)calloc(n * NEXUS_STATS_NTYPES, sizeof(*seen));
+    if (!mine || !hops || !seen)
+        nx_fatal("check_inbound malloc failed");
+
+    for (int d = 0; d < n; d++) {
+        mine[2 * d] = -1;
+        mine[2 * d + 1] = nexus_next_hop(nctx, d, &mine[2 * d], &addr);
+    }
+    if (MPI_Allgather(mine, 2 * n, MPI_INT, hops, 2 * n, MPI_INT,
+                      MPI_COMM_WORLD) != MPI_SUCCESS)
+        nx_fatal("check_inbound allgather failed");
+
+    /* seen: 1 if a sender hands us its own messages, 2 if remote ones */
+    for (int src = 0; src < n; src++) {
+        int remote = (mine[2 * src + 1] != NX_ISLOCAL && src != me);
+        for (int d = 0; d < n; d++) {
+            int cur = src, mid = 0;
+            for (int step = 0; cur != d && step < 8; step++) {
+                int nxt = hops[2 * (cur * n + d)];
+                int type = hops[2 * (cur * n + d) + 1];
+                if (type == NX_NOTFOUND || type == NX_DONE)
+                    break;
+                if (nxt == me)
+                    seen[cur * NEXUS_STATS_NTYPES + type] |=
+                        (remote && mid) ? 2 : 1;
+                cur = nxt;
+                mid = 1;
+            }
+        }
+    }
+
+    ni = nexus_inbound(nctx, NULL, 0);
+    peers = (nexus_inbound_t *)malloc((ni + 1) * sizeof(*peers));
+    if (!peers || nexus_inbound(nctx, peers, ni + 1) != ni)
+        nx_fatal("nexus_inbound failed");
+    for (int i = 0; i < ni; i++) {
+        int *sp = &seen[peers[i].grank * NEXUS_STATS_NTYPES + peers[i].type];
+        int islocal = (peers[i].type == NX_ISLOCAL ||
+                       peers[i].type == NX_SRCREP);
+        if (!*sp || (islocal && !peers[i].nlinks != !(*sp & 2)) ||
+            (islocal != (peers[i].rail < 0)))
+            nx_fatal("nexus_inbound lists a bad peer");
+        *sp = 0;
+    }
+    for (int i = 0; i < n * NEXUS_STATS_NTYPES; i++) {
+        if (seen[i])
+            nx_fatal("nexus_inbound missed a peer");
+    }
+
+    free(mine);
+    free(hops);
+    free(seen);
+    free(peers);
+}
+
+/*
+ * check_shared: bootstrap two contexts with nexus' topology (the
+ * second from the first) on the same progressors, make sure they route
+ * like nctx, and make sure the second still does after the first one
+ * is gone
+ */
+static void check_shared(nexus_ctx_t nctx)
+{
+    progressor_handle_t *rails[8];
+    int n = tctx.ranksize, nr = nexus_nrails(nctx), rank, rank2;
+    nexus_ctx_t s1, s2;
+    hg_addr_t addr;
+
+    for (int i = 0; i < nr && i < 8; i++)
+        rails[i] = nexus_railprogressor(nctx, i);
+    s1 = nexus_bootstrap_shared(nctx, rails, nr, nexus_localprogressor(nctx));
+    if (!s1)
+        nx_fatal("nexus_bootstrap_shared failed");
+    s2 = nexus_bootstrap_shared(s1, rails, nr, nexus_localprogressor(nctx));
+    if (!s2)
+        nx_fatal("nexus_bootstrap_shared from a shared context failed");
+    if (nexus_global_rank(s2) != tctx.myrank ||
+        nexus_local_size(s2) != nexus_local_size(nctx))
+        nx_fatal("nexus_bootstrap_shared bad ranks");
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1)
+            nexus_destroy(s1);
+        for (int d = 0; d < n; d++) {
+            nexus_ret_t nret = nexus_next_hop(nctx, d, &rank, &addr);
+            nexus_ret_t sret = nexus_next_hop(s2, d, &rank2, &addr);
+            if (sret == NX_PENDING &&
+                nexus_prefetch(s2, &d, 1, 1) == NX_SUCCESS)
+                sret = nexus_next_hop(s2, d, &rank2, &addr);
+            if (sret != nret || (nret != NX_DONE && rank2 != rank))
+                nx_fatal("shared context routes differently");
+        }
+    }
+    nexus_destroy(s2);
+}
+
+/*
+ * check_comm: bootstrap over half of the job (our rank's parity) with
+ * our own split of it for localcomm, then gather the sub context's next
+ * hops and make sure every route in it gets to its dest
+ */
+static void check_comm(nexus_ctx_t nctx)
+{
+    progressor_handle_t *rails[8];
+    int nr = nexus_nrails(nctx), n, me, ls;
+    int *mine, *hops;
+    MPI_Comm sub, local;
+    nexus_ctx_t sctx;
+    hg_addr_t addr;
+
+    if (MPI_Comm_split(MPI_COMM_WORLD, tctx.myrank % 2, tctx.myrank,
+                       &sub) != MPI_SUCCESS ||
+        MPI_Comm_split_type(sub, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                            &local) != MPI_SUCCESS)
+        nx_fatal("check_comm split failed");
+    MPI_Comm_rank(sub, &me);
+    MPI_Comm_size(sub, &n);
+    MPI_Comm_size(local, &ls);
+
+    for (int i = 0; i < nr && i < 8; i++)
+        rails[i] = nexus_railprogressor(nctx, i);
+    sctx = nexus_bootstrap_comm(sub, local, rails, nr,
+                                nexus_localprogressor(nctx));
+    if (!sctx)
+        nx_fatal("nexus_bootstrap_comm failed");
+    if (nexus_global_rank(sctx) != me || nexus_global_size(sctx) != n ||
+        nexus_local_size(sctx) != ls)
+        nx_fatal("nexus_bootstrap_comm bad ranks");
+
+    mine = (int *)malloc(2 * n * sizeof(*mine));
+    hops = (int *)malloc(2 * n * n * sizeof(*hops));
+    if (!mine || !hops)
+        nx_fatal("check_comm malloc failed");
+    for (int d = 0; d < n; d++) {
+        mine[2 * d] = -1;
+        mine[2 * d + 1] = nexus_next_hop(sctx, d, &mine[2 * d], &addr);
+        if (mine[2 * d + 1] == NX_PENDING &&
+            nexus_prefetch(sctx, &d, 1, 1) == NX_SUCCESS)
+            mine[2 * d + 1] = nexus_next_hop(sctx, d, &mine[2 * d], &addr);
+    }
+    if (MPI_Allgather(mine, 2 * n, MPI_INT, hops, 2 * n, MPI_INT,
+                      sub) != MPI_SUCCESS)
+        nx_fatal("check_comm allgather failed");
+
+    for (int d = 0; d < n; d++) {
+        int cur = me, step;
+        for (step = 0; cur != d && step < 8; step++) {
+            int nxt = hops[2 * (cur * n + d)];
+            int type = hops[2 * (cur * n + d) + 1];
+            if (type == NX_NOTFOUND || type == NX_DONE || type == NX_PENDING ||
+                nxt < 0 || nxt >= n)
+                break;
+            cur = nxt;
+        }
+        if (cur != d || hops[2 * (d * n + d) + 1] != NX_DONE)
+            nx_fatal("nexus_bootstrap_comm route does not reach its dest");
+    }
+
+    free(mine);
+    free(hops);
+    nexus_destroy(sctx);
+    MPI_Comm_free(&local);
+    MPI_Comm_free(&sub);
+}
+
 int main(int argc, char **argv)
 {
-    int c, lr, ls, lbase;
+    int c, lr, ls, lbase, provided, polls;
     char *end, *myurl = NULL;
     hg_class_t *cls = NULL;
     hg_context_t *ctx = NULL;
     progressor_handle_t *prg = NULL;
+    nexus_boot_t boot;
+    nexus_ret_t bret;
 
     me = argv[0];
 
@@ -252,6 +787,7 @@ int main(int argc, char **argv)
 
     /* set default parameter values */
     tctx.count = 2;
+    tctx.async = 0;
 
     if (snprintf(tctx.subnet, sizeof(tctx.subnet), "127.0.0.1") <= 0)
       nx_fatal("sprintf for subnet failed");
@@ -259,10 +795,13 @@ int main(int argc, char **argv)
     if (snprintf(tctx.proto, sizeof(tctx.proto), "bmi+tcp") <= 0)
       nx_fatal("sprintf for proto failed");
 
-    while ((c = getopt(argc, argv, "c:t:s:h")) != -1) {
+    while ((c = getopt(argc, argv, "ac:t:s:h")) != -1) {
         switch(c) {
         case 'h': /* print help */
             usage(0);
+        case 'a': /* split-phase bootstrap */
+            tctx.async = 1;
+            break;
         case 'c': /* number of RPCs to transport */
             tctx.count = strtol(optarg, &end, 10);
             if (*end) {
@@ -287,7 +826,9 @@ int main(int argc, char **argv)
         }
     }
 
-    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) {
+    if (MPI_Init_thread(&argc, &argv, tctx.async ? MPI_THREAD_MULTIPLE
+                                                 : MPI_THREAD_SINGLE,
+                        &provided) != MPI_SUCCESS) {
         perror("Error: MPI_Init failed");
         exit(1);
     }
@@ -301,6 +842,7 @@ int main(int argc, char **argv)
         printf("\tTrials = %d\n", tctx.count);
         printf("\tSubnet = %s\n", tctx.subnet);
         printf("\tProtocol = %s\n", tctx.proto);
+        printf("\tBootstrap = %s\n", tctx.async ? "split-phase" : "blocking");
     }
 
     if (strcmp(tctx.proto, "bmi+tcp") == 0) {
@@ -331,11 +873,40 @@ int main(int argc, char **argv)
         goto error;
     }
 
-    if (!(tctx.nctx = nexus_bootstrap(prg, NULL))) {
+    if (tctx.async) {
+        if (!(boot = nexus_bootstrap_start(prg, NULL))) {
+            fprintf(stderr, "Error: nexus_bootstrap_start failed\n");
+            goto error;
+        }
+        /* pretend to do our own setup while nexus bootstraps */
+        for (polls = 0;
+             (bret = nexus_bootstrap_test(boot, &tctx.nctx)) == NX_PENDING;
+             polls++) {
+            usleep(1000);
+        }
+        if (bret != NX_SUCCESS) {
+            fprintf(stderr, "Error: nexus_bootstrap_test failed\n");
+            goto error;
+        }
+        if (!tctx.myrank)
+            printf("\tBootstrap polls = %d (MPI thread level %d)\n",
+                   polls, provided);
+    } else if (!(tctx.nctx = nexus_bootstrap(prg, NULL))) {
         fprintf(stderr, "Error: nexus_bootstrap failed\n");
         goto error;
     }
 
+    check_prefetch(tctx.nctx);
+    check_batch(tctx.nctx);
+    check_partition(tctx.nctx);
+    check_export(tctx.nctx);
+    check_inbound(tctx.nctx);
+    check_threads(tctx.nctx);
+    check_repair(tctx.nctx);
+    check_stats(tctx.nctx);
+    check_shared(tctx.nctx);
+    check_comm(tctx.nctx);
+
     for (int i = 1; i <= tctx.count; i++) {
         int srcrep = -1, dstrep = -1, dest = -1;
         int src = tctx.myrank;
@@ -36,5 +36,19 @@ if [ $? != 0 ]; then
     exit 1
 fi
 
+#
+# again with the split-phase bootstrap
+#
+rm -Rf /tmp/na_sm
+rm -Rf /dev/shm/na_sm*
+sleep 1
+
+do_mpirun $MPI_PROCS 4 "" "$BUILD_PREFIX/tests/nexus-test -a -s 10.92"
+
+if [ $? != 0 ]; then
+    echo "Nexus split-phase bootstrap test failed ($?)"
+    exit 1
+fi
+
 echo "Nexus test successful"
 exit 0